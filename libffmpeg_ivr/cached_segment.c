@@ -20,11 +20,19 @@
 **/
 
 
+#define _GNU_SOURCE
 #include <float.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <math.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "libavutil/avassert.h"
 #include "libavutil/mathematics.h"
@@ -33,6 +41,8 @@
 #include "libavutil/opt.h"
 #include "libavutil/log.h"
 #include "libavutil/fifo.h"
+#include "libavutil/time.h"
+#include "libavutil/md5.h"
 
 #include "libavformat/avformat.h"
     
@@ -46,31 +56,455 @@ void avpriv_set_pts_info(AVStream *s, int pts_wrap_bits,
 
 #define MIN(a,b) ((a) > (b) ? (b) : (a))
 
+#define CSEG_INTERRUPT_CHECK_MS 100   // max blocking time before checking interrupt callback
+#define CSEG_WRITER_POLL_MS 10        // max blocking time in writer poll() before checking new segment
+#define CSEG_MAX_BATCH_SEGMENTS 16    // max segments passed to write_segments() at once
+
+//////////////////////////
+//chunk pool operation
+
+#define CHUNK_ARENA_SIZE (4 * 1024 * 1024)   /* address space mapped at a time, multiple of huge page */
+#define CHUNKS_PER_ARENA (CHUNK_ARENA_SIZE / CSEG_CHUNK_SIZE)
+#define CHUNK_POOL_MAX_COMMITTED_FREE 1024   /* max number of free chunks keeping their pages */
+#define CHUNK_POOL_TRIM_INTERVAL 1000000     /* in micro-seconds */
+
+/* 
+ * lazily mapped memory for chunks, its pages are only committed by the kernel 
+ * when the chunk is written for the first time
+ */
+typedef struct CachedChunkArena {
+    struct CachedChunkArena *next;
+    uint8_t *base;
+    int hugetlb;        /* backed by hugetlb pages */
+    int nb_used;        /* chunks carved from this arena */
+    CachedSegmentChunk chunks[CHUNKS_PER_ARENA];
+} CachedChunkArena;
+
+/* chunk pool shared by all the segments of the process */
+typedef struct CachedChunkPool {
+    pthread_mutex_t lock;
+    CachedChunkArena *arenas;
+    CachedSegmentChunk *free_chunks;      /* free chunks with resident pages, hottest first */
+    CachedSegmentChunk *released_chunks;  /* free chunks whose pages has been released */
+    int nb_free;            /* number of free_chunks */
+    int max_free;           /* max number of free_chunks, the excess are released */
+    int64_t nb_arenas;
+    int64_t nb_committed;   /* chunks whose pages may be resident */
+    int64_t nb_in_use;      /* chunks held by segments */
+    
+    CachedChunkArena *carving[2];   /* arenas being carved, [1] for the ones with huge pages */
+    int mlock_failed;       /* mlock failed once, e.g. over RLIMIT_MEMLOCK, not tried again */
+    int nb_idle_outputs;    /* outputs releasing their idle chunks, the pool is trimmed if any */
+    int64_t last_trim_time;
+} CachedChunkPool;
+
+static CachedChunkPool chunk_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, 
+    .max_free = CHUNK_POOL_MAX_COMMITTED_FREE,
+};
+
+static int chunk_arena_map(CachedChunkArena * arena, int hugepage)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    
+    arena->base = MAP_FAILED;
+    arena->hugetlb = 0;
+#ifdef MAP_HUGETLB
+    if(hugepage){
+        //reserved at map, not to get SIGBUS on the first touch without free huge pages
+        arena->base = mmap(NULL, CHUNK_ARENA_SIZE, PROT_READ | PROT_WRITE, 
+                           (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+        if(arena->base != MAP_FAILED){
+            arena->hugetlb = 1;
+            return 0;
+        }
+    }
+#endif
+    //no memset, the pages are zero-filled by kernel on the first touch
+    arena->base = mmap(NULL, CHUNK_ARENA_SIZE, PROT_READ | PROT_WRITE, 
+                       flags, -1, 0);
+    if(arena->base == MAP_FAILED){
+        return AVERROR(errno);
+    }
+#ifdef MADV_HUGEPAGE
+    if(hugepage){
+        //no hugetlb pages reserved, fall back to transparent huge page
+        madvise(arena->base, CHUNK_ARENA_SIZE, MADV_HUGEPAGE);
+    }
+#endif
+    return 0;
+}
+
+/* must be called with chunk pool locked, hugepage is from the output taking the chunk */
+static CachedSegmentChunk * chunk_pool_carve(int hugepage)
+{
+    CachedChunkArena * arena = chunk_pool.carving[hugepage];
+    CachedSegmentChunk * chunk;
+    int ret;
+    
+    if(arena == NULL || arena->nb_used == CHUNKS_PER_ARENA){
+        arena = av_mallocz(sizeof(CachedChunkArena));
+        if(arena == NULL){
+            return NULL;
+        }
+        if((ret = chunk_arena_map(arena, hugepage)) < 0){
+            av_log(NULL, AV_LOG_ERROR, "[cseg] mmap chunk arena failed with errno(%d)\n", AVUNERROR(ret));
+            av_free(arena);
+            return NULL;
+        }
+        arena->next = chunk_pool.arenas;
+        chunk_pool.arenas = arena;
+        chunk_pool.carving[hugepage] = arena;
+        chunk_pool.nb_arenas++;
+    }
+    chunk = &arena->chunks[arena->nb_used];
+    chunk->data = arena->base + (int64_t)arena->nb_used * CSEG_CHUNK_SIZE;
+    chunk->committed = 0;
+    chunk->pinned = arena->hugetlb;
+    arena->nb_used++;
+    return chunk;
+}
+
+/* 
+ * must be called with chunk pool locked, 
+ * return the chain of free chunks which has been idle for too long
+ */
+static CachedSegmentChunk * chunk_pool_collect_idle(int64_t now)
+{
+    CachedSegmentChunk * idle = NULL;
+    CachedSegmentChunk ** pprev = &chunk_pool.free_chunks;
+    
+    if(chunk_pool.nb_idle_outputs <= 0 || 
+       now - chunk_pool.last_trim_time < CHUNK_POOL_TRIM_INTERVAL){
+        return NULL;
+    }
+    chunk_pool.last_trim_time = now;
+    
+    while(*pprev != NULL){
+        CachedSegmentChunk * chunk = *pprev;
+        if(!chunk->pinned && chunk->idle_time > 0 && 
+           now - chunk->idle_since >= chunk->idle_time){
+            *pprev = chunk->next;
+            chunk->next = idle;
+            idle = chunk;
+            chunk_pool.nb_free--;
+        }else{
+            pprev = &chunk->next;
+        }
+    }
+    return idle;
+}
+
+/* give back the pages of a chain of free chunks to system, called without lock */
+static void chunk_pool_release(CachedSegmentChunk * first)
+{
+    CachedSegmentChunk * chunk;
+    
+    for(chunk = first; chunk != NULL; chunk = chunk->next){
+        if(chunk->pinned){
+            continue;
+        }
+        if(chunk->locked){
+            munlock(chunk->data, CSEG_CHUNK_SIZE);
+            chunk->locked = 0;
+        }
+        madvise(chunk->data, CSEG_CHUNK_SIZE, MADV_DONTNEED);
+    }
+    
+    pthread_mutex_lock(&chunk_pool.lock);
+    while(first != NULL){
+        chunk = first;
+        first = chunk->next;
+        if(chunk->pinned){
+            //its pages cannot be released, keep it hot
+            chunk->next = chunk_pool.free_chunks;
+            chunk_pool.free_chunks = chunk;
+            chunk_pool.nb_free++;
+            continue;
+        }
+        chunk->committed = 0;
+        chunk_pool.nb_committed--;
+        chunk->next = chunk_pool.released_chunks;
+        chunk_pool.released_chunks = chunk;
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+}
+
+/* 
+ * pre-commit nb_chunks chunks into the free list of pool, 
+ * flags and idle_time are the same as the segments of the output
+ */
+static int chunk_pool_prewarm(int nb_chunks, int flags, int64_t idle_time)
+{
+    CachedSegmentChunk * chunk;
+    int page_size = getpagesize();
+    int i, off;
+    int64_t now = av_gettime_relative();
+    
+    pthread_mutex_lock(&chunk_pool.lock);
+    for(i = 0; i < nb_chunks; i++){
+        chunk = chunk_pool_carve((flags & CSEG_FLAG_HUGEPAGE) != 0);
+        if(chunk == NULL){
+            break;
+        }
+        if((flags & CSEG_FLAG_MLOCK) && !chunk->pinned && !chunk_pool.mlock_failed && 
+           mlock(chunk->data, CSEG_CHUNK_SIZE) == 0){
+            //pages are faulted in by mlock 
+            chunk->locked = 1;
+        }else{
+            for(off = 0; off < CSEG_CHUNK_SIZE; off += page_size){
+                chunk->data[off] = 0;
+            }
+        }
+        chunk->committed = 1;
+        chunk->idle_since = now;
+        chunk->idle_time = idle_time;
+        chunk_pool.nb_committed++;
+        chunk->next = chunk_pool.free_chunks;
+        chunk_pool.free_chunks = chunk;
+        chunk_pool.nb_free++;
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+    
+    return i == nb_chunks ? 0 : AVERROR(ENOMEM);
+}
+
+/* take a chunk for a segment, flags are pool_flags of the segment */
+static CachedSegmentChunk * chunk_pool_get(int flags)
+{
+    CachedSegmentChunk * chunk = NULL;
+    int lock_pages = 0, unlock_pages = 0;
+    
+    pthread_mutex_lock(&chunk_pool.lock);
+    if(chunk_pool.free_chunks != NULL){
+        chunk = chunk_pool.free_chunks;
+        chunk_pool.free_chunks = chunk->next;
+        chunk_pool.nb_free--;
+    }else if(chunk_pool.released_chunks != NULL){
+        chunk = chunk_pool.released_chunks;
+        chunk_pool.released_chunks = chunk->next;
+    }else{
+        chunk = chunk_pool_carve((flags & CSEG_FLAG_HUGEPAGE) != 0);
+    }
+    if(chunk != NULL){
+        if(!chunk->committed){
+            //would be committed by the coming write
+            chunk->committed = 1;
+            chunk_pool.nb_committed++;
+        }
+        chunk_pool.nb_in_use++;
+        chunk->next = NULL;
+        chunk->size = 0;
+        lock_pages = (flags & CSEG_FLAG_MLOCK) && !chunk->locked && !chunk->pinned && 
+                     !chunk_pool.mlock_failed;
+        unlock_pages = !(flags & CSEG_FLAG_MLOCK) && chunk->locked;
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+    
+    //the chunk is owned by the caller now, (un)lock its pages outside the lock
+    if(unlock_pages){
+        munlock(chunk->data, CSEG_CHUNK_SIZE);
+        chunk->locked = 0;
+    }else if(lock_pages){
+        if(mlock(chunk->data, CSEG_CHUNK_SIZE) == 0){
+            chunk->locked = 1;
+        }else{
+            av_log(NULL, AV_LOG_WARNING, "[cseg] mlock chunk failed with errno(%d), disable mlock\n", errno);
+            pthread_mutex_lock(&chunk_pool.lock);
+            chunk_pool.mlock_failed = 1;
+            pthread_mutex_unlock(&chunk_pool.lock);
+        }
+    }
+    
+    return chunk;
+}
+
+/* 
+ * give back a chain of chunks to pool, the free chunks are released 
+ * after idle for idle_time of their output, 0 for never
+ */
+static void chunk_pool_put(CachedSegmentChunk * first, int release_pages, int64_t idle_time)
+{
+    CachedSegmentChunk * chunk;
+    CachedSegmentChunk * idle;
+    int64_t now = av_gettime_relative();
+    
+    pthread_mutex_lock(&chunk_pool.lock);
+    while(first != NULL && !release_pages && 
+          chunk_pool.nb_free < chunk_pool.max_free){
+        chunk = first;
+        first = chunk->next;
+        chunk->next = chunk_pool.free_chunks;
+        chunk->idle_since = now;
+        chunk->idle_time = idle_time;
+        chunk_pool.free_chunks = chunk;
+        chunk_pool.nb_free++;
+        chunk_pool.nb_in_use--;
+    }
+    for(chunk = first; chunk != NULL; chunk = chunk->next){
+        chunk->idle_since = now;
+        chunk_pool.nb_in_use--;
+    }
+    idle = chunk_pool_collect_idle(now);
+    pthread_mutex_unlock(&chunk_pool.lock);
+    
+    //the left chunks give back their pages, outside the lock
+    if(first != NULL){
+        chunk_pool_release(first);
+    }
+    if(idle != NULL){
+        chunk_pool_release(idle);
+    }
+}
+
+/* 
+ * attach a cseg muxer to the shared pool, its huge page, mlock and idle time 
+ * only apply to the chunks of its segments, undone by chunk_pool_detach()
+ */
+static int chunk_pool_attach(CachedSegmentContext *cseg)
+{
+    int nb_chunks;
+    
+    nb_chunks = (int)(((int64_t)cseg->pool_seg_size + CSEG_CHUNK_SIZE - 1) / CSEG_CHUNK_SIZE);
+    if(cseg->pool_size <= 0 || nb_chunks <= 0){
+        nb_chunks = 0;
+    }
+    
+    pthread_mutex_lock(&chunk_pool.lock);
+    cseg->pool_attached = 1;
+    if(cseg->pool_idle_time > 0.0){
+        chunk_pool.nb_idle_outputs++;
+    }
+    //the pre-warmed chunks are kept hot by raising max_free until detach
+    cseg->pool_prewarmed = cseg->pool_size * nb_chunks;
+    chunk_pool.max_free += cseg->pool_prewarmed;
+    pthread_mutex_unlock(&chunk_pool.lock);
+    
+    if(cseg->pool_prewarmed > 0){
+        return chunk_pool_prewarm(cseg->pool_prewarmed, cseg->flags, 
+                                  (int64_t)(cseg->pool_idle_time * 1000000.0));
+    }
+    return 0;
+}
+
+/* undo chunk_pool_attach(), called after the segments of cseg are freed */
+static void chunk_pool_detach(CachedSegmentContext *cseg)
+{
+    CachedSegmentChunk * excess = NULL;
+    CachedSegmentChunk * chunk;
+    
+    if(!cseg->pool_attached){
+        return;
+    }
+    pthread_mutex_lock(&chunk_pool.lock);
+    cseg->pool_attached = 0;
+    if(cseg->pool_idle_time > 0.0){
+        chunk_pool.nb_idle_outputs--;
+    }
+    chunk_pool.max_free -= cseg->pool_prewarmed;
+    cseg->pool_prewarmed = 0;
+    while(chunk_pool.nb_free > chunk_pool.max_free){
+        chunk = chunk_pool.free_chunks;
+        chunk_pool.free_chunks = chunk->next;
+        chunk_pool.nb_free--;
+        chunk->next = excess;
+        excess = chunk;
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+    
+    if(excess != NULL){
+        chunk_pool_release(excess);
+    }
+}
+
+/* 
+ * release the free chunks idle for too long, called by the idle consumers, 
+ * return the time of the next trim, 0 if no output releases its idle chunks
+ */
+static int64_t chunk_pool_trim(void)
+{
+    CachedSegmentChunk * idle;
+    int64_t next = 0;
+    
+    pthread_mutex_lock(&chunk_pool.lock);
+    idle = chunk_pool_collect_idle(av_gettime_relative());
+    if(chunk_pool.nb_idle_outputs > 0){
+        next = chunk_pool.last_trim_time + CHUNK_POOL_TRIM_INTERVAL;
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+    
+    if(idle != NULL){
+        chunk_pool_release(idle);
+    }
+    return next;
+}
+
+void cached_chunk_pool_stat(int64_t *reserved, int64_t *committed, int64_t *in_use)
+{
+    pthread_mutex_lock(&chunk_pool.lock);
+    if(reserved){
+        *reserved = chunk_pool.nb_arenas * CHUNK_ARENA_SIZE;
+    }
+    if(committed){
+        *committed = chunk_pool.nb_committed * CSEG_CHUNK_SIZE;
+    }
+    if(in_use){
+        *in_use = chunk_pool.nb_in_use * CSEG_CHUNK_SIZE;
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+}
+
+
 //////////////////////////
 //segment operation
 
-CachedSegment * cached_segment_alloc(uint32_t max_size)
+CachedSegment * cached_segment_alloc(uint32_t max_size, int release_pages)
 {
     CachedSegment * s;
-    s = av_mallocz(sizeof(CachedSegment) + max_size);
+    s = av_mallocz(sizeof(CachedSegment));
+    if(s == NULL){
+        return NULL;
+    }
     s->next = NULL;
     s->buffer_max_size = max_size;
+    s->release_pages = release_pages;
     s->start_ts = -1.0;
     s->duration = 0.0;
-    //s->buffer = av_malloc(max_size);
     s->size = 0;
     s->start_dts = AV_NOPTS_VALUE;
+    s->nb_chunks = 0;
+    s->first_chunk = s->last_chunk = NULL;
+    s->journal_index = -1;
+    s->journal_state = CSEG_JOURNAL_NONE;
     
-/*    
-    av_log(NULL, AV_LOG_WARNING, 
-           "new segment(size:%d) allocated\n",
-           max_size);
-*/
     return s;    
 }
+
+static void cached_segment_release_chunks(CachedSegment * segment)
+{
+    if(segment->first_chunk != NULL){
+        chunk_pool_put(segment->first_chunk, segment->release_pages, segment->pool_idle_time);
+    }
+    segment->first_chunk = segment->last_chunk = NULL;
+    segment->nb_chunks = 0;
+}
+
+/* allocate a segment taking its chunks with the pool options of cseg */
+static CachedSegment * cseg_segment_alloc(CachedSegmentContext *cseg, uint32_t max_size)
+{
+    CachedSegment * s = cached_segment_alloc(max_size, (cseg->flags & CSEG_FLAG_RELEASE_PAGES) != 0);
+    if(s != NULL){
+        s->pool_flags = cseg->flags & (CSEG_FLAG_HUGEPAGE | CSEG_FLAG_MLOCK);
+        s->pool_idle_time = (int64_t)(cseg->pool_idle_time * 1000000.0);
+    }
+    return s;
+}
+
 void cached_segment_free(CachedSegment * segment)
 {
-    //av_free(segment->buffer);
+    cached_segment_release_chunks(segment);
+    av_freep(&segment->writer_data);
+    av_freep(&segment->md5);
     av_free(segment);
 }
 
@@ -84,19 +518,140 @@ void cached_segment_reset(CachedSegment * segment)
     segment->size = 0;
     segment->start_dts = AV_NOPTS_VALUE;
     segment->next_dts = AV_NOPTS_VALUE;
+    segment->state = CSEG_SEGMENT_IDLE;
+    segment->upload_ret = 0;
+    segment->has_md5 = 0;
+    segment->recording = 0;
+    segment->streamed = 0;
+    segment->stream_ret = 0;
+    segment->dropped = 0;
+    segment->stream_chunk = NULL;
+    segment->stream_chunk_pos = 0;
+    segment->journal_index = -1;
+    segment->journal_state = CSEG_JOURNAL_NONE;
+    if(segment->md5){
+        av_md5_init(segment->md5);
+    }
+    cached_segment_release_chunks(segment);
+}
+
+int cached_segment_iov(CachedSegment *segment, int start_chunk, 
+                       struct iovec *iov, int max_iov)
+{
+    CachedSegmentChunk * chunk = segment->first_chunk;
+    int i = 0;
+    
+    while(chunk != NULL && start_chunk > 0){
+        chunk = chunk->next;
+        start_chunk--;
+    }
+    for(; chunk != NULL && i < max_iov; chunk = chunk->next){
+        iov[i].iov_base = chunk->data;
+        iov[i].iov_len = chunk->size;
+        i++;
+    }
+    return i;
+}
+
+/* append a chain of nb_chunks new empty chunks to segment */
+static void cached_segment_link_chunks(CachedSegment * segment, CachedSegmentChunk * first, 
+                                       CachedSegmentChunk * last, int nb_chunks)
+{
+    if(segment->last_chunk){
+        //the streaming reader may follow the link at the same time
+        __atomic_store_n(&segment->last_chunk->next, first, __ATOMIC_RELEASE);
+    }else{
+        segment->first_chunk = first;
+    }
+    segment->last_chunk = last;
+    segment->nb_chunks += nb_chunks;
+}
+
+/* append a new empty chunk to segment, return NULL if no memory */
+static CachedSegmentChunk * cached_segment_add_chunk(CachedSegment * segment)
+{
+    CachedSegmentChunk * chunk = chunk_pool_get(segment->pool_flags);
+    if(chunk == NULL){
+        return NULL;
+    }
+    cached_segment_link_chunks(segment, chunk, chunk, 1);
+    return chunk;
 }
+
 int write_segment(void *opaque, uint8_t *buf, int buf_size)
 {  
     CachedSegment * segment = (CachedSegment *) opaque;
-    if((segment->buffer_max_size - segment->size) < buf_size){
+    CachedSegmentChunk * chunk = segment->last_chunk;
+    CachedSegmentChunk * first = NULL, * last = NULL;
+    int left = buf_size;
+    int tail, nb_new, i;
+    
+    if(segment->buffer_max_size != 0 && 
+       (segment->buffer_max_size - segment->size) < buf_size){
         return -1;
     }
-    memcpy(segment->buffer + segment->size, buf, buf_size);
+    
+    //take all the chunks needed before any data is published, 
+    //so that a failure leaves the segment unchanged
+    tail = chunk != NULL ? CSEG_CHUNK_SIZE - chunk->size : 0;
+    nb_new = buf_size > tail ? (buf_size - tail + CSEG_CHUNK_SIZE - 1) / CSEG_CHUNK_SIZE : 0;
+    for(i = 0; i < nb_new; i++){
+        CachedSegmentChunk * new_chunk = chunk_pool_get(segment->pool_flags);
+        if(new_chunk == NULL){
+            if(first != NULL){
+                chunk_pool_put(first, segment->release_pages, segment->pool_idle_time);
+            }
+            return AVERROR(ENOMEM);
+        }
+        if(last != NULL){
+            last->next = new_chunk;
+        }else{
+            first = new_chunk;
+        }
+        last = new_chunk;
+    }
+    
+    if(chunk == NULL || chunk->size == CSEG_CHUNK_SIZE){
+        chunk = first;
+    }
+    if(first != NULL){
+        cached_segment_link_chunks(segment, first, last, nb_new);
+    }
+    while(left > 0){
+        int len;
+        if(chunk->size == CSEG_CHUNK_SIZE){
+            chunk = chunk->next;
+        }
+        len = MIN(left, CSEG_CHUNK_SIZE - chunk->size);
+        memcpy(chunk->data + chunk->size, buf, len);
+        __atomic_store_n(&chunk->size, chunk->size + len, __ATOMIC_RELEASE);
+        buf += len;
+        left -= len;
+    }
+    if(segment->md5){
+        av_md5_update(segment->md5, buf - buf_size, buf_size);
+    }
     segment->size += buf_size;
 
     return buf_size;
 } 
 
+static void notify_stream_reader(CachedSegmentContext *cseg);
+
+/* AVIO write callback of the inner muxer, copy the data into the current segment */
+static int write_cur_segment(void *opaque, uint8_t *buf, int buf_size)
+{
+    CachedSegmentContext *cseg = (CachedSegmentContext *)opaque;
+    CachedSegment * segment = cseg->cur_segment;
+    int ret;
+    
+    ret = write_segment(segment, buf, buf_size);
+    if(ret >= 0 && segment->recording){
+        notify_stream_reader(cseg);
+    }
+    return ret;
+}
+
 
 //////////////////////////
 //segment list operation
@@ -150,236 +705,2616 @@ void free_segment_list(CachedSegmentList *seg_list)
 }
 
 
+//////////////////////////
+//segment ring operation
+int init_segment_ring(CachedSegmentRing *ring, uint32_t min_capacity)
+{
+    uint32_t capacity = 1;
+    while(capacity < min_capacity){
+        capacity <<= 1;
+    }
+    ring->slots = av_mallocz(sizeof(CachedSegment *) * capacity);
+    if(ring->slots == NULL){
+        return AVERROR(ENOMEM);
+    }
+    ring->mask = capacity - 1;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+int put_segment_ring(CachedSegmentRing *ring, CachedSegment * segment)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    
+    if(tail - head > ring->mask){
+        return -1; //full
+    }
+    segment->next = NULL;
+    ring->slots[tail & ring->mask] = segment;
+    //publish the slot content before the new tail
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+CachedSegment * peek_segment_ring(CachedSegmentRing *ring, uint32_t index)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    
+    if(tail - head <= index){
+        return NULL;
+    }
+    return ring->slots[(head + index) & ring->mask];
+}
+
+CachedSegment * get_segment_ring(CachedSegmentRing *ring)
+{
+    CachedSegment * segment = peek_segment_ring(ring, 0);
+    if(segment == NULL){
+        return NULL;
+    }
+    ring->slots[ring->head & ring->mask] = NULL;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    return segment;
+}
+
+uint32_t segment_ring_count(CachedSegmentRing *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
+
+void free_segment_ring(CachedSegmentRing *ring)
+{
+    CachedSegment * segment;
+    if(ring->slots == NULL){
+        return;
+    }
+    while((segment = get_segment_ring(ring)) != NULL){
+        cached_segment_free(segment);
+    }
+    av_freep(&ring->slots);
+    ring->mask = 0;
+    ring->head = ring->tail = 0;
+}
+
+
+
+/////////////////////////////
+//writer operations 
+static CachedSegmentWriter * first_writer = NULL;
+
+void register_segment_writer(CachedSegmentWriter * writer)
+{
+    writer->next = first_writer;
+    first_writer = writer;
+}
+static CachedSegmentWriter *find_segment_writer(char * filename)
+{
+    char hostname[1024], hoststr[1024], proto[16];
+    char auth[1024];
+    char path[MAX_URL_SIZE];
+    int port, i;
+    CachedSegmentWriter * writer;
+    
+
+    av_url_split(proto, sizeof(proto), auth, sizeof(auth),
+                 hostname, sizeof(hostname), &port,
+                 path, sizeof(path), filename);
+    if(strlen(proto) == 0){
+        //no protocol, means file
+        strcpy(proto, "file");
+    }
+    for(writer = first_writer; writer != NULL; writer = writer->next){
+        if(av_match_name(proto, writer->protos)){
+            return writer;
+        }        
+    }
+    return NULL;
+    
+}
+
+//////////////////////////
+//durability of local files
+
+/* a file in the group commit, on the stack of the thread waiting for it */
+typedef struct CachedSyncWaiter {
+    struct CachedSyncWaiter *next;
+    int fd;
+    int ret;
+    int done;
+} CachedSyncWaiter;
+
+/* 
+ * the local files written by all the cseg instances of the process since the last commit, 
+ * they are synced together by the first waiter whose interval is up
+ */
+typedef struct CachedSyncGroup {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* a commit is done */
+    CachedSyncWaiter *waiters;
+    int64_t start_time;         /* when the first of waiters joined */
+} CachedSyncGroup;
+
+static CachedSyncGroup sync_group = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, 
+    .cond = PTHREAD_COND_INITIALIZER, 
+};
+
+static int sync_fd(int fd)
+{
+    int ret;
+    
+    while(fdatasync(fd) < 0){
+        if(errno != EINTR){
+            ret = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "[cseg] fdatasync() failed with errno(%d)\n", errno);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* fdatasync() each file of waiters once, the segments of a file share its result */
+static void sync_group_commit(CachedSyncWaiter *waiters)
+{
+    CachedSyncWaiter *w, *prev;
+    
+    for(w = waiters; w != NULL; w = w->next){
+        for(prev = waiters; prev != w && prev->fd != w->fd; prev = prev->next){
+        }
+        w->ret = (prev != w) ? prev->ret : sync_fd(w->fd);
+    }
+}
+
+int cached_file_sync(int fd, int64_t offset, int64_t len, int durability, int interval)
+{
+    CachedSyncWaiter waiter, *waiters, *w;
+    int64_t deadline, abs_time;
+    struct timespec ts;
+    
+    if(durability == CSEG_DURABILITY_NONE){
+        return 0;
+    }else if(durability == CSEG_DURABILITY_SEGMENT){
+        return sync_fd(fd);
+    }
+    
+    //start writeback at once, the commit finds the data mostly on disk
+    sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.fd = fd;
+    pthread_mutex_lock(&sync_group.lock);
+    if(sync_group.waiters == NULL){
+        sync_group.start_time = av_gettime_relative();
+    }
+    waiter.next = sync_group.waiters;
+    sync_group.waiters = &waiter;
+    while(!waiter.done){
+        deadline = sync_group.start_time + (int64_t)interval * 1000;
+        if(sync_group.waiters == NULL){
+            //being committed by another thread
+            pthread_cond_wait(&sync_group.cond, &sync_group.lock);
+        }else if(av_gettime_relative() >= deadline){
+            waiters = sync_group.waiters;
+            sync_group.waiters = NULL;
+            pthread_mutex_unlock(&sync_group.lock);
+            
+            sync_group_commit(waiters);
+            
+            pthread_mutex_lock(&sync_group.lock);
+            for(w = waiters; w != NULL; w = w->next){
+                w->done = 1;
+            }
+            pthread_cond_broadcast(&sync_group.cond);
+        }else{
+            //the condition uses the realtime clock
+            abs_time = av_gettime() + (deadline - av_gettime_relative());
+            ts.tv_sec = abs_time / 1000000;
+            ts.tv_nsec = (abs_time % 1000000) * 1000;
+            pthread_cond_timedwait(&sync_group.cond, &sync_group.lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&sync_group.lock);
+    
+    return waiter.ret;
+}
+
+int cached_dir_sync(const char *path, int durability)
+{
+    char dir[MAX_URL_SIZE];
+    const char *p;
+    int fd, ret = 0;
+    
+    if(durability == CSEG_DURABILITY_NONE){
+        return 0;
+    }
+    p = strrchr(path, '/');
+    if(p == NULL){
+        av_strlcpy(dir, ".", sizeof(dir));
+    }else if(p == path){
+        av_strlcpy(dir, "/", sizeof(dir));
+    }else{
+        av_strlcpy(dir, path, FFMIN(p - path + 1, sizeof(dir)));
+    }
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0){
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[cseg] open directory %s for sync failed with errno(%d)\n", 
+               dir, errno);
+        return ret;
+    }
+    while(fsync(fd) < 0){
+        if(errno != EINTR){
+            ret = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "[cseg] fsync() directory %s failed with errno(%d)\n", 
+                   dir, errno);
+            break;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+////////////////////////////
+//cseg format operations
+
+static int ff_check_interrupt(AVIOInterruptCB *cb)
+{
+    int ret;
+    if (cb && cb->callback && (ret = cb->callback(cb->opaque)))
+        return ret;
+    return 0;
+}
+
+
+static void notify_fd(int fd)
+{
+    eventfd_write(fd, 1);
+}
+
+static void drain_fd(int fd)
+{
+    eventfd_t value;
+    eventfd_read(fd, &value);
+}
+
+static void executor_schedule(CachedSegmentContext *cseg);
+
+/* wakeup the consumer of cseg, either its own thread or the shared executor */
+static void wakeup_consumer(CachedSegmentContext *cseg)
+{
+    if(cseg->on_executor){
+        executor_schedule(cseg);
+    }else{
+        notify_fd(cseg->not_empty_fd);
+    }
+}
+
+/* wakeup the consumer waiting for the data of the live segment */
+static void notify_stream_reader(CachedSegmentContext *cseg)
+{
+    //pairs with the fence in cached_segment_stream_read()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&cseg->stream_waiting, __ATOMIC_RELAXED)){
+        wakeup_consumer(cseg);
+    }
+}
+
+int cached_segment_stream_read(CachedSegmentContext *cseg, CachedSegment *segment, 
+                               uint8_t *buf, int buf_size)
+{
+    CachedSegmentChunk * chunk, * next;
+    struct pollfd pfd;
+    int recording, len;
+    
+    pfd.fd = cseg->not_empty_fd;
+    pfd.events = POLLIN;
+    
+    while(1){
+        //all the data is visible once recording is seen cleared
+        recording = __atomic_load_n(&segment->recording, __ATOMIC_ACQUIRE);
+        
+        if(segment->stream_chunk == NULL){
+            segment->stream_chunk = segment->first_chunk;
+            segment->stream_chunk_pos = 0;
+        }
+        chunk = segment->stream_chunk;
+        while(chunk != NULL){
+            len = __atomic_load_n(&chunk->size, __ATOMIC_ACQUIRE) - segment->stream_chunk_pos;
+            if(len > 0){
+                len = MIN(len, buf_size);
+                memcpy(buf, chunk->data + segment->stream_chunk_pos, len);
+                segment->stream_chunk_pos += len;
+                __atomic_store_n(&cseg->stream_waiting, 0, __ATOMIC_RELAXED);
+                return len;
+            }
+            next = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+            if(next == NULL){
+                break;
+            }
+            chunk = segment->stream_chunk = next;
+            segment->stream_chunk_pos = 0;
+        }
+        
+        if(!recording){
+            __atomic_store_n(&cseg->stream_waiting, 0, __ATOMIC_RELAXED);
+            return 0;
+        }else if(!__atomic_load_n(&cseg->consumer_active, __ATOMIC_ACQUIRE)){
+            __atomic_store_n(&cseg->stream_waiting, 0, __ATOMIC_RELAXED);
+            return AVERROR_EXIT;
+        }
+        if(!__atomic_load_n(&cseg->stream_waiting, __ATOMIC_RELAXED)){
+            //check the data again after telling the muxer to wake us up
+            __atomic_store_n(&cseg->stream_waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            continue;
+        }
+        //woken up by muxer, the timeout is only for the muxer exit checking
+        if(poll(&pfd, 1, CSEG_INTERRUPT_CHECK_MS) > 0){
+            drain_fd(cseg->not_empty_fd);
+        }
+    }
+    return 0;
+}
+
+/* called by the muxer thread only */
+static CachedSegment * get_free_segment(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment = NULL;
+    
+    segment = get_segment_list(&(cseg->free_list));
+    if(segment == NULL){
+        //take back the segments written by consumer
+        while((segment = get_segment_ring(&cseg->recycle_ring)) != NULL){
+            put_segment_list(&(cseg->free_list), segment);
+        }
+        segment = get_segment_list(&(cseg->free_list));        
+    }
+    if(segment != NULL){
+        cached_segment_reset(segment);
+    }else{
+        segment = cseg_segment_alloc(cseg, cseg->max_seg_size);
+    }
+    return segment;
+}
+
+/* called by the muxer thread only */
+static void recycle_free_segment(CachedSegmentContext *cseg, CachedSegment * segment)
+{
+    cached_segment_reset(segment);
+    put_segment_list(&(cseg->free_list), segment);        
+}
+
+/* called by the consumer thread only */
+static void recycle_written_segment(CachedSegmentContext *cseg, CachedSegment * segment)
+{
+    cached_segment_reset(segment);
+    if(put_segment_ring(&cseg->recycle_ring, segment)){
+        cached_segment_free(segment);
+    }
+}
+
+/* called by the consumer thread after removing segments from cached_ring */
+static void notify_producer(CachedSegmentContext *cseg)
+{
+    //pairs with the fence in wait_cached_ring_space()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&cseg->producer_waiting, __ATOMIC_RELAXED) &&
+       segment_ring_count(&cseg->cached_ring) <= cseg->low_nb_segments){
+        notify_fd(cseg->not_full_fd);
+    }
+}
+
+/* block the muxer until cached_ring drains to the low watermark */
+static int wait_cached_ring_space(AVFormatContext *s)
+{
+    CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
+    struct pollfd pfd;
+    int64_t wait_start, wait_time;
+    int ret = 0;
+    
+    pfd.fd = cseg->not_full_fd;
+    pfd.events = POLLIN;
+    wait_start = av_gettime_relative();
+    
+    __atomic_store_n(&cseg->producer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while(segment_ring_count(&cseg->cached_ring) > cseg->low_nb_segments){
+        if (ff_check_interrupt(&s->interrupt_callback)){ 
+            ret = AVERROR_EXIT;
+            break;
+        }else if(cseg->consumer_exit_code){
+            ret = cseg->consumer_exit_code;
+            break;
+        }
+        //woken up by consumer, the timeout is only for interrupt checking
+        if(poll(&pfd, 1, CSEG_INTERRUPT_CHECK_MS) > 0){
+            drain_fd(cseg->not_full_fd);
+        }
+    }
+    __atomic_store_n(&cseg->producer_waiting, 0, __ATOMIC_RELAXED);
+    
+    wait_time = av_gettime_relative() - wait_start;
+    cseg->wait_count++;
+    cseg->wait_total_us += wait_time;
+    if(wait_time > cseg->wait_max_us){
+        cseg->wait_max_us = wait_time;
+    }
+    return ret;
+}
+
+/* 
+ * withdraw the segment being recorded from streaming, called by the muxer thread only, 
+ * return 1 if the consumer has taken it, which must be passed to cached ring then
+ */
+static int withdraw_live_segment(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    if(!segment->recording){
+        return 0;
+    }
+    return __atomic_exchange_n(&cseg->live_segment, NULL, __ATOMIC_ACQ_REL) != segment;
+}
+
+//////////////////////////
+//local disk spool and journal
+
+#define SPOOL_RECORD_MAGIC 0x4c505343   /* "CSPL" */
+#define SPOOL_STATE_MAGIC  0x54535343   /* "CSST" */
+#define SPOOL_RECORD_DONE  (1 << 0)     /* written, backfilled or given up */
+#define SPOOL_RECORD_MD5   (1 << 1)     /* md5 is valid */
+#define SPOOL_RECORD_LIVE  (1 << 2)     /* journaled segment still handled by the consumer of this run */
+#define SPOOL_RECORD_NO_DATA (1 << 3)   /* journaled, its data is not written and synced yet */
+#define SPOOL_DATA_FILE  "spool.dat"
+#define SPOOL_INDEX_FILE "spool.idx"
+#define SPOOL_STATE_FILE "spool.state"
+#define SPOOL_MAX_SPILLS 8   /* max segments handed over to spool thread and not written yet */
+
+/* one record in spool.idx for each spooled segment, the data is at offset of spool.dat */
+typedef struct CachedSpoolRecord {
+    uint32_t magic;
+    uint32_t flags;
+    int32_t size;
+    int32_t reserved;
+    int64_t offset;
+    int64_t sequence;
+    int64_t pos;
+    double start_ts;
+    double duration;
+    int64_t next_dts;
+    uint8_t md5[16];
+} CachedSpoolRecord;
+
+/* content of spool.state, overwritten in place, kept across the compaction of spool */
+typedef struct CachedSpoolState {
+    uint32_t magic;
+    uint32_t reserved;
+    int64_t next_sequence;
+    char writer_state[CSEG_WRITER_STATE_SIZE];
+} CachedSpoolState;
+
+static int spool_pwrite(int fd, const void *buf, size_t size, int64_t offset)
+{
+    const uint8_t * p = buf;
+    ssize_t written;
+    
+    while(size > 0){
+        written = pwrite(fd, p, size, offset);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        p += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int spool_pread(int fd, void *buf, size_t size, int64_t offset)
+{
+    uint8_t * p = buf;
+    ssize_t nread;
+    
+    while(size > 0){
+        nread = pread(fd, p, size, offset);
+        if(nread < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return AVERROR(errno);
+        }else if(nread == 0){
+            return AVERROR(EIO); //truncated by others
+        }
+        p += nread;
+        size -= nread;
+        offset += nread;
+    }
+    return 0;
+}
+
+static int spool_set_flags(CachedSegmentSpool *spool, int index, uint32_t flags)
+{
+    return spool_pwrite(spool->index_fd, &flags, sizeof(flags), 
+                        (int64_t)index * sizeof(CachedSpoolRecord) + offsetof(CachedSpoolRecord, flags));
+}
+
+/* drop all the records and data once every record is done, called with spool locked */
+static void spool_compact(CachedSegmentSpool *spool)
+{
+    if(spool->nb_pending != 0 || spool->nb_writing != 0){
+        return;
+    }
+    if(ftruncate(spool->index_fd, 0) == 0 && ftruncate(spool->data_fd, 0) == 0){
+        spool->nb_records = spool->head = 0;
+        spool->data_size = 0;
+        spool->pending_size = 0;
+    }
+}
+
+/* persist the next sequence and writer state for the journal, called with spool locked */
+static void spool_save_state(CachedSegmentSpool *spool)
+{
+    CachedSpoolState state;
+    
+    if(spool->state_fd < 0){
+        return;
+    }
+    memset(&state, 0, sizeof(state));
+    state.magic = SPOOL_STATE_MAGIC;
+    state.next_sequence = spool->next_sequence;
+    av_strlcpy(state.writer_state, spool->writer_state, CSEG_WRITER_STATE_SIZE);
+    if(spool_pwrite(spool->state_fd, &state, sizeof(state), 0) < 0){
+        av_log(NULL, AV_LOG_WARNING, "[cseg] save journal state failed with errno(%d)\n", errno);
+    }
+}
+
+/* 
+ * save the state and make spool.idx and spool.state durable if they are dirty, 
+ * called by spool thread without lock, the syncs are never done with lock held
+ */
+static void spool_sync(CachedSegmentSpool *spool)
+{
+    int index_dirty, state_dirty;
+    
+    pthread_mutex_lock(&spool->lock);
+    index_dirty = spool->index_dirty;
+    state_dirty = spool->state_dirty;
+    spool->index_dirty = spool->state_dirty = 0;
+    if(state_dirty){
+        spool_save_state(spool);
+    }
+    pthread_mutex_unlock(&spool->lock);
+    
+    if(index_dirty && fdatasync(spool->index_fd) < 0){
+        av_log(NULL, AV_LOG_WARNING, "[cseg] sync spool index failed with errno(%d)\n", errno);
+    }
+    if(state_dirty && spool->state_fd >= 0 && fdatasync(spool->state_fd) < 0){
+        av_log(NULL, AV_LOG_WARNING, "[cseg] sync journal state failed with errno(%d)\n", errno);
+    }
+}
+
+/* let spool thread sync spool.idx and/or spool.state, called with spool locked */
+static void spool_mark_dirty(CachedSegmentSpool *spool, int index_dirty, int state_dirty)
+{
+    spool->index_dirty |= index_dirty;
+    spool->state_dirty |= state_dirty;
+    pthread_cond_signal(&spool->cond);
+}
+
+static void spool_close(CachedSegmentContext *cseg)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    
+    if(!spool->active){
+        return;
+    }
+    if(spool->has_thread){
+        //the segments handed over are written before it exits
+        pthread_mutex_lock(&spool->lock);
+        spool->thread_exit = 1;
+        pthread_cond_signal(&spool->cond);
+        pthread_mutex_unlock(&spool->lock);
+        pthread_join(spool->thread, NULL);
+        spool->has_thread = 0;
+    }
+    spool_sync(spool);
+    if(spool->nb_pending > 0){
+        av_log(NULL, AV_LOG_WARNING, "[cseg] %d segments(%"PRId64" bytes) left in spool %s\n", 
+               spool->nb_pending, spool->pending_size, cseg->spool_dir);
+    }
+    if(spool->segment != NULL){
+        cached_segment_free(spool->segment);
+        spool->segment = NULL;
+    }
+    if(spool->state_fd >= 0){
+        close(spool->state_fd);
+    }
+    close(spool->index_fd);   //the lock is released with it
+    close(spool->data_fd);
+    av_freep(&spool->jobs);
+    pthread_cond_destroy(&spool->done_cond);
+    pthread_cond_destroy(&spool->cond);
+    pthread_mutex_destroy(&spool->lock);
+    spool->active = 0;
+}
+
+static void * spool_routine(void *arg);
+
+
+/* 
+ * open the spool in cseg_spool_dir, the segments left by the last run, 
+ * including the journaled ones not written before it stopped, are backfilled. 
+ * The spool is locked so that only one output uses it.
+ */
+static int spool_open(CachedSegmentContext *cseg)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    CachedSpoolRecord record;
+    CachedSpoolState state;
+    char path[MAX_URL_SIZE];
+    struct stat st;
+    int ret, i, nb_lost;
+    
+    memset(spool, 0, sizeof(CachedSegmentSpool));
+    spool->data_fd = spool->index_fd = spool->state_fd = -1;
+    spool->journal = (cseg->flags & CSEG_FLAG_JOURNAL) != 0;
+    
+    if(mkdir(cseg->spool_dir, 0755) < 0 && errno != EEXIST){
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[cseg] create spool directory %s failed\n", cseg->spool_dir);
+        goto fail;
+    }
+    snprintf(path, sizeof(path), "%s/" SPOOL_INDEX_FILE, cseg->spool_dir);
+    spool->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(spool->index_fd < 0){
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[cseg] open spool index %s failed\n", path);
+        goto fail;
+    }
+    if(flock(spool->index_fd, LOCK_EX | LOCK_NB) < 0){
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[cseg] spool %s is used by another output\n", cseg->spool_dir);
+        goto fail;
+    }
+    snprintf(path, sizeof(path), "%s/" SPOOL_DATA_FILE, cseg->spool_dir);
+    spool->data_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(spool->data_fd < 0){
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[cseg] open spool data %s failed\n", path);
+        goto fail;
+    }
+    if(spool->journal){
+        snprintf(path, sizeof(path), "%s/" SPOOL_STATE_FILE, cseg->spool_dir);
+        spool->state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(spool->state_fd < 0){
+            ret = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "[cseg] open journal state %s failed\n", path);
+            goto fail;
+        }
+        if(spool_pread(spool->state_fd, &state, sizeof(state), 0) == 0 && 
+           state.magic == SPOOL_STATE_MAGIC){
+            spool->has_state = 1;
+            spool->next_sequence = state.next_sequence;
+            av_strlcpy(spool->writer_state, state.writer_state, CSEG_WRITER_STATE_SIZE);
+        }
+    }
+    
+    //recover the records of the last run, a torn record at the end is discarded
+    if(fstat(spool->data_fd, &st) < 0){
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    spool->data_size = st.st_size;
+    if(fstat(spool->index_fd, &st) < 0){
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    spool->nb_records = st.st_size / sizeof(CachedSpoolRecord);
+    spool->head = -1;
+    nb_lost = 0;
+    for(i = 0; i < spool->nb_records; i++){
+        ret = spool_pread(spool->index_fd, &record, sizeof(record), 
+                          (int64_t)i * sizeof(CachedSpoolRecord));
+        if(ret < 0){
+            goto fail;
+        }
+        if(record.magic != SPOOL_RECORD_MAGIC || record.size < 0 || record.offset < 0 || 
+           (!(record.flags & (SPOOL_RECORD_DONE | SPOOL_RECORD_NO_DATA)) && 
+            record.offset + record.size > spool->data_size)){
+            av_log(NULL, AV_LOG_WARNING, "[cseg] spool index %s is broken at record %d, truncated\n", 
+                   cseg->spool_dir, i);
+            break;
+        }
+        if(!(record.flags & SPOOL_RECORD_DONE) && (record.flags & SPOOL_RECORD_NO_DATA)){
+            //journaled, but stopped before its data was synced, nothing to backfill
+            ret = spool_set_flags(spool, i, SPOOL_RECORD_DONE);
+            if(ret < 0){
+                goto fail;
+            }
+            nb_lost++;
+        }else if(!(record.flags & SPOOL_RECORD_DONE)){
+            if(record.flags & SPOOL_RECORD_LIVE){
+                //journaled but not written before the last run stopped
+                ret = spool_set_flags(spool, i, record.flags & ~SPOOL_RECORD_LIVE);
+                if(ret < 0){
+                    goto fail;
+                }
+            }
+            if(spool->head < 0){
+                spool->head = i;
+            }
+            spool->nb_pending++;
+            spool->pending_size += record.size;
+        }
+    }
+    spool->nb_records = i;
+    spool->nb_backfill = spool->nb_pending;
+    if(spool->head < 0){
+        spool->head = i;
+    }
+    if(ftruncate(spool->index_fd, (int64_t)i * sizeof(CachedSpoolRecord)) < 0){
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    spool_compact(spool);
+    if(nb_lost > 0){
+        av_log(NULL, AV_LOG_WARNING, "[cseg] %d journaled segments in spool %s have no data, discarded\n", 
+               nb_lost, cseg->spool_dir);
+    }
+    if(spool->nb_pending > 0){
+        av_log(NULL, AV_LOG_INFO, "[cseg] %d segments(%"PRId64" bytes) in spool %s to backfill\n", 
+               spool->nb_pending, spool->pending_size, cseg->spool_dir);
+    }
+    
+    spool->segment = cseg_segment_alloc(cseg, 0);
+    if(spool->segment == NULL){
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if(spool->journal){
+        //enough for the segments cached and spilled, the others have data written by spool_put
+        spool->jobs_size = cseg->max_nb_segments + SPOOL_MAX_SPILLS;
+        spool->jobs = av_mallocz(sizeof(CachedSegment *) * spool->jobs_size);
+        if(spool->jobs == NULL){
+            cached_segment_free(spool->segment);
+            spool->segment = NULL;
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+    pthread_mutex_init(&spool->lock, NULL);
+    pthread_cond_init(&spool->cond, NULL);
+    pthread_cond_init(&spool->done_cond, NULL);
+    init_segment_list(&spool->spills);
+    spool->active = 1;
+    ret = pthread_create(&spool->thread, NULL, spool_routine, cseg);
+    if(ret){
+        av_log(NULL, AV_LOG_ERROR, "[cseg] start spool thread failed\n");
+        spool_close(cseg);
+        return AVERROR(ret);
+    }
+    spool->has_thread = 1;
+    return 0;
+    
+fail:
+    if(spool->index_fd >= 0){
+        close(spool->index_fd);
+    }
+    if(spool->data_fd >= 0){
+        close(spool->data_fd);
+    }
+    if(spool->state_fd >= 0){
+        close(spool->state_fd);
+    }
+    spool->data_fd = spool->index_fd = spool->state_fd = -1;
+    return ret;
+}
+
+/* write the data of segment at offset of spool.dat */
+static int spool_write_data(CachedSegmentSpool *spool, CachedSegment *segment, int64_t offset)
+{
+    CachedSegmentChunk * chunk;
+    int ret;
+    
+    for(chunk = segment->first_chunk; chunk != NULL; chunk = chunk->next){
+        ret = spool_pwrite(spool->data_fd, chunk->data, chunk->size, offset);
+        if(ret < 0){
+            return ret;
+        }
+        offset += chunk->size;
+    }
+    return 0;
+}
+
+/* fill the spool record of segment except offset */
+static void spool_fill_record(CachedSegment *segment, uint32_t flags, CachedSpoolRecord *record)
+{
+    memset(record, 0, sizeof(CachedSpoolRecord));
+    record->magic = SPOOL_RECORD_MAGIC;
+    record->flags = flags;
+    record->size = segment->size;
+    record->sequence = segment->sequence;
+    record->pos = segment->pos;
+    record->start_ts = segment->start_ts;
+    record->duration = segment->duration;
+    record->next_dts = segment->next_dts;
+    if(segment->has_md5){
+        record->flags |= SPOOL_RECORD_MD5;
+        memcpy(record->md5, segment->md5_digest, 16);
+    }
+}
+
+/* 
+ * append the data and record of segment, the space of data is reserved with spool locked 
+ * and written without lock, not called by the muxer. 
+ * Return 0 and the index of its record on success
+ */
+static int spool_append(CachedSegmentContext *cseg, CachedSegment *segment, uint32_t flags, 
+                        int *index)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    CachedSpoolRecord record;
+    int ret = 0;
+    
+    spool_fill_record(segment, flags, &record);
+    
+    pthread_mutex_lock(&spool->lock);
+    if(cseg->spool_max_size > 0 && 
+       spool->data_size + segment->size > cseg->spool_max_size){
+        pthread_mutex_unlock(&spool->lock);
+        return AVERROR(ENOSPC);
+    }
+    record.offset = spool->data_size;
+    spool->data_size += segment->size;
+    spool->nb_writing++;
+    pthread_mutex_unlock(&spool->lock);
+    
+    //data goes first and is synced, so that a record never points to the data not on disk
+    ret = spool_write_data(spool, segment, record.offset);
+    if(ret == 0 && fdatasync(spool->data_fd) < 0){
+        ret = AVERROR(errno);
+    }
+    
+    pthread_mutex_lock(&spool->lock);
+    spool->nb_writing--;
+    if(ret == 0){
+        ret = spool_pwrite(spool->index_fd, &record, sizeof(record), 
+                           (int64_t)spool->nb_records * sizeof(CachedSpoolRecord));
+    }
+    if(ret == 0){
+        *index = spool->nb_records;
+        spool->nb_records++;
+        spool->nb_pending++;
+        spool->pending_size += segment->size;
+        spool_mark_dirty(spool, 1, 0);
+    }else{
+        //the space of the partial data is given back at compaction
+        spool_compact(spool);
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return ret;
+}
+
+/* 
+ * record the completed segment in journal before it is handed to the consumer, 
+ * called by the muxer thread only. Only the record is appended here, its data is 
+ * written and synced by spool thread, so that the muxer never waits on disk. 
+ * The segment is still written by the consumer, its record is only backfilled 
+ * after restart if the process stopped before that and the data was synced
+ */
+static void spool_journal(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    CachedSpoolRecord record;
+    int ret = 0;
+    
+    if(!spool->active || !spool->journal){
+        return;
+    }
+    spool_fill_record(segment, SPOOL_RECORD_LIVE | SPOOL_RECORD_NO_DATA, &record);
+    
+    pthread_mutex_lock(&spool->lock);
+    if(cseg->spool_max_size > 0 && 
+       spool->data_size + segment->size > cseg->spool_max_size){
+        ret = AVERROR(ENOSPC);
+    }else{
+        //the space of data is reserved, it is not compacted while the record is pending
+        record.offset = spool->data_size;
+        ret = spool_pwrite(spool->index_fd, &record, sizeof(record), 
+                           (int64_t)spool->nb_records * sizeof(CachedSpoolRecord));
+    }
+    if(ret == 0){
+        spool->data_size += segment->size;
+        segment->journal_index = spool->nb_records;
+        segment->journal_offset = record.offset;
+        spool->nb_records++;
+        spool->nb_pending++;
+        spool->pending_size += segment->size;
+        if(spool->nb_jobs < spool->jobs_size){
+            segment->journal_job = (spool->jobs_head + spool->nb_jobs) % spool->jobs_size;
+            spool->jobs[segment->journal_job] = segment;
+            spool->nb_jobs++;
+            segment->journal_state = CSEG_JOURNAL_QUEUED;
+        }
+    }
+    spool->next_sequence = segment->sequence + 1;
+    spool_mark_dirty(spool, ret == 0, 1);
+    pthread_mutex_unlock(&spool->lock);
+    if(ret < 0){
+        av_log(NULL, AV_LOG_WARNING, 
+               "[cseg] journal segment(size:%d, start_ts:%f, sequence:%lld) failed with error(%d)\n", 
+               segment->size, segment->start_ts, (long long)segment->sequence, ret);
+    }
+}
+
+/* 
+ * wait for the data of the journaled segment being written by spool thread, 
+ * and cancel its job if not started, called with spool locked
+ */
+static void spool_cancel_journal(CachedSegmentSpool *spool, CachedSegment *segment)
+{
+    while(segment->journal_state == CSEG_JOURNAL_WRITING){
+        pthread_cond_wait(&spool->done_cond, &spool->lock);
+    }
+    if(segment->journal_state == CSEG_JOURNAL_QUEUED){
+        spool->jobs[segment->journal_job] = NULL;
+        segment->journal_state = CSEG_JOURNAL_NONE;
+    }
+}
+
+/* 
+ * make the data of the journaled segment durable if spool thread has not done it, 
+ * called with spool locked, by the consumer or spool thread only
+ */
+static int spool_store_journal(CachedSegmentSpool *spool, CachedSegment *segment)
+{
+    int ret;
+    
+    spool_cancel_journal(spool, segment);
+    if(segment->journal_state == CSEG_JOURNAL_STORED){
+        return 0;
+    }
+    segment->journal_state = CSEG_JOURNAL_WRITING;
+    pthread_mutex_unlock(&spool->lock);
+    
+    ret = spool_write_data(spool, segment, segment->journal_offset);
+    if(ret == 0 && fdatasync(spool->data_fd) < 0){
+        ret = AVERROR(errno);
+    }
+    
+    pthread_mutex_lock(&spool->lock);
+    segment->journal_state = ret == 0 ? CSEG_JOURNAL_STORED : CSEG_JOURNAL_NONE;
+    pthread_cond_broadcast(&spool->done_cond);
+    return ret;
+}
+
+/* 
+ * the segment has been written by the consumer, done with its journal record, 
+ * and save the writer state to resume after restart
+ */
+static void spool_written(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    
+    if(!spool->active || !spool->journal){
+        return;
+    }
+    pthread_mutex_lock(&spool->lock);
+    if(segment->journal_index >= 0){
+        spool_cancel_journal(spool, segment);
+        spool_set_flags(spool, segment->journal_index, SPOOL_RECORD_DONE);
+        segment->journal_index = -1;
+        spool->nb_pending--;
+        spool->pending_size -= segment->size;
+    }
+    if(cseg->writer->save_state != NULL && 
+       cseg->writer->save_state(cseg, spool->writer_state, CSEG_WRITER_STATE_SIZE) == 0){
+        spool_mark_dirty(spool, 1, 1);
+    }else{
+        spool_mark_dirty(spool, 1, 0);
+    }
+    spool_compact(spool);
+    pthread_mutex_unlock(&spool->lock);
+}
+
+/* 
+ * keep the segment in spool for backfill instead of dropping it, called by consumer 
+ * or spool thread. A journaled segment is only handed over to backfill once its data is stored. 
+ * return 0 on success, a negative AVERROR if the segment is not spooled
+ */
+static int spool_put(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    int ret = 0;
+    
+    if(!spool->active){
+        return AVERROR(ENOSYS);
+    }
+    
+    if(segment->journal_index >= 0){
+        pthread_mutex_lock(&spool->lock);
+        ret = spool_store_journal(spool, segment);
+        if(ret == 0){
+            ret = spool_set_flags(spool, segment->journal_index, 
+                                  segment->has_md5 ? SPOOL_RECORD_MD5 : 0);
+        }
+        if(ret == 0){
+            spool_mark_dirty(spool, 1, 0);
+        }else{
+            //never backfilled, dropped with its record
+            spool_set_flags(spool, segment->journal_index, SPOOL_RECORD_DONE);
+            spool->nb_pending--;
+            spool->pending_size -= segment->size;
+            spool_compact(spool);
+        }
+        segment->journal_index = -1;
+    }else{
+        int index;
+        ret = spool_append(cseg, segment, 0, &index);
+        pthread_mutex_lock(&spool->lock);
+    }
+    if(ret == 0){
+        spool->nb_spooled++;
+        //the consumer checks it without lock for backfill
+        __atomic_store_n(&spool->nb_backfill, spool->nb_backfill + 1, __ATOMIC_RELEASE);
+    }else{
+        spool->nb_dropped++;
+    }
+    pthread_mutex_unlock(&spool->lock);
+    if(ret < 0){
+        av_log(NULL, AV_LOG_WARNING, 
+               "[cseg] spool segment(size:%d, start_ts:%f, sequence:%lld) failed with error(%d)\n", 
+               segment->size, segment->start_ts, (long long)segment->sequence, ret);
+    }
+    return ret;
+}
+
+/* 
+ * hand the segment over to spool thread to keep it on disk, called by the muxer thread only. 
+ * Return 0 if taken, a negative AVERROR if the segment is not spooled
+ */
+static int spool_spill(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    int ret = 0;
+    
+    if(!spool->active){
+        return AVERROR(ENOSYS);
+    }
+    pthread_mutex_lock(&spool->lock);
+    if(segment->journal_index < 0 && spool->spills.seg_num >= SPOOL_MAX_SPILLS){
+        //spool thread falls behind, memory is bounded. 
+        //A journaled segment is always taken, only its record is updated
+        spool->nb_dropped++;
+        ret = AVERROR(ENOBUFS);
+    }else{
+        put_segment_list(&spool->spills, segment);
+        pthread_cond_signal(&spool->cond);
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return ret;
+}
+
+#define SPOOL_MAX_JOB_BATCH 16
+
+/* 
+ * write the data of the queued journal records, synced once for the batch, 
+ * called by spool thread with spool locked
+ */
+static void spool_write_jobs(CachedSegmentSpool *spool)
+{
+    CachedSegment * batch[SPOOL_MAX_JOB_BATCH];
+    int rets[SPOOL_MAX_JOB_BATCH];
+    CachedSegment * segment;
+    int i, nb = 0, synced;
+    
+    while(spool->nb_jobs > 0 && nb < SPOOL_MAX_JOB_BATCH){
+        segment = spool->jobs[spool->jobs_head];
+        spool->jobs[spool->jobs_head] = NULL;
+        spool->jobs_head = (spool->jobs_head + 1) % spool->jobs_size;
+        spool->nb_jobs--;
+        if(segment != NULL){
+            segment->journal_state = CSEG_JOURNAL_WRITING;
+            batch[nb++] = segment;
+        }
+    }
+    if(nb == 0){
+        return;
+    }
+    pthread_mutex_unlock(&spool->lock);
+    
+    //the segments are kept by the consumer until they leave the writing state
+    for(i = 0; i < nb; i++){
+        rets[i] = spool_write_data(spool, batch[i], batch[i]->journal_offset);
+    }
+    synced = fdatasync(spool->data_fd) == 0;
+    if(!synced){
+        av_log(NULL, AV_LOG_WARNING, "[cseg] sync spool data failed with errno(%d)\n", errno);
+    }
+    
+    pthread_mutex_lock(&spool->lock);
+    for(i = 0; i < nb; i++){
+        segment = batch[i];
+        if(rets[i] == 0 && synced && 
+           spool_set_flags(spool, segment->journal_index, 
+                           SPOOL_RECORD_LIVE | (segment->has_md5 ? SPOOL_RECORD_MD5 : 0)) == 0){
+            segment->journal_state = CSEG_JOURNAL_STORED;
+        }else{
+            //retried by spool_put if the segment goes to backfill
+            segment->journal_state = CSEG_JOURNAL_NONE;
+        }
+    }
+    spool->index_dirty = 1;
+    pthread_cond_broadcast(&spool->done_cond);
+}
+
+/* 
+ * write the data of journaled segments and the segments handed over by the muxer to spool, 
+ * and sync spool.idx and spool.state so that the muxer never waits on disk
+ */
+static void * spool_routine(void *arg)
+{
+    CachedSegmentContext *cseg = (CachedSegmentContext *)arg;
+    CachedSegmentSpool *spool = &cseg->spool;
+    CachedSegment * segment;
+    
+    pthread_mutex_lock(&spool->lock);
+    while(1){
+        while(spool->nb_jobs == 0 && spool->spills.seg_num == 0 && 
+              !spool->index_dirty && !spool->state_dirty && !spool->thread_exit){
+            pthread_cond_wait(&spool->cond, &spool->lock);
+        }
+        if(spool->nb_jobs > 0){
+            spool_write_jobs(spool);
+            continue;
+        }
+        segment = get_segment_list(&spool->spills);
+        if(segment != NULL){
+            pthread_mutex_unlock(&spool->lock);
+            spool_put(cseg, segment);
+            cached_segment_free(segment);
+            pthread_mutex_lock(&spool->lock);
+            continue;
+        }
+        if(spool->index_dirty || spool->state_dirty){
+            pthread_mutex_unlock(&spool->lock);
+            spool_sync(spool);
+            pthread_mutex_lock(&spool->lock);
+            continue;
+        }
+        break; //exit only after the segments handed over are written
+    }
+    pthread_mutex_unlock(&spool->lock);
+    
+    return NULL;
+}
+
+/* load the data of record into the backfill segment */
+static int spool_load(CachedSegmentSpool *spool, CachedSpoolRecord *record)
+{
+    CachedSegment * segment = spool->segment;
+    CachedSegmentChunk * chunk;
+    int64_t offset = record->offset;
+    int left = record->size;
+    int len, ret;
+    
+    cached_segment_reset(segment);
+    while(left > 0){
+        chunk = cached_segment_add_chunk(segment);
+        if(chunk == NULL){
+            return AVERROR(ENOMEM);
+        }
+        len = MIN(left, CSEG_CHUNK_SIZE);
+        ret = spool_pread(spool->data_fd, chunk->data, len, offset);
+        if(ret < 0){
+            return ret;
+        }
+        chunk->size = len;
+        offset += len;
+        left -= len;
+    }
+    segment->size = record->size;
+    segment->sequence = record->sequence;
+    segment->pos = record->pos;
+    segment->start_ts = record->start_ts;
+    segment->duration = record->duration;
+    segment->next_dts = record->next_dts;
+    if(record->flags & SPOOL_RECORD_MD5){
+        segment->has_md5 = 1;
+        memcpy(segment->md5_digest, record->md5, 16);
+    }
+    return 0;
+}
+
+/* 
+ * write the oldest spooled segment if the consumer has nothing else to do, 
+ * live segments keep the priority. A failed backfill never fails the consumer, 
+ * it is retried with backoff. 
+ * return 1 if a segment was backfilled, 0 otherwise
+ */
+static int spool_backfill(CachedSegmentContext *cseg)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    CachedSpoolRecord record;
+    int64_t now, delay;
+    int ret, nb_written;
+    
+    if(!spool->active || __atomic_load_n(&spool->nb_backfill, __ATOMIC_ACQUIRE) == 0 || 
+       cseg->writer_paused || cseg->nb_uploading > 0 || 
+       segment_ring_count(&cseg->cached_ring) != 0){
+        return 0;
+    }
+    now = av_gettime_relative();
+    if(now < spool->next_time){
+        return 0;
+    }
+    
+    //skip the journaled records written already. Only the consumer moves head and 
+    //compacts, so the record and its data are stable after unlock
+    pthread_mutex_lock(&spool->lock);
+    ret = AVERROR(EAGAIN);
+    while(spool->head < spool->nb_records){
+        ret = spool_pread(spool->index_fd, &record, sizeof(record), 
+                          (int64_t)spool->head * sizeof(CachedSpoolRecord));
+        if(ret < 0 || !(record.flags & SPOOL_RECORD_DONE)){
+            break;
+        }
+        spool->head++;
+    }
+    pthread_mutex_unlock(&spool->lock);
+    if(ret == AVERROR(EAGAIN) || (ret == 0 && (record.flags & SPOOL_RECORD_LIVE))){
+        //the journaled segment is going to be queued by the muxer
+        spool->next_time = now + CSEG_WRITER_POLL_MS * 1000;
+        return 0;
+    }
+    if(ret == 0){
+        ret = spool_load(spool, &record);
+    }
+    if(ret == 0){
+        if(cseg->writer->write_segment != NULL){
+            ret = cseg->writer->write_segment(cseg, spool->segment);
+        }else{
+            ret = cseg->writer->write_segments(cseg, &spool->segment, 1, &nb_written);
+        }
+    }
+    cached_segment_reset(spool->segment);
+    
+    if(ret == 1){
+        //backend still unavailable, the same record is tried again later
+        delay = spool->retry_delay ? spool->retry_delay * 2 : 
+                (int64_t)(FFMAX(cseg->retry_min, 0.1) * 1000000);
+        if(cseg->retry_max > 0 && delay > (int64_t)(cseg->retry_max * 1000000)){
+            delay = (int64_t)(cseg->retry_max * 1000000);
+        }
+        spool->retry_delay = delay;
+        spool->next_time = now + delay;
+        return 0;
+    }
+    spool->retry_delay = 0;
+    if(ret < 0){
+        av_log(NULL, AV_LOG_ERROR, 
+               "[cseg] backfill spooled segment(size:%d, start_ts:%f, sequence:%lld) failed with error(%d), dropped\n", 
+               record.size, record.start_ts, (long long)record.sequence, ret);
+        spool->nb_dropped++;
+    }else{
+        spool->nb_backfilled++;
+    }
+    
+    pthread_mutex_lock(&spool->lock);
+    spool_set_flags(spool, spool->head, SPOOL_RECORD_DONE);
+    spool->head++;
+    spool->nb_pending--;
+    spool->pending_size -= record.size;
+    __atomic_store_n(&spool->nb_backfill, spool->nb_backfill - 1, __ATOMIC_RELEASE);
+    if(ret == 0 && spool->journal && cseg->writer->save_state != NULL && 
+       cseg->writer->save_state(cseg, spool->writer_state, CSEG_WRITER_STATE_SIZE) == 0){
+        spool_mark_dirty(spool, 1, 1);
+    }else{
+        spool_mark_dirty(spool, 1, 0);
+    }
+    spool_compact(spool);
+    pthread_mutex_unlock(&spool->lock);
+    
+    if(cseg->spool_rate > 0){
+        spool->next_time = now + (int64_t)record.size * 1000000 / cseg->spool_rate;
+    }
+    return ret == 0;
+}
+
+/* milliseconds to wait until the next backfill, -1 for none */
+static int spool_timeout(CachedSegmentContext *cseg)
+{
+    CachedSegmentSpool *spool = &cseg->spool;
+    int64_t remain;
+    
+    if(!spool->active || __atomic_load_n(&spool->nb_backfill, __ATOMIC_ACQUIRE) == 0 || 
+       cseg->writer_paused){
+        return -1;
+    }
+    remain = spool->next_time - av_gettime_relative();
+    if(remain <= 0){
+        return 0;
+    }
+    return (int)((remain + 999) / 1000);
+}
+
+#define SEGMENT_HAS_DROPED   1
+/* append current segment to the cached segment list */
+static int append_cur_segment(AVFormatContext *s)
+{
+    CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
+    CachedSegment * segment = cseg->cur_segment;
+    int ret = 0;
+    int dropped;
+    
+    if(segment == NULL){
+        //no current segment, just finished
+        return 0;
+    }
+    
+    cseg->cur_segment = NULL;
+    
+    if(segment->md5){
+        av_md5_final(segment->md5, segment->md5_digest);
+        segment->has_md5 = 1;
+    }
+    
+    if(segment->recording){
+        if(withdraw_live_segment(cseg, segment)){
+            //the consumer still reads it, so it always goes to cached ring, 
+            //which is empty as the consumer takes no other segment while streaming
+            dropped = segment->dropped = (segment->start_ts <= 0.0 || segment->duration < 1);
+            if(!dropped){
+                spool_journal(cseg, segment);
+            }
+            __atomic_store_n(&segment->recording, 0, __ATOMIC_RELEASE);
+            put_segment_ring(&(cseg->cached_ring), segment);
+            wakeup_consumer(cseg);
+            return dropped ? SEGMENT_HAS_DROPED : 0;
+        }
+        segment->recording = 0;
+    }
+       
+    if(segment->start_ts <= 0.0 ||
+       segment->duration < 1){
+        //segment is invalid
+        recycle_free_segment(cseg, segment);
+        return SEGMENT_HAS_DROPED;
+    }
+    
+    spool_journal(cseg, segment);
+        
+    if(segment_ring_count(&cseg->cached_ring) >= cseg->max_nb_segments){
+        cseg->nb_full++;
+        if(!(cseg->flags & CSEG_FLAG_NONBLOCK)){
+            ret = wait_cached_ring_space(s);
+            if(ret < 0){
+                if(segment->journal_index < 0 || spool_spill(cseg, segment) < 0){
+                    recycle_free_segment(cseg, segment);
+                }
+                return ret;
+            }
+        }//if(!(cseg->flags & CSEG_FLAG_NONBLOCK)){
+    }
+    
+    if(segment_ring_count(&cseg->cached_ring) >= cseg->max_nb_segments && 
+       spool_spill(cseg, segment) == 0){
+        //keep it on disk for backfill instead of dropping, written by spool thread
+        av_log(s, AV_LOG_VERBOSE, 
+               "One Segment(size:%d, start_ts:%f, sequence:%lld) is spooled because of slow writer\n", 
+               segment->size, segment->start_ts, (long long)segment->sequence); 
+        ret = 0;
+    }else if(segment_ring_count(&cseg->cached_ring) >= cseg->max_nb_segments){ 
+        av_log(s, AV_LOG_WARNING, 
+               "One Segment(size:%d, start_ts:%f, duration:%f, pos:%lld, sequence:%lld) "
+               "is dropped because of slow writer\n", 
+                segment->size, 
+                segment->start_ts, segment->duration, 
+                segment->pos, segment->sequence); 
+        recycle_free_segment(cseg, segment);
+        cseg->nb_dropped++;
+        ret = SEGMENT_HAS_DROPED;
+    }else{
+/*
+        av_log(s, AV_LOG_INFO, 
+                "One Segment(size:%d, start_ts:%f, duration:%f, pos:%lld, sequence:%lld) "
+                "is added to cached list(len:%d)\n", 
+                segment->size, 
+                segment->start_ts, segment->duration, 
+                segment->pos, segment->sequence, 
+                segment_ring_count(&cseg->cached_ring)); 
+*/
+        put_segment_ring(&(cseg->cached_ring), segment);  
+        wakeup_consumer(cseg);    
+        ret = 0;
+    }
+    
+    return ret;
+}
+
+void cached_segment_complete(CachedSegmentContext *cseg, CachedSegment *segment, int ret)
+{
+    segment->upload_ret = ret;
+    __atomic_store_n(&segment->state, CSEG_SEGMENT_UPLOADED, __ATOMIC_RELEASE);
+    wakeup_consumer(cseg); //wakeup consumer to commit
+}
+
+/* 
+ * upload workers adapt the blocking upload_segment() of writer to 
+ * the asynchronous submit/complete model
+ */
+static void * upload_worker_routine(void *arg)
+{
+    CachedSegmentUploadWorker * worker = (CachedSegmentUploadWorker *)arg;
+    CachedSegmentContext *cseg = worker->cseg;
+    CachedSegment * segment;
+    int ret;
+    
+    pthread_mutex_lock(&cseg->upload_mutex);
+    while(1){
+        while(cseg->upload_jobs.seg_num == 0 && !cseg->upload_exit){
+            pthread_cond_wait(&cseg->upload_cond, &cseg->upload_mutex);
+        }
+        segment = get_segment_list(&cseg->upload_jobs);
+        if(segment == NULL){
+            break; //exit only after all the jobs are done
+        }
+        if(cseg->upload_cancel){
+            pthread_mutex_unlock(&cseg->upload_mutex);
+            cached_segment_complete(cseg, segment, AVERROR_EXIT);
+            pthread_mutex_lock(&cseg->upload_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&cseg->upload_mutex);
+        
+        ret = cseg->writer->upload_segment(cseg, segment, worker->index);
+        cached_segment_complete(cseg, segment, ret);
+        
+        pthread_mutex_lock(&cseg->upload_mutex);
+    }
+    pthread_mutex_unlock(&cseg->upload_mutex);
+    
+    return NULL;
+}
+
+static int start_upload_workers(CachedSegmentContext *cseg)
+{
+    int i, ret;
+    
+    cseg->upload_workers = av_mallocz(sizeof(CachedSegmentUploadWorker) * cseg->nb_upload_workers);
+    if(cseg->upload_workers == NULL){
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&cseg->upload_mutex, NULL);
+    pthread_cond_init(&cseg->upload_cond, NULL);
+    init_segment_list(&cseg->upload_jobs);
+    cseg->upload_exit = 0;
+    cseg->upload_cancel = 0;
+    
+    for(i = 0; i < cseg->nb_upload_workers; i++){
+        CachedSegmentUploadWorker * worker = &cseg->upload_workers[i];
+        worker->cseg = cseg;
+        worker->index = i;
+        ret = pthread_create(&worker->thread_id, NULL, upload_worker_routine, worker);
+        if(ret){
+            av_log(NULL, AV_LOG_ERROR, "[cseg] start upload worker thread failed\n");
+            worker->thread_id = 0;
+            return AVERROR(ret);
+        }
+    }
+    return 0;
+}
+
+/* wait for all the queued uploads finished, then stop workers */
+static void stop_upload_workers(CachedSegmentContext *cseg)
+{
+    int i;
+    
+    if(cseg->upload_workers == NULL){
+        return;
+    }
+    pthread_mutex_lock(&cseg->upload_mutex);
+    cseg->upload_exit = 1;
+    pthread_cond_broadcast(&cseg->upload_cond);
+    pthread_mutex_unlock(&cseg->upload_mutex);
+    
+    for(i = 0; i < cseg->nb_upload_workers; i++){
+        if(cseg->upload_workers[i].thread_id != 0){
+            pthread_join(cseg->upload_workers[i].thread_id, NULL);
+        }
+    }
+    pthread_cond_destroy(&cseg->upload_cond);
+    pthread_mutex_destroy(&cseg->upload_mutex);
+    av_freep(&cseg->upload_workers);
+}
+
+/* 
+ * hand the segment to upload workers or asynchronous writer, 
+ * return 0 if accepted, 1 if writer is busy
+ */
+static int submit_segment(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    int ret;
+    
+    segment->state = CSEG_SEGMENT_UPLOADING;
+    if(cseg->upload_workers == NULL){
+        ret = cseg->writer->submit_segment(cseg, segment);
+        if(ret == 1){
+            segment->state = CSEG_SEGMENT_IDLE;
+            return 1;
+        }else if(ret < 0){
+            cached_segment_complete(cseg, segment, ret);
+        }
+    }else{
+        pthread_mutex_lock(&cseg->upload_mutex);
+        put_segment_list(&cseg->upload_jobs, segment);
+        pthread_cond_signal(&cseg->upload_cond);
+        pthread_mutex_unlock(&cseg->upload_mutex);
+    }
+    cseg->nb_uploading++;
+    return 0;
+}
+
+/* abort the segments in flight on error */
+static void cancel_inflight(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment;
+    uint32_t i;
+    
+    if(cseg->upload_workers != NULL){
+        pthread_mutex_lock(&cseg->upload_mutex);
+        cseg->upload_cancel = 1;
+        pthread_mutex_unlock(&cseg->upload_mutex);
+    }else if(cseg->writer != NULL && cseg->writer->cancel != NULL){
+        for(i = 0; (segment = peek_segment_ring(&cseg->cached_ring, i)) != NULL; i++){
+            if(__atomic_load_n(&segment->state, __ATOMIC_ACQUIRE) == CSEG_SEGMENT_UPLOADING){
+                cseg->writer->cancel(cseg, segment);
+            }
+        }
+    }
+}
+
+/* wait for all the segments in flight completed, then stop upload workers */
+static void finish_inflight(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment;
+    struct pollfd pfd;
+    uint32_t i;
+    
+    if(cseg->parallel_upload && cseg->upload_workers == NULL){
+        pfd.fd = cseg->not_empty_fd;
+        pfd.events = POLLIN;
+        i = 0;
+        while((segment = peek_segment_ring(&cseg->cached_ring, i)) != NULL){
+            if(__atomic_load_n(&segment->state, __ATOMIC_ACQUIRE) != CSEG_SEGMENT_UPLOADING){
+                i++;
+                continue;
+            }
+            if(cseg->writer->poll != NULL){
+                cseg->writer->poll(cseg, CSEG_INTERRUPT_CHECK_MS);
+            }else if(poll(&pfd, 1, CSEG_INTERRUPT_CHECK_MS) > 0){
+                drain_fd(cseg->not_empty_fd);
+            }
+        }
+    }
+    stop_upload_workers(cseg);
+}
+
+/* 
+ * write out the segments in cached ring in batches with write_segments, 
+ * return the same as consumer_write_serial()
+ */
+static int consumer_write_batch(CachedSegmentContext *cseg, int max_segments)
+{
+    CachedSegment * batch[CSEG_MAX_BATCH_SEGMENTS];
+    int nb_segments, nb_done, i;
+    int nb_written = 0;
+    int ret;
+    
+    while(max_segments <= 0 || nb_written < max_segments){
+        //collect the contiguous ready segments from the head
+        nb_segments = 0;
+        while(nb_segments < CSEG_MAX_BATCH_SEGMENTS && 
+              (max_segments <= 0 || nb_written + nb_segments < max_segments) && 
+              (batch[nb_segments] = peek_segment_ring(&cseg->cached_ring, nb_segments)) != NULL){
+            nb_segments++;
+        }
+        if(nb_segments == 0){
+            break;
+        }
+        
+        nb_done = 0;
+        ret = cseg->writer->write_segments(cseg, batch, nb_segments, &nb_done);
+        if(nb_done < 0 || nb_done > nb_segments || (ret == 0 && nb_done != nb_segments)){
+            av_log(NULL, AV_LOG_ERROR,  "[cseg] writer returns invalid number of written segments:%d\n", nb_done);        
+            return AVERROR(EINVAL);
+        }
+        for(i = 0; i < nb_done; i++){
+            get_segment_ring(&(cseg->cached_ring));
+            spool_written(cseg, batch[i]);
+            recycle_written_segment(cseg, batch[i]);
+        }
+        nb_written += nb_done;
+        if(nb_done){
+            notify_producer(cseg);
+        }
+        
+        if(ret == 1){
+            //should keep in fifo
+            return 1;
+        }else if(ret < 0){
+            return ret;
+        }else if(ret != 0){
+            av_log(NULL, AV_LOG_ERROR,  "[cseg] cannot support the writer return code:%d\n", ret);        
+            return AVERROR(EINVAL);
+        }
+    }
+    return 0;
+}
+
+/* 
+ * hand the live segment to the writer for streaming if the writer has caught up, 
+ * it returns after the segment ended, 
+ * return 1 if the segment was streamed, 0 if none
+ */
+static int consumer_stream(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment;
+    
+    if(!cseg->stream || cseg->writer_paused){
+        return 0;
+    }
+    segment = __atomic_load_n(&cseg->live_segment, __ATOMIC_ACQUIRE);
+    if(segment == NULL || segment_ring_count(&cseg->cached_ring) != 0){
+        return 0;
+    }
+    //take it from the muxer, then it would not be recycled until finished
+    if(!__atomic_compare_exchange_n(&cseg->live_segment, &segment, NULL, 0, 
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        return 0;
+    }
+    segment->streamed = 1;
+    segment->stream_ret = cseg->writer->stream_segment(cseg, segment);
+    return 1;
+}
+
+/* 
+ * finish the streamed segment at the head of cached ring, 
+ * return 0 on success or none, otherwise the same as consumer_write_serial()
+ */
+static int consumer_finish_stream(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment = peek_segment_ring(&cseg->cached_ring, 0);
+    int ret;
+    
+    if(segment == NULL || !segment->streamed){
+        return 0;
+    }
+    ret = cseg->writer->finish_segment(cseg, segment, segment->stream_ret);
+    if(ret == 0){
+        get_segment_ring(&(cseg->cached_ring));
+        spool_written(cseg, segment);
+        recycle_written_segment(cseg, segment);
+        notify_producer(cseg);
+    }else if(ret != 1 && ret > 0){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg] cannot support the writer return code:%d\n", ret);        
+        ret = AVERROR(EINVAL);
+    }
+    return ret;
+}
+
+/* 
+ * write out the segments in cached ring one by one with write_segment, 
+ * at most max_segments of them if max_segments > 0, 
+ * return 0 on success, 1 on writer pause, a negative AVERROR on failure
+ */
+static int consumer_write_serial(CachedSegmentContext *cseg, int max_segments)
+{
+    CachedSegment * segment = NULL;
+    int nb_written = 0;
+    int ret;
+    
+    //the streamed segment is always the first one
+    if(cseg->stream && (ret = consumer_finish_stream(cseg)) != 0){
+        return ret;
+    }
+    
+    if(cseg->writer != NULL && cseg->writer->write_segments != NULL && 
+       (cseg->writer->capabilities & CSEG_WRITER_CAP_BATCH)){
+        return consumer_write_batch(cseg, max_segments);
+    }
+    
+    while((max_segments <= 0 || nb_written < max_segments) && 
+          (segment = peek_segment_ring(&cseg->cached_ring, 0)) != NULL){            
+        ret = 0;
+        if(cseg->writer != NULL && cseg->writer->write_segment != NULL){   
+            //because there is only one comsumer, the head segment is safe to access
+            ret = cseg->writer->write_segment(cseg, segment);
+        } 
+        if(ret == 0){
+            //successful
+            
+            //remove the segment from cached ring
+            get_segment_ring(&(cseg->cached_ring));
+            spool_written(cseg, segment);
+            recycle_written_segment(cseg, segment);
+            notify_producer(cseg);
+            nb_written++;
+            
+        }else if(ret == 1){
+            //should keep in fifo
+            return 1;
+        }else if(ret < 0){
+            //error     
+            return ret;
+        }else{
+            //not support other ret code, consider error
+            av_log(NULL, AV_LOG_ERROR,  "[cseg] cannot support the writer return code:%d\n", ret);        
+            return AVERROR(EINVAL);
+        }
+    }// while((segment = peek_segment_ring(&cseg->cached_ring, 0)) != NULL){
+    return 0;
+}
+
+/* 
+ * commit the completed segments in sequence order, then submit the waiting 
+ * segments to upload workers or asynchronous writer. 
+ * return 0 on success, 1 on writer pause, a negative AVERROR on failure
+ */
+static int consumer_write_parallel(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment = NULL;
+    uint32_t i;
+    int ret;
+    
+    while((segment = peek_segment_ring(&cseg->cached_ring, 0)) != NULL &&
+          __atomic_load_n(&segment->state, __ATOMIC_ACQUIRE) == CSEG_SEGMENT_UPLOADED){
+        cseg->nb_uploading--;
+        ret = segment->upload_ret;
+        if(cseg->writer->commit_segment != NULL){
+            ret = cseg->writer->commit_segment(cseg, segment, segment->upload_ret);
+        }
+        if(ret == 0){
+            get_segment_ring(&(cseg->cached_ring));
+            spool_written(cseg, segment);
+            recycle_written_segment(cseg, segment);
+            notify_producer(cseg);
+        }else if(ret == 1){
+            //upload it again after writer resumed
+            segment->state = CSEG_SEGMENT_IDLE;
+            return 1;
+        }else if(ret < 0){
+            return ret;
+        }else{
+            av_log(NULL, AV_LOG_ERROR,  "[cseg] cannot support the writer return code:%d\n", ret);        
+            return AVERROR(EINVAL);
+        }
+    }
+    
+    for(i = 0; cseg->nb_uploading < cseg->inflight_window && 
+               (segment = peek_segment_ring(&cseg->cached_ring, i)) != NULL; i++){
+        if(segment->state != CSEG_SEGMENT_IDLE){
+            continue;
+        }
+        if(submit_segment(cseg, segment) == 1){
+            //writer busy, try again on the next completion, or pause it if none in flight
+            return cseg->nb_uploading == 0 ? 1 : 0;
+        }
+    }
+    return 0;
+}
+
+/* set the time to retry the paused writer, with exponential backoff and jitter */
+static void schedule_writer_retry(CachedSegmentContext *cseg)
+{
+    int64_t delay, jitter;
+    
+    if(cseg->retry_min <= 0){
+        cseg->retry_time = 0;  //retry only on new segment
+        return;
+    }
+    if(cseg->retry_delay == 0){
+        delay = (int64_t)(cseg->retry_min * 1000000);
+    }else{
+        delay = cseg->retry_delay * 2;
+    }
+    if(cseg->retry_max > 0 && delay > (int64_t)(cseg->retry_max * 1000000)){
+        delay = (int64_t)(cseg->retry_max * 1000000);
+    }
+    cseg->retry_delay = delay;
+    
+    //wait a random time in [delay / 2, delay] so that the channels paused by 
+    //the same backend failure do not retry at the same time
+    jitter = (int64_t)((double)rand_r(&cseg->retry_seed) / RAND_MAX * (delay / 2));
+    cseg->retry_time = av_gettime_relative() + delay - jitter;
+}
+
+/* milliseconds to wait until the paused writer should be retried, -1 for no retry */
+static int writer_retry_timeout(CachedSegmentContext *cseg)
+{
+    int64_t remain;
+    
+    if(!cseg->writer_paused || cseg->retry_time == 0){
+        return -1;
+    }
+    remain = cseg->retry_time - av_gettime_relative();
+    if(remain <= 0){
+        return 0;
+    }
+    return (int)((remain + 999) / 1000);
+}
+
+static int consumer_write(CachedSegmentContext *cseg, int max_segments)
+{
+    int ret;
+    
+    //a paused writer is retried when new segment comes or the retry time is up
+    if(cseg->writer_paused && 
+       __atomic_load_n(&cseg->cached_ring.tail, __ATOMIC_ACQUIRE) == cseg->pause_tail &&
+       (cseg->retry_time == 0 || av_gettime_relative() < cseg->retry_time)){
+        return 1;
+    }
+    if(cseg->writer_paused){
+        cseg->nb_retries++;
+    }
+    if(cseg->parallel_upload){
+        ret = consumer_write_parallel(cseg);
+    }else{
+        ret = consumer_write_serial(cseg, max_segments);
+    }
+    cseg->writer_paused = (ret == 1);
+    if(cseg->writer_paused){
+        cseg->pause_tail = __atomic_load_n(&cseg->cached_ring.tail, __ATOMIC_ACQUIRE);
+        schedule_writer_retry(cseg);
+    }else{
+        cseg->retry_delay = 0;
+        cseg->retry_time = 0;
+    }
+    return ret;
+}
+
+/* one round of the consumer work, return the same as consumer_write() */
+static int consumer_process(CachedSegmentContext *cseg, int max_segments)
+{
+    CachedSegment * segment = NULL;
+    int keep_seg_num = 0;         
+    int ret;
+    
+    //try write out the segments in cached ring
+    ret = consumer_write(cseg, max_segments);
+    if(ret < 0){
+        return ret;
+    }
+    
+    //on writer pause, clean up the expired segments which are not in upload
+    keep_seg_num = MIN((uint32_t)ceil(cseg->pre_recoding_time / cseg->time), 
+                        cseg->max_nb_segments - 1);    
+    while(ret == 1 && segment_ring_count(&cseg->cached_ring) > keep_seg_num &&
+          (segment = peek_segment_ring(&cseg->cached_ring, 0)) != NULL &&
+          segment->state == CSEG_SEGMENT_IDLE){
+        //remove the segment from cached ring, kept in spool if enabled
+        get_segment_ring(&(cseg->cached_ring));                
+        if(!segment->dropped){
+            spool_put(cseg, segment);
+        }
+        recycle_written_segment(cseg, segment);
+    }
+    notify_producer(cseg);
+    return ret;
+}
+
+/* 
+ * flush the cached segments after the muxer finished, 
+ * return 1 if flush is over, 0 if more to do, a negative AVERROR on failure
+ */
+static int consumer_flush(CachedSegmentContext *cseg, int max_segments)
+{
+    int ret;
+    
+    ret = consumer_write(cseg, max_segments);
+    if(ret < 0){
+        return ret;
+    }else if(ret == 1){
+        //should keep in fifo  
+        return 1;
+    }
+    return segment_ring_count(&cseg->cached_ring) == 0;
+}
+
+/* 
+ * wait for next time, wakeup by the muxer on new segment or exit, 
+ * or by the completion of segment in flight
+ */
+static int consumer_wait(CachedSegmentContext *cseg)
+{
+    struct pollfd pfd;
+    int64_t trim_time = chunk_pool_trim();
+    int timeout = writer_retry_timeout(cseg);
+    int spool_wait = spool_timeout(cseg);
+    int ret = 0;
+   
+    if(spool_wait >= 0 && (timeout < 0 || spool_wait < timeout)){
+        timeout = spool_wait;
+    }
+    if(trim_time > 0){
+        //wake up to release the idle chunks of pool
+        int trim_wait = (int)FFMAX((trim_time - av_gettime_relative() + 999) / 1000, 0);
+        if(timeout < 0 || trim_wait < timeout){
+            timeout = trim_wait;
+        }
+    }
+    pfd.fd = cseg->not_empty_fd;
+    pfd.events = POLLIN;
+    
+    if(cseg->writer->poll != NULL && cseg->upload_workers == NULL && cseg->nb_uploading > 0){
+        //the writer progresses in its poll(), only peek the wakeup
+        if(poll(&pfd, 1, 0) > 0){
+            drain_fd(cseg->not_empty_fd);
+        }else{
+            ret = cseg->writer->poll(cseg, 
+                (timeout >= 0 && timeout < CSEG_WRITER_POLL_MS) ? timeout : CSEG_WRITER_POLL_MS);
+        }
+    }else if(poll(&pfd, 1, timeout) > 0){
+        drain_fd(cseg->not_empty_fd);
+    }
+    return ret;
+}
+
+/* 
+ * give the segments uploaded but not committed at the end back to the writer by 
+ * commit_segment() with AVERROR_EXIT, which discards their upload on the server, 
+ * called by consumer after the segments in flight finished
+ */
+static void discard_uploaded_segments(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment;
+    uint32_t i;
+    
+    if(cseg->writer == NULL || cseg->writer->commit_segment == NULL){
+        return;
+    }
+    for(i = 0; (segment = peek_segment_ring(&cseg->cached_ring, i)) != NULL; i++){
+        if(__atomic_load_n(&segment->state, __ATOMIC_ACQUIRE) == CSEG_SEGMENT_UPLOADED){
+            cseg->nb_uploading--;
+        }else if(segment->writer_data == NULL){
+            continue;
+        }
+        cseg->writer->commit_segment(cseg, segment, AVERROR_EXIT);
+        segment->state = CSEG_SEGMENT_IDLE;
+    }
+}
+
+/* 
+ * keep the segments not written at the end in spool for the next run, 
+ * called by consumer after the segments in flight finished
+ */
+static void spool_cached_segments(CachedSegmentContext *cseg)
+{
+    CachedSegment * segment;
+    
+    if(!cseg->spool.active){
+        return;
+    }
+    while((segment = get_segment_ring(&cseg->cached_ring)) != NULL){
+        if(!segment->dropped){
+            spool_put(cseg, segment);
+        }
+        recycle_written_segment(cseg, segment);
+    }
+}
+
+static void * consumer_routine(void *arg)
+{
+    CachedSegmentContext *cseg = 
+        (CachedSegmentContext *)arg;
+    int ret = 0;
+    
+    while(__atomic_load_n(&cseg->consumer_active, __ATOMIC_ACQUIRE)){
+        ret = consumer_process(cseg, 0);
+        if(ret < 0){
+            goto exit;
+        }
+        if(ret == 0 && spool_backfill(cseg)){
+            continue; //check the live segments before the next one
+        }
+        if(ret == 0 && consumer_stream(cseg)){
+            continue; //finish it once the muxer passed it
+        }
+        ret = consumer_wait(cseg);
+        if(ret < 0){
+            goto exit;
+        }
+        
+    }//while(cseg->consumer_active){
+    
+    //flush all the cached segment 
+    //because cseg->consumer_active is 0 which means no producer existed now
+    cseg->writer_paused = 0;
+    while((ret = consumer_flush(cseg, 0)) == 0){
+        //wait for segments in flight
+        ret = consumer_wait(cseg);
+        if(ret < 0){
+            break;
+        }
+    }
+    if(ret < 0){
+        goto exit;
+    }
+    finish_inflight(cseg);
+    discard_uploaded_segments(cseg);
+    spool_cached_segments(cseg);
+    
+    return NULL;    
+    
+exit:
+    cancel_inflight(cseg);
+    finish_inflight(cseg);
+    discard_uploaded_segments(cseg);
+    spool_cached_segments(cseg);
+    cseg->consumer_exit_code = ret;
+    notify_fd(cseg->not_full_fd); //wakeup the blocked muxer to get the error
+    return NULL;
+}
+
+
+//////////////////////////
+//shared consumer executor
+
+#define EXECUTOR_SEGMENTS_PER_TURN 1  /* segments written for a channel before switching to the next */
+#define EXECUTOR_POLL_MAX_MS 1000     /* max time to wait for the writer I/O before polling it again */
+
+/* 
+ * threads running the consumers of all the cseg instances (channels) of the process 
+ * which enable cseg_executor_threads, channels are served in round-robin
+ */
+typedef struct CachedSegmentExecutor {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* runnable channel or exit */
+    pthread_cond_t done_cond;   /* channel finished or executor stopped */
+    pthread_t *threads;
+    int nb_threads;
+    int nb_channels;
+    int nb_runnable;
+    int exit;
+    CachedSegmentContext *run_head, *run_tail;  /* runnable channels */
+    CachedSegmentContext *timers;   /* channels waiting for the retry of paused writer */
+    CachedSegmentContext *polls;    /* channels waiting for the I/O of their writer */
+    int poll_leader;        /* a thread is waiting for the I/O of the channels in polls */
+    int poll_round;
+    int wake_fd;            /* eventfd to wakeup the poll leader */
+    struct pollfd *poll_set;
+    int poll_set_size;
+} CachedSegmentExecutor;
+
+static CachedSegmentExecutor cseg_executor = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, 
+    .cond = PTHREAD_COND_INITIALIZER, 
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .wake_fd = -1,
+};
+
+/* must be called with executor locked */
+static void executor_wake_leader(void)
+{
+    if(cseg_executor.poll_leader){
+        notify_fd(cseg_executor.wake_fd);
+    }
+}
+
+/* must be called with executor locked */
+static void executor_enqueue(CachedSegmentContext *cseg)
+{
+    cseg->exec_next = NULL;
+    if(cseg_executor.run_tail != NULL){
+        cseg_executor.run_tail->exec_next = cseg;
+    }else{
+        cseg_executor.run_head = cseg;
+    }
+    cseg_executor.run_tail = cseg;
+    cseg_executor.nb_runnable++;
+    cseg->exec_queued = 1;
+    pthread_cond_signal(&cseg_executor.cond);
+    executor_wake_leader();
+}
+
+/* must be called with executor locked */
+static void executor_schedule_locked(CachedSegmentContext *cseg)
+{
+    if(!cseg->exec_done){
+        if(cseg->exec_running){
+            cseg->exec_pending = 1;  //run again after the current turn
+        }else if(!cseg->exec_queued){
+            executor_enqueue(cseg);
+        }
+    }
+}
 
-/////////////////////////////
-//writer operations 
-static CachedSegmentWriter * first_writer = NULL;
+static void executor_schedule(CachedSegmentContext *cseg)
+{
+    pthread_mutex_lock(&cseg_executor.lock);
+    executor_schedule_locked(cseg);
+    pthread_mutex_unlock(&cseg_executor.lock);
+}
 
-void register_segment_writer(CachedSegmentWriter * writer)
+/* must be called with executor locked */
+static void executor_set_timer(CachedSegmentContext *cseg, int64_t deadline)
 {
-    writer->next = first_writer;
-    first_writer = writer;
+    cseg->exec_deadline = deadline;
+    if(!cseg->exec_timer){
+        cseg->exec_timer = 1;
+        cseg->exec_timer_next = cseg_executor.timers;
+        cseg_executor.timers = cseg;
+    }
 }
-static CachedSegmentWriter *find_segment_writer(char * filename)
+
+/* must be called with executor locked */
+static void executor_clear_timer(CachedSegmentContext *cseg)
 {
-    char hostname[1024], hoststr[1024], proto[16];
-    char auth[1024];
-    char path[MAX_URL_SIZE];
-    int port, i;
-    CachedSegmentWriter * writer;
+    CachedSegmentContext **p = &cseg_executor.timers;
     
-
-    av_url_split(proto, sizeof(proto), auth, sizeof(auth),
-                 hostname, sizeof(hostname), &port,
-                 path, sizeof(path), filename);
-    if(strlen(proto) == 0){
-        //no protocol, means file
-        strcpy(proto, "file");
+    if(!cseg->exec_timer){
+        return;
     }
-    for(writer = first_writer; writer != NULL; writer = writer->next){
-        if(av_match_name(proto, writer->protos)){
-            return writer;
-        }        
+    while(*p != NULL){
+        if(*p == cseg){
+            *p = cseg->exec_timer_next;
+            break;
+        }
+        p = &(*p)->exec_timer_next;
     }
-    return NULL;
-    
+    cseg->exec_timer = 0;
+    cseg->exec_timer_next = NULL;
 }
 
-////////////////////////////
-//cseg format operations
-
-static int ff_check_interrupt(AVIOInterruptCB *cb)
+/* must be called with executor locked */
+static void executor_add_poll(CachedSegmentContext *cseg)
 {
-    int ret;
-    if (cb && cb->callback && (ret = cb->callback(cb->opaque)))
-        return ret;
-    return 0;
+    if(!cseg->exec_polling){
+        cseg->exec_polling = 1;
+        cseg->exec_poll_round = 0;
+        cseg->exec_poll_next = cseg_executor.polls;
+        cseg_executor.polls = cseg;
+        executor_wake_leader();  //let it wait for the fds of cseg too
+    }
 }
 
+/* must be called with executor locked */
+static void executor_clear_poll(CachedSegmentContext *cseg)
+{
+    CachedSegmentContext **p = &cseg_executor.polls;
+    
+    if(!cseg->exec_polling){
+        return;
+    }
+    while(*p != NULL){
+        if(*p == cseg){
+            *p = cseg->exec_poll_next;
+            break;
+        }
+        p = &(*p)->exec_poll_next;
+    }
+    cseg->exec_polling = 0;
+    cseg->exec_poll_next = NULL;
+}
 
-static CachedSegment * get_free_segment(CachedSegmentContext *cseg)
+/* 
+ * must be called with executor locked, 
+ * collect the writer fds of cseg into the poll set at nb_fds, return the new size of the set
+ */
+static int executor_collect_fds(CachedSegmentContext *cseg, int nb_fds, int64_t now)
 {
-    CachedSegment * segment = NULL;
-    pthread_mutex_lock(&cseg->mutex);
-    if(cseg->free_list.seg_num > 0){
-        segment = get_segment_list(&(cseg->free_list));
-        cached_segment_reset(segment);
+    int timeout = CSEG_WRITER_POLL_MS;
+    int n = 0;
+    
+    if(cseg->writer->poll_fds != NULL){
+        timeout = -1;
+        n = cseg->writer->poll_fds(cseg, cseg_executor.poll_set + nb_fds, 
+                                   cseg_executor.poll_set_size - nb_fds, &timeout);
+        if(n > cseg_executor.poll_set_size - nb_fds){
+            //grow the poll set and try again
+            struct pollfd *poll_set = av_realloc(cseg_executor.poll_set, 
+                                                 sizeof(struct pollfd) * (nb_fds + n));
+            if(poll_set != NULL){
+                cseg_executor.poll_set = poll_set;
+                cseg_executor.poll_set_size = nb_fds + n;
+                timeout = -1;
+                n = cseg->writer->poll_fds(cseg, cseg_executor.poll_set + nb_fds, n, &timeout);
+            }
+            if(n > cseg_executor.poll_set_size - nb_fds){
+                n = 0;
+                timeout = 0;
+            }
+        }
+        if(n < 0){
+            //let the writer poll() report the error
+            n = 0;
+            timeout = 0;
+        }
     }
-    pthread_mutex_unlock(&cseg->mutex);
-    if(segment == NULL){
-        segment = cached_segment_alloc(cseg->max_seg_size);
+    if(timeout < 0 || timeout > EXECUTOR_POLL_MAX_MS){
+        timeout = EXECUTOR_POLL_MAX_MS;
     }
-    return segment;
+    cseg->exec_poll_round = cseg_executor.poll_round;
+    cseg->exec_poll_first = nb_fds;
+    cseg->exec_poll_nb = n;
+    cseg->exec_poll_deadline = now + (int64_t)timeout * 1000;
+    return nb_fds + n;
 }
 
-static void recycle_free_segment(CachedSegmentContext *cseg, CachedSegment * segment)
+/* 
+ * must be called with executor locked, wait for the writer I/O of the channels in poll list 
+ * until next (0 if none) or any channel becomes runnable, schedule the channels whose writer is ready
+ */
+static void executor_poll_writers(int64_t next)
 {
-    cached_segment_reset(segment);
-    pthread_mutex_lock(&cseg->mutex);        
-    put_segment_list(&(cseg->free_list), segment);        
-    pthread_mutex_unlock(&cseg->mutex);
+    CachedSegmentContext **p, *cseg;
+    int64_t now = av_gettime_relative();
+    int64_t deadline = next;
+    int nb_fds = 1;
+    int i, ready;
+    
+    if(cseg_executor.poll_set == NULL){
+        cseg_executor.poll_set = av_malloc(sizeof(struct pollfd) * 16);
+        if(cseg_executor.poll_set == NULL){
+            return;
+        }
+        cseg_executor.poll_set_size = 16;
+    }
+    cseg_executor.poll_round++;
+    for(cseg = cseg_executor.polls; cseg != NULL; cseg = cseg->exec_poll_next){
+        nb_fds = executor_collect_fds(cseg, nb_fds, now);
+        if(deadline == 0 || cseg->exec_poll_deadline < deadline){
+            deadline = cseg->exec_poll_deadline;
+        }
+    }
+    cseg_executor.poll_set[0].fd = cseg_executor.wake_fd;
+    cseg_executor.poll_set[0].events = POLLIN;
+    for(i = 0; i < nb_fds; i++){
+        cseg_executor.poll_set[i].revents = 0;
+    }
+    
+    cseg_executor.poll_leader = 1;
+    pthread_mutex_unlock(&cseg_executor.lock);
+    poll(cseg_executor.poll_set, nb_fds, (int)FFMAX((deadline - now + 999) / 1000, 0));
+    if(cseg_executor.poll_set[0].revents){
+        drain_fd(cseg_executor.wake_fd);
+    }
+    pthread_mutex_lock(&cseg_executor.lock);
+    cseg_executor.poll_leader = 0;
+    
+    //the channels added during poll are checked in the next round
+    now = av_gettime_relative();
+    p = &cseg_executor.polls;
+    while((cseg = *p) != NULL){
+        ready = 0;
+        if(cseg->exec_poll_round == cseg_executor.poll_round){
+            ready = cseg->exec_poll_deadline <= now;
+            for(i = 0; i < cseg->exec_poll_nb && !ready; i++){
+                ready = cseg_executor.poll_set[cseg->exec_poll_first + i].revents != 0;
+            }
+        }
+        if(ready){
+            *p = cseg->exec_poll_next;
+            cseg->exec_polling = 0;
+            cseg->exec_poll_next = NULL;
+            executor_schedule_locked(cseg);
+        }else{
+            p = &cseg->exec_poll_next;
+        }
+    }
 }
-#define SEGMENT_HAS_DROPED   1
-/* append current segment to the cached segment list */
-static int append_cur_segment(AVFormatContext *s)
+
+/* 
+ * must be called with executor locked, schedule the channels whose timer expired, 
+ * return the earliest deadline of the remaining timers, 0 if none
+ */
+static int64_t executor_run_timers(void)
 {
-    CachedSegmentContext *cseg = (CachedSegmentContext *)s->priv_data;
-    CachedSegment * segment = cseg->cur_segment;
-    int ret = 0;
+    CachedSegmentContext **p = &cseg_executor.timers;
+    CachedSegmentContext *cseg;
+    int64_t now = av_gettime_relative();
+    int64_t next = 0;
     
-    if(segment == NULL){
-        //no current segment, just finished
-        return 0;
+    while((cseg = *p) != NULL){
+        if(cseg->exec_deadline <= now){
+            *p = cseg->exec_timer_next;
+            cseg->exec_timer = 0;
+            cseg->exec_timer_next = NULL;
+            executor_schedule_locked(cseg);
+        }else{
+            if(next == 0 || cseg->exec_deadline < next){
+                next = cseg->exec_deadline;
+            }
+            p = &cseg->exec_timer_next;
+        }
     }
+    return next;
+}
+
+/* 
+ * one turn of the consumer of a channel, 
+ * return 0 if waiting for wakeup, 1 if more to do, 2 if the consumer finished, 
+ * 3 if waiting for wakeup or the I/O of writer
+ */
+static int executor_run_channel(CachedSegmentContext *cseg)
+{
+    int ret;
+    int writer_poll = cseg->writer->poll != NULL && cseg->upload_workers == NULL;
     
-    cseg->cur_segment = NULL;
-       
-    if(segment->start_ts <= 0.0 ||
-       segment->duration < 1){
-        //segment is invalid
-        recycle_free_segment(cseg, segment);
-        return SEGMENT_HAS_DROPED;
+    if(writer_poll && cseg->nb_uploading > 0){
+        //never block in the writer, the executor waits for its I/O
+        ret = cseg->writer->poll(cseg, 0);
+        if(ret < 0){
+            goto exit;
+        }
     }
-        
-    pthread_mutex_lock(&cseg->mutex);
-    if(!(cseg->flags & CSEG_FLAG_NONBLOCK)){
-        while(cseg->cached_list.seg_num >= cseg->max_nb_segments){
-            pthread_mutex_unlock(&cseg->mutex);            
-            if (ff_check_interrupt(&s->interrupt_callback)){ 
-                recycle_free_segment(cseg, segment);
-                return AVERROR_EXIT;  
-            }else if(cseg->consumer_exit_code){
-                recycle_free_segment(cseg, segment);
-                return cseg->consumer_exit_code;
-            }
-            av_usleep(10000); //wait for 10ms
-            pthread_mutex_lock(&cseg->mutex);
-        }  
-    }//if(!(cseg->flags & CSEG_FLAG_NONBLOCK)){
-        
     
-    if(cseg->cached_list.seg_num >= cseg->max_nb_segments){ 
-        av_log(s, AV_LOG_WARNING, 
-               "One Segment(size:%d, start_ts:%f, duration:%f, pos:%lld, sequence:%lld) "
-               "is dropped because of slow writer\n", 
-                segment->size, 
-                segment->start_ts, segment->duration, 
-                segment->pos, segment->sequence); 
-        cached_segment_reset(segment);
-        put_segment_list(&(cseg->free_list), segment);     
-        ret = SEGMENT_HAS_DROPED;
-    }else{
-/*
-        av_log(s, AV_LOG_INFO, 
-                "One Segment(size:%d, start_ts:%f, duration:%f, pos:%lld, sequence:%lld) "
-                "is added to cached list(len:%d)\n", 
-                segment->size, 
-                segment->start_ts, segment->duration, 
-                segment->pos, segment->sequence, 
-                cseg->cached_list.seg_num); 
-*/
-        put_segment_list(&(cseg->cached_list), segment);  
-        ret = 0;
+    if(__atomic_load_n(&cseg->consumer_active, __ATOMIC_ACQUIRE)){
+        ret = consumer_process(cseg, EXECUTOR_SEGMENTS_PER_TURN);
+        if(ret < 0){
+            goto exit;
+        }
+        if(writer_poll && cseg->nb_uploading > 0){
+            return 3;
+        }
+        if(ret == 0 && spool_backfill(cseg)){
+            return 1;
+        }
+        return ret == 0 && !cseg->parallel_upload && 
+               segment_ring_count(&cseg->cached_ring) > 0;
     }
-    pthread_cond_signal(&cseg->not_empty); //wakeup comsumer    
     
-    pthread_mutex_unlock(&cseg->mutex);
+    //flush all the cached segment 
+    if(!cseg->flushing){
+        cseg->flushing = 1;
+        cseg->writer_paused = 0;
+    }
+    ret = consumer_flush(cseg, EXECUTOR_SEGMENTS_PER_TURN);
+    if(ret < 0){
+        goto exit;
+    }else if(ret == 0){
+        //parallel upload is waked up on completion
+        if(writer_poll && cseg->nb_uploading > 0){
+            return 3;
+        }
+        return !cseg->parallel_upload;
+    }
+    finish_inflight(cseg);
+    discard_uploaded_segments(cseg);
+    spool_cached_segments(cseg);
+    return 2;
     
-    return ret;
+exit:
+    cancel_inflight(cseg);
+    finish_inflight(cseg);
+    discard_uploaded_segments(cseg);
+    spool_cached_segments(cseg);
+    cseg->consumer_exit_code = ret;
+    notify_fd(cseg->not_full_fd); //wakeup the blocked muxer to get the error
+    return 2;
 }
 
-static void * consumer_routine(void *arg)
+static void * executor_routine(void *arg)
 {
-    CachedSegmentContext *cseg = 
-        (CachedSegmentContext *)arg;
-    CachedSegment * segment = NULL;
-    int ret = 0;
-   
+    CachedSegmentContext *cseg;
+    int ret;
     
-    pthread_mutex_lock(&cseg->mutex);
-    while(cseg->consumer_active){
-        int keep_seg_num = 0;         
-        
-        //try write out all segment in cached list
-        while((segment = cseg->cached_list.first) != NULL){            
-            ret = 0;
-            if(cseg->writer != NULL && cseg->writer->write_segment != NULL){   
-                pthread_mutex_unlock(&cseg->mutex);
-                //because there is only one comsumer, the first segment is safe to access without lock
-                ret = cseg->writer->write_segment(cseg, segment);
-                pthread_mutex_lock(&cseg->mutex);
-            } 
-            if(ret == 0){
-                //successful
-                
-                //remove the segment from cached list
-                segment = get_segment_list(&(cseg->cached_list));                
-                cached_segment_reset(segment);          
-                put_segment_list(&(cseg->free_list), segment);                        
-                
-            }else if(ret == 1){
-                //should keep in fifo
+    pthread_mutex_lock(&cseg_executor.lock);
+    while(1){
+        while(cseg_executor.run_head == NULL && !cseg_executor.exit){
+            int64_t next, trim_time;
+            
+            //release the idle chunks of pool outside the lock
+            pthread_mutex_unlock(&cseg_executor.lock);
+            trim_time = chunk_pool_trim();
+            pthread_mutex_lock(&cseg_executor.lock);
+            
+            next = executor_run_timers();
+            if(cseg_executor.run_head != NULL || cseg_executor.exit){
                 break;
-            }else if(ret < 0){
-                //error     
-                pthread_mutex_unlock(&cseg->mutex);
-                cseg->consumer_exit_code = ret;
-                pthread_exit(NULL);     
+            }
+            if(trim_time > 0 && (next == 0 || trim_time < next)){
+                next = trim_time;
+            }
+            if(cseg_executor.polls != NULL && !cseg_executor.poll_leader){
+                executor_poll_writers(next);
+                continue;
+            }
+            if(next == 0){
+                pthread_cond_wait(&cseg_executor.cond, &cseg_executor.lock);
             }else{
-                //not support other ret code, consider error
-                pthread_mutex_unlock(&cseg->mutex);
-                av_log(NULL, AV_LOG_ERROR,  "[cseg] cannot support the writer return code:%d\n", ret);        
-                cseg->consumer_exit_code = AVERROR(EINVAL);
-                pthread_exit(NULL); 
+                //the condition uses the realtime clock
+                int64_t abs_time = av_gettime() + (next - av_gettime_relative());
+                struct timespec ts;
+                ts.tv_sec = abs_time / 1000000;
+                ts.tv_nsec = (abs_time % 1000000) * 1000;
+                pthread_cond_timedwait(&cseg_executor.cond, &cseg_executor.lock, &ts);
             }
-        }// while((segment = cseg->cached_list.first) != NULL){
-        
-        //clean up the expired segments
-        keep_seg_num = MIN((uint32_t)ceil(cseg->pre_recoding_time / cseg->time), 
-                            cseg->max_nb_segments - 1);    
-        while(cseg->cached_list.seg_num > keep_seg_num){
-            //remove the segment from cached list
-            segment = get_segment_list(&(cseg->cached_list));                
-            cached_segment_reset(segment);          
-            put_segment_list(&(cseg->free_list), segment);              
-        }//while(cseg->cached_list.seg_num > keep_seg_num){
-            
-        if(cseg->consumer_active){
-            pthread_cond_wait(&(cseg->not_empty), &(cseg->mutex)); //wait for next time
         }
+        if(cseg_executor.exit){
+            break;
+        }
+        cseg = cseg_executor.run_head;
+        cseg_executor.run_head = cseg->exec_next;
+        if(cseg_executor.run_head == NULL){
+            cseg_executor.run_tail = NULL;
+        }
+        cseg_executor.nb_runnable--;
+        cseg->exec_queued = 0;
+        cseg->exec_running = 1;
+        cseg->exec_pending = 0;
+        executor_clear_poll(cseg);
+        pthread_mutex_unlock(&cseg_executor.lock);
         
-    }//while(cseg->consumer_active){
-    pthread_mutex_unlock(&cseg->mutex);
+        ret = executor_run_channel(cseg);
+        
+        pthread_mutex_lock(&cseg_executor.lock);
+        cseg->exec_running = 0;
+        if(ret == 2){
+            executor_clear_timer(cseg);
+            cseg->exec_done = 1;
+            pthread_cond_broadcast(&cseg_executor.done_cond);
+        }else if(ret == 1 || cseg->exec_pending){
+            //go to the tail for fairness
+            cseg->exec_pending = 0;
+            executor_enqueue(cseg);
+        }else{
+            if(ret == 3){
+                executor_add_poll(cseg);
+            }
+            if(cseg->writer_paused && cseg->retry_time != 0){
+                executor_set_timer(cseg, cseg->retry_time);
+            }else if(spool_timeout(cseg) >= 0){
+                //next backfill of spool
+                executor_set_timer(cseg, cseg->spool.next_time);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cseg_executor.lock);
     
-    //flush all the cached segment 
-    //because cseg->consumer_active is 0 which means no producer existed now, 
-    //we don't need lock any more
-    while((segment = get_segment_list(&(cseg->cached_list))) != NULL){
-        //call writer's method
-        ret = 0;
-        if(cseg->writer != NULL && cseg->writer->write_segment != NULL){                    
-            ret = cseg->writer->write_segment(cseg, segment);
+    return NULL;
+}
+
+/* must be called with executor locked after its threads stopped */
+static void executor_release(void)
+{
+    if(cseg_executor.wake_fd >= 0){
+        close(cseg_executor.wake_fd);
+        cseg_executor.wake_fd = -1;
+    }
+    av_freep(&cseg_executor.poll_set);
+    cseg_executor.poll_set_size = 0;
+}
+
+/* add cseg to the executor, start the executor threads for the first channel */
+static int executor_attach(CachedSegmentContext *cseg)
+{
+    int i, ret = 0;
+    
+    pthread_mutex_lock(&cseg_executor.lock);
+    while(cseg_executor.exit){
+        //the last executor is stopping
+        pthread_cond_wait(&cseg_executor.done_cond, &cseg_executor.lock);
+    }
+    if(cseg_executor.threads == NULL){
+        cseg_executor.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(cseg_executor.wake_fd < 0){
+            ret = AVERROR(errno);
+            pthread_mutex_unlock(&cseg_executor.lock);
+            av_log(NULL, AV_LOG_ERROR, "[cseg] create executor eventfd failed\n");
+            return ret;
+        }
+        cseg_executor.threads = av_mallocz(sizeof(pthread_t) * cseg->nb_executor_threads);
+        if(cseg_executor.threads == NULL){
+            close(cseg_executor.wake_fd);
+            cseg_executor.wake_fd = -1;
+            pthread_mutex_unlock(&cseg_executor.lock);
+            return AVERROR(ENOMEM);
+        }
+        for(i = 0; i < cseg->nb_executor_threads; i++){
+            ret = pthread_create(&cseg_executor.threads[i], NULL, executor_routine, NULL);
+            if(ret){
+                av_log(NULL, AV_LOG_ERROR, "[cseg] start executor thread failed\n");
+                ret = AVERROR(ret);
+                break;
+            }
+            cseg_executor.nb_threads++;
         }
-        cached_segment_reset(segment);          
-        put_segment_list(&(cseg->free_list), segment);         
-        
         if(ret < 0){
-            //error  
-            cseg->consumer_exit_code = ret;
-            break;                
-        }else if(ret == 0){
-            //successful
-            
-        }else if(ret == 1){
-            //should keep in fifo  
-            break;
-        }else{
-            cseg->consumer_exit_code = AVERROR(EINVAL);
-            break;   
+            pthread_t * threads = cseg_executor.threads;
+            int nb_threads = cseg_executor.nb_threads;
+            cseg_executor.exit = 1;
+            pthread_cond_broadcast(&cseg_executor.cond);
+            executor_wake_leader();
+            pthread_mutex_unlock(&cseg_executor.lock);
+            for(i = 0; i < nb_threads; i++){
+                pthread_join(threads[i], NULL);
+            }
+            pthread_mutex_lock(&cseg_executor.lock);
+            av_free(threads);
+            cseg_executor.threads = NULL;
+            cseg_executor.nb_threads = 0;
+            executor_release();
+            cseg_executor.exit = 0;
+            pthread_cond_broadcast(&cseg_executor.done_cond);
+            pthread_mutex_unlock(&cseg_executor.lock);
+            return ret;
         }
+    }else if(cseg->nb_executor_threads != cseg_executor.nb_threads){
+        av_log(NULL, AV_LOG_VERBOSE, "[cseg] executor is running with %d threads, ignore cseg_executor_threads(%d)\n", 
+               cseg_executor.nb_threads, cseg->nb_executor_threads);
     }
+    cseg_executor.nb_channels++;
+    cseg->exec_queued = 0;
+    cseg->exec_running = 0;
+    cseg->exec_pending = 0;
+    cseg->exec_done = 0;
+    cseg->flushing = 0;
+    cseg->on_executor = 1;
+    pthread_mutex_unlock(&cseg_executor.lock);
     
-    return NULL;    
+    return 0;
+}
+
+/* wait for the consumer of cseg finished, stop the executor threads after the last channel */
+static void executor_detach(CachedSegmentContext *cseg)
+{
+    pthread_t * threads = NULL;
+    int i, nb_threads = 0;
+    
+    pthread_mutex_lock(&cseg_executor.lock);
+    while(!cseg->exec_done){
+        pthread_cond_wait(&cseg_executor.done_cond, &cseg_executor.lock);
+    }
+    cseg->on_executor = 0;
+    cseg_executor.nb_channels--;
+    if(cseg_executor.nb_channels == 0){
+        threads = cseg_executor.threads;
+        nb_threads = cseg_executor.nb_threads;
+        cseg_executor.exit = 1;
+        pthread_cond_broadcast(&cseg_executor.cond);
+        executor_wake_leader();
+    }
+    pthread_mutex_unlock(&cseg_executor.lock);
+    
+    if(threads != NULL){
+        for(i = 0; i < nb_threads; i++){
+            pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_lock(&cseg_executor.lock);
+        av_free(threads);
+        cseg_executor.threads = NULL;
+        cseg_executor.nb_threads = 0;
+        executor_release();
+        cseg_executor.exit = 0;
+        pthread_cond_broadcast(&cseg_executor.done_cond);
+        pthread_mutex_unlock(&cseg_executor.lock);
+    }
+}
+
+int cached_segment_queue_depth(CachedSegmentContext *cseg)
+{
+    return segment_ring_count(&cseg->cached_ring);
+}
+
+void cached_segment_executor_stat(int *nb_threads, int *nb_channels, int *nb_runnable)
+{
+    pthread_mutex_lock(&cseg_executor.lock);
+    if(nb_threads){
+        *nb_threads = cseg_executor.nb_threads;
+    }
+    if(nb_channels){
+        *nb_channels = cseg_executor.nb_channels;
+    }
+    if(nb_runnable){
+        *nb_runnable = cseg_executor.nb_runnable;
+    }
+    pthread_mutex_unlock(&cseg_executor.lock);
 }
 
 
@@ -432,9 +3367,18 @@ static int cseg_start(AVFormatContext *s)
         err = AVERROR(ENOMEM);
         return err;      
     }
+    if((cseg->flags & CSEG_FLAG_MD5) && segment->md5 == NULL){
+        segment->md5 = av_md5_alloc();
+        if(!segment->md5){
+            recycle_free_segment(cseg, segment);
+            err = AVERROR(ENOMEM);
+            return err;
+        }
+        av_md5_init(segment->md5);
+    }
     
     avio_out = avio_alloc_context(cseg->out_buffer, SEGMENT_IO_BUFFER_SIZE,
-                                  1, segment, NULL, &write_segment, NULL);
+                                  1, cseg, NULL, &write_cur_segment, NULL);
     if (!avio_out) {
         recycle_free_segment(cseg, segment);
         err = AVERROR(ENOMEM);
@@ -447,6 +3391,13 @@ static int cseg_start(AVFormatContext *s)
     cseg->cur_segment = segment;
     cseg->number++;   
     segment->sequence = cseg->sequence++;
+    
+    if(cseg->stream){
+        //publish it for the consumer to stream
+        segment->recording = 1;
+        __atomic_store_n(&cseg->live_segment, segment, __ATOMIC_RELEASE);
+        wakeup_consumer(cseg);
+    }
 
     if (oc->oformat->priv_class && oc->priv_data)
         av_opt_set(oc->priv_data, "mpegts_flags", "resend_headers", 0);
@@ -465,8 +3416,8 @@ static int cseg_write_header(AVFormatContext *s)
     int basename_size;
     CachedSegmentWriter * writer;
     
-    pthread_mutex_init(&cseg->mutex, NULL);
-    pthread_cond_init(&cseg->not_empty, NULL);
+    cseg->not_empty_fd = -1;
+    cseg->not_full_fd = -1;
     cseg->sequence       = cseg->start_sequence;
     cseg->recording_time = cseg->time * AV_TIME_BASE;
     cseg->start_dts = AV_NOPTS_VALUE;
@@ -518,12 +3469,55 @@ static int cseg_write_header(AVFormatContext *s)
 
     cseg->filename = av_strdup(s->filename);
     cseg->out_buffer = av_malloc(SEGMENT_IO_BUFFER_SIZE);
-    init_segment_list(&cseg->cached_list);
+    if(cseg->out_buffer == NULL){
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
     init_segment_list(&cseg->free_list);   
+    if ((ret = init_segment_ring(&cseg->cached_ring, cseg->max_nb_segments)) < 0)
+        goto fail;
+    // all the segments except the current one may be in consumer's hand
+    if ((ret = init_segment_ring(&cseg->recycle_ring, cseg->max_nb_segments + 1)) < 0)
+        goto fail;
+    if(cseg->low_nb_segments < 0 || cseg->low_nb_segments >= cseg->max_nb_segments){
+        cseg->low_nb_segments = cseg->max_nb_segments - 1;
+    }
+    if ((ret = chunk_pool_attach(cseg)) < 0){
+        av_log(s, AV_LOG_ERROR, "Pre-warm segment chunks failed\n");
+        goto fail;
+    }
+    for (i = 0; i < cseg->pool_size; i++) {
+        CachedSegment * segment = cseg_segment_alloc(cseg, cseg->max_seg_size);
+        if (segment == NULL) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        put_segment_list(&cseg->free_list, segment);
+    }
+    cseg->not_empty_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    cseg->not_full_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(cseg->not_empty_fd < 0 || cseg->not_full_fd < 0){
+        ret = AVERROR(errno);
+        av_log(s, AV_LOG_ERROR, "Create eventfd failed\n");
+        goto fail;
+    }
     cseg->last_mux_dts = (int64_t *)av_malloc(sizeof(int64_t) * s->nb_streams);
     for (i = 0; i < s->nb_streams; i++) {
         cseg->last_mux_dts[i] = AV_NOPTS_VALUE;
     }
+    
+    //segments which cannot be written at the moment are kept on disk and backfilled later
+    if(cseg->spool_dir != NULL && strlen(cseg->spool_dir) != 0){
+        if ((ret = spool_open(cseg)) < 0)
+            goto fail;
+        if(cseg->spool.has_state && cseg->spool.next_sequence > cseg->sequence){
+            //continue the sequence of the last run
+            av_log(s, AV_LOG_INFO, "Resume sequence %"PRId64" from journal\n", cseg->spool.next_sequence);
+            cseg->sequence = cseg->spool.next_sequence;
+        }
+    }else if(cseg->flags & CSEG_FLAG_JOURNAL){
+        av_log(s, AV_LOG_WARNING, "Journal needs cseg_spool_dir, disable it\n");
+    }
 
     if ((ret = cseg_mux_init(s)) < 0)
         goto fail;
@@ -570,21 +3564,68 @@ static int cseg_write_header(AVFormatContext *s)
         }
     }   
     
+    //write segments asynchronously by the writer itself or upload workers
+    cseg->nb_uploading = 0;
+    cseg->retry_seed = (unsigned)av_gettime();
+    if((cseg->writer->capabilities & CSEG_WRITER_CAP_ASYNC) && cseg->writer->submit_segment != NULL && 
+       cseg->max_inflight > 1){
+        cseg->parallel_upload = 1;
+        cseg->inflight_window = cseg->max_inflight;
+    }else if(cseg->nb_upload_workers > 1 && cseg->writer->upload_segment != NULL){
+        cseg->parallel_upload = 1;
+        cseg->inflight_window = cseg->nb_upload_workers;
+        if ((ret = start_upload_workers(cseg)) < 0){
+            stop_upload_workers(cseg);
+            goto fail;
+        }
+    }else if(cseg->nb_upload_workers > 1){
+        av_log(s, AV_LOG_WARNING, "Writer(%s) cannot upload in parallel, use a single worker\n", 
+               cseg->writer->name);
+    }
+    
+    //streaming holds the consumer for the whole segment, so it needs a serial consumer thread
+    if(cseg->stream && 
+       (!(cseg->writer->capabilities & CSEG_WRITER_CAP_STREAM) || 
+        cseg->writer->stream_segment == NULL || cseg->writer->finish_segment == NULL || 
+        cseg->parallel_upload || cseg->nb_executor_threads > 0)){
+        av_log(s, AV_LOG_WARNING, "Writer(%s) cannot stream the segment being recorded, disable cseg_stream\n", 
+               cseg->writer->name);
+        cseg->stream = 0;
+    }
+    
+    if(cseg->spool.active && 
+       cseg->writer->write_segment == NULL && cseg->writer->write_segments == NULL){
+        av_log(s, AV_LOG_WARNING, "Writer(%s) cannot backfill the spooled segments, disable spool\n", 
+               cseg->writer->name);
+        spool_close(cseg);
+    }
+    if(cseg->spool.has_state && cseg->writer->restore_state != NULL){
+        cseg->writer->restore_state(cseg, cseg->spool.writer_state);
+    }
+    
     //successful write header, start consumer
     cseg->consumer_active = 1;
     cseg->consumer_exit_code = 0;
-    ret = pthread_create(&(cseg->consumer_thread_id), NULL, consumer_routine, cseg);
-    if(ret){
+    if(cseg->nb_executor_threads > 0){
+        //run on the shared executor instead of its own thread
+        if ((ret = executor_attach(cseg)) < 0){
+            cseg->consumer_active = 0;
+            stop_upload_workers(cseg);
+            goto fail;
+        }
+    }else if ((ret = pthread_create(&(cseg->consumer_thread_id), NULL, consumer_routine, cseg))){
         av_log(s, AV_LOG_ERROR, "Start consumer thread failed");
         ret = AVERROR(ret);
         cseg->consumer_active = 0;
         cseg->consumer_thread_id  = 0;
+        stop_upload_workers(cseg);
         goto fail;
     }    
     
 fail:
     av_dict_free(&options);
     if (ret < 0) {
+        spool_close(cseg);
         if(cseg->writer){
             if(cseg->writer->uninit){
                 cseg->writer->uninit(cseg);
@@ -616,8 +3657,18 @@ fail:
         if(cseg->format_options){
             av_dict_free(&cseg->format_options);            
         }
-        pthread_cond_destroy(&cseg->not_empty);
-        pthread_mutex_destroy(&cseg->mutex);        
+        free_segment_ring(&cseg->cached_ring);
+        free_segment_ring(&cseg->recycle_ring);
+        free_segment_list(&cseg->free_list);
+        chunk_pool_detach(cseg);
+        if(cseg->not_empty_fd >= 0){
+            close(cseg->not_empty_fd);
+            cseg->not_empty_fd = -1;
+        }
+        if(cseg->not_full_fd >= 0){
+            close(cseg->not_full_fd);
+            cseg->not_full_fd = -1;
+        }
     }
     return ret;
 }
@@ -884,14 +3935,13 @@ static int cseg_write_trailer(struct AVFormatContext *s)
         avio_flush(oc->pb);
         av_freep(&(oc->pb));
         
-        pthread_mutex_lock(&cseg->mutex);
-        if((cseg->flags & CSEG_FLAG_NONBLOCK) && (cseg->cached_list.seg_num >= cseg->max_nb_segments)){
+        if((cseg->flags & CSEG_FLAG_NONBLOCK) && 
+           (segment_ring_count(&cseg->cached_ring) >= cseg->max_nb_segments) && 
+           !(cseg->cur_segment != NULL && withdraw_live_segment(cseg, cseg->cur_segment))){
             if(cseg->cur_segment != NULL){
-                cached_segment_reset(cseg->cur_segment);
-                put_segment_list(&(cseg->free_list), cseg->cur_segment);
+                recycle_free_segment(cseg, cseg->cur_segment);
                 cseg->cur_segment = NULL;                
             }
-            pthread_mutex_unlock(&cseg->mutex); 
             
 //Jam(2018-01-12): remove this logic, keep the first and unfinished segment
 /*            
@@ -901,18 +3951,15 @@ static int cseg_write_trailer(struct AVFormatContext *s)
             // don't write this single unfinished segment to avoid record fragmentation
 
             if(cseg->cur_segment != NULL){
-                cached_segment_reset(cseg->cur_segment);
-                put_segment_list(&(cseg->free_list), cseg->cur_segment);
+                recycle_free_segment(cseg, cseg->cur_segment);
                 cseg->cur_segment = NULL;                
             }
-            pthread_mutex_unlock(&cseg->mutex);   
             av_log(s, AV_LOG_ERROR,
                     "drop the current single unfinished segment\n");           
 */ 
 
         }else{
             
-            pthread_mutex_unlock(&cseg->mutex);  
             append_cur_segment(s); // lose the control of cseg->cur_segment            
         }
     }//if (oc->pb) {
@@ -920,10 +3967,8 @@ static int cseg_write_trailer(struct AVFormatContext *s)
     if(cseg->consumer_thread_id != 0){
         void * res;
         int ret;
-        pthread_mutex_lock(&cseg->mutex); 
-        cseg->consumer_active = 0;          
-        pthread_cond_signal(&cseg->not_empty); //wakeup comsumer
-        pthread_mutex_unlock(&cseg->mutex);  
+        __atomic_store_n(&cseg->consumer_active, 0, __ATOMIC_RELEASE);
+        notify_fd(cseg->not_empty_fd); //wakeup comsumer
                 
         ret = pthread_join(cseg->consumer_thread_id, &res);
         if (ret != 0){
@@ -931,6 +3976,11 @@ static int cseg_write_trailer(struct AVFormatContext *s)
         }
         cseg->consumer_thread_id = 0;
         
+    }else if(cseg->on_executor){
+        av_log(s, AV_LOG_VERBOSE, "queue depth %d at stop\n", cached_segment_queue_depth(cseg));
+        __atomic_store_n(&cseg->consumer_active, 0, __ATOMIC_RELEASE);
+        executor_schedule(cseg);
+        executor_detach(cseg);
     }
     
     if(cseg->writer){
@@ -939,12 +3989,48 @@ static int cseg_write_trailer(struct AVFormatContext *s)
         }
         cseg->writer = NULL;
     }    
+    if(cseg->spool.active && cseg->spool.journal){
+        //the writer has finished its state at uninit, nothing to resume, synced at spool close
+        pthread_mutex_lock(&cseg->spool.lock);
+        cseg->spool.writer_state[0] = 0;
+        spool_mark_dirty(&cseg->spool, 0, 1);
+        pthread_mutex_unlock(&cseg->spool.lock);
+    }
 
     avformat_free_context(oc);
     cseg->avf = NULL;
 
-    free_segment_list(&(cseg->cached_list));
+    if(cseg->wait_count || cseg->nb_dropped){
+        av_log(s, AV_LOG_INFO, 
+               "cached list full %"PRId64" times, %"PRId64" segments dropped, "
+               "muxer blocked %"PRId64" times(total:%.3fs, max:%.3fs)\n",
+               cseg->nb_full, cseg->nb_dropped, cseg->wait_count,  
+               cseg->wait_total_us / 1000000.0, cseg->wait_max_us / 1000000.0);
+    }
+
+    if(cseg->nb_retries){
+        av_log(s, AV_LOG_INFO, "paused writer retried %"PRId64" times\n", cseg->nb_retries);
+    }
+    
+    if(cseg->spool.nb_spooled || cseg->spool.nb_backfilled || cseg->spool.nb_dropped){
+        av_log(s, AV_LOG_INFO, "%"PRId64" segments spooled, %"PRId64" backfilled, %"PRId64" dropped by spool\n", 
+               cseg->spool.nb_spooled, cseg->spool.nb_backfilled, cseg->spool.nb_dropped);
+    }
+    spool_close(cseg);
+
+    free_segment_ring(&(cseg->cached_ring));
+    free_segment_ring(&(cseg->recycle_ring));
     free_segment_list(&(cseg->free_list));
+    chunk_pool_detach(cseg);
+
+    {
+        int64_t reserved, committed, in_use;
+        cached_chunk_pool_stat(&reserved, &committed, &in_use);
+        av_log(s, AV_LOG_VERBOSE, 
+               "chunk pool memory: reserved %"PRId64" bytes, committed %"PRId64" bytes, "
+               "in use %"PRId64" bytes\n", 
+               reserved, committed, in_use);
+    }
 
     av_freep(&cseg->filename);
  
@@ -959,8 +4045,10 @@ static int cseg_write_trailer(struct AVFormatContext *s)
     if(cseg->format_options){
         av_dict_free(&cseg->format_options);            
     }    
-    pthread_cond_destroy(&cseg->not_empty);
-    pthread_mutex_destroy(&cseg->mutex); 
+    close(cseg->not_empty_fd);
+    cseg->not_empty_fd = -1;
+    close(cseg->not_full_fd);
+    cseg->not_full_fd = -1;
    
     return 0;
 }
@@ -969,17 +4057,53 @@ static int cseg_write_trailer(struct AVFormatContext *s)
 #define E AV_OPT_FLAG_ENCODING_PARAM
 static const AVOption options[] = {
     {"fallocate_size",  "set fallocate size for ivr writer",        OFFSET(fallocate_size),AV_OPT_TYPE_INT64,  {.i64 = 0},     0, INT64_MAX, E},
+    {"fs_uring",  "write the local files by io_uring for ivr writer in asynchronous mode",        OFFSET(fs_uring),AV_OPT_TYPE_INT,  {.i64 = 0},     0, 1, E},
+    {"fs_direct",  "write the local files with O_DIRECT for ivr writer, needs fs_uring",        OFFSET(fs_direct),AV_OPT_TYPE_INT,  {.i64 = 0},     0, 1, E},
+    {"lease_num",  "set number of file URIs leased ahead by ivr writer, 0 to disable",        OFFSET(lease_num),AV_OPT_TYPE_INT,  {.i64 = 0},     0, 64, E},
+    {"save_batch_num",  "set number of file saves sent in one request by ivr writer, 0 to disable",        OFFSET(save_batch_num),AV_OPT_TYPE_INT,  {.i64 = 0},     0, 64, E},
+    {"save_batch_delay",  "set max delay in seconds of a file save batched by ivr writer",        OFFSET(save_batch_delay),AV_OPT_TYPE_DOUBLE,  {.dbl = 1.0},     0, 60, E},
+    {"http2",  "use HTTP/2 by ivr writer, the requests are multiplexed on one connection",        OFFSET(http2),AV_OPT_TYPE_INT,  {.i64 = 0},     0, 1, E},
+    {"http_verbose",  "dump curl verbose output of ivr writer to stderr",        OFFSET(http_verbose),AV_OPT_TYPE_INT,  {.i64 = 0},     0, 1, E},
+    {"http_append_num",  "set number of segments aggregated into one HTTP object by ivr writer, 0 to disable. "
+                        "It requires an IVR server whose storage accepts PUT with Content-Range (not S3 or OSS), "
+                        "the server confirms it by upload_mode range in op=create",        OFFSET(http_append_num),AV_OPT_TYPE_INT,  {.i64 = 0},     0, 1024, E},
+    {"http_stat_level",  "set log level of the request timing of ivr writer",        OFFSET(http_stat_level),AV_OPT_TYPE_INT,  {.i64 = AV_LOG_VERBOSE},     AV_LOG_QUIET, AV_LOG_DEBUG, E},
     {"start_number",  "set first number in the sequence",        OFFSET(start_sequence),AV_OPT_TYPE_INT64,  {.i64 = 0},     0, INT64_MAX, E},
     {"cseg_time",      "set segment length in seconds",           OFFSET(time),    AV_OPT_TYPE_DOUBLE,  {.dbl = 10},     0, FLT_MAX, E},
     {"cseg_list_size", "set maximum number of the cache list",  OFFSET(max_nb_segments),    AV_OPT_TYPE_INT,    {.i64 = 3},     1, INT_MAX, E},
+    {"cseg_list_low_size", "set the cache list size to resume the blocked muxer, -1 for cseg_list_size - 1",  OFFSET(low_nb_segments),    AV_OPT_TYPE_INT,    {.i64 = -1},     -1, INT_MAX, E},
     {"cseg_ts_options","set hls mpegts list of options for the container format used for hls", OFFSET(format_options_str), AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,    E},
-    {"cseg_seg_size",  "set maximum segment size in bytes",        OFFSET(max_seg_size),AV_OPT_TYPE_INT,  {.i64 = 10485760},     0, INT_MAX, E},
+    {"cseg_seg_size",  "set maximum segment size in bytes, 0 for no limit",        OFFSET(max_seg_size),AV_OPT_TYPE_INT,  {.i64 = 0},     0, INT_MAX, E},
     {"start_ts",      "set start timestamp (in seconds) for the first segment", OFFSET(start_ts),    AV_OPT_TYPE_DOUBLE,  {.dbl = -1.0},     -1.0, DBL_MAX, E},
     {"cseg_cache_time", "set min cache time in seconds for writer pause", OFFSET(pre_recoding_time),    AV_OPT_TYPE_DOUBLE,  {.dbl = 0},     0, DBL_MAX, E},
     {"use_localtime",          "set filename expansion with strftime at segment creation", OFFSET(use_localtime), AV_OPT_TYPE_INT, {.i64 = 0 }, 0, 1, E },
+    {"cseg_upload_workers", "set number of workers uploading segments in parallel",  OFFSET(nb_upload_workers),    AV_OPT_TYPE_INT,    {.i64 = 1},     1, 64, E},
+    {"cseg_retry_min", "set min seconds to retry the paused writer, 0 for retry only on new segment", OFFSET(retry_min),    AV_OPT_TYPE_DOUBLE,  {.dbl = 0.5},     0, DBL_MAX, E},
+    {"cseg_retry_max", "set max seconds to retry the paused writer, 0 for no limit of backoff", OFFSET(retry_max),    AV_OPT_TYPE_DOUBLE,  {.dbl = 10},     0, DBL_MAX, E},
+    {"cseg_max_inflight", "set max number of segments submitted to an asynchronous writer, 1 to write one by one. "
+                          "More than 1 changes the requests of the ivr writer: op=create no longer carries last_file_name, "
+                          "each file is saved by its own op=save",  OFFSET(max_inflight),    AV_OPT_TYPE_INT,    {.i64 = 1},     1, 1024, E},
+    {"cseg_stream", "upload the segment while it is being recorded if the writer supports it, with a serial writer",  OFFSET(stream),    AV_OPT_TYPE_INT,    {.i64 = 0},     0, 1, E},
+    {"cseg_executor_threads", "set number of threads of the executor shared by all cseg outputs, 0 for a dedicated consumer thread",  OFFSET(nb_executor_threads),    AV_OPT_TYPE_INT,    {.i64 = 0},     0, 1024, E},
     {"writer_timeout",     "set timeout (in milliseconds) of writer I/O operations", OFFSET(writer_timeout),     AV_OPT_TYPE_INT, { .i64 = 30000 },         -1, INT_MAX, .flags = E },
     {"cseg_flags",     "set flags affecting cached segement working policy", OFFSET(flags), AV_OPT_TYPE_FLAGS, {.i64 = 0 }, 0, UINT_MAX, E, "flags"},
     {"nonblock",   "never blocking in the write_packet() when the cached list is full, instead, dicard the eariest segment", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_NONBLOCK }, 0, UINT_MAX,   E, "flags"},
+    {"release_pages",   "give back the memory pages of the written segment to system", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_RELEASE_PAGES }, 0, UINT_MAX,   E, "flags"},
+    {"hugepage",   "back the segment memory with huge pages if possible", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_HUGEPAGE }, 0, UINT_MAX,   E, "flags"},
+    {"mlock",   "lock the segment memory to prevent it from being swapped out", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_MLOCK }, 0, UINT_MAX,   E, "flags"},
+    {"md5",   "compute the MD5 of segment during muxing for the writer to verify the upload", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_MD5 }, 0, UINT_MAX,   E, "flags"},
+    {"journal",   "record the segments in cseg_spool_dir before writing, the unwritten ones are resumed after restart", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_FLAG_JOURNAL }, 0, UINT_MAX,   E, "flags"},
+    {"cseg_spool_dir", "set directory to spool the segments which cannot be written at the moment, they are backfilled once the writer recovers", OFFSET(spool_dir), AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,    E},
+    {"cseg_spool_max_size", "set max bytes of the spooled data, 0 for no limit",  OFFSET(spool_max_size),    AV_OPT_TYPE_INT64,    {.i64 = 0},     0, INT64_MAX, E},
+    {"cseg_durability", "set when the data written to local files is durable, before the segment is reported written", OFFSET(durability), AV_OPT_TYPE_INT, {.i64 = CSEG_DURABILITY_NONE }, 0, CSEG_DURABILITY_GROUP, E, "durability"},
+    {"none",   "leave the data in page cache", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_DURABILITY_NONE }, 0, 0,   E, "durability"},
+    {"segment",   "fdatasync each segment", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_DURABILITY_SEGMENT }, 0, 0,   E, "durability"},
+    {"group",   "start writeback of each segment, fdatasync the files written by all outputs together every cseg_sync_interval", 0, AV_OPT_TYPE_CONST, {.i64 = CSEG_DURABILITY_GROUP }, 0, 0,   E, "durability"},
+    {"cseg_sync_interval", "set interval in milliseconds of the group commit of local files",  OFFSET(sync_interval),    AV_OPT_TYPE_INT,    {.i64 = 100},     1, 60000, E},
+    {"cseg_spool_rate", "set max bytes per second to backfill the spooled segments, 0 for no limit",  OFFSET(spool_rate),    AV_OPT_TYPE_INT64,    {.i64 = 0},     0, INT64_MAX, E},
+    {"cseg_pool_size", "set number of segments pre-allocated at start",  OFFSET(pool_size),    AV_OPT_TYPE_INT,    {.i64 = 0},     0, INT_MAX, E},
+    {"cseg_pool_seg_size", "set bytes of memory pre-warmed for each pre-allocated segment",  OFFSET(pool_seg_size),    AV_OPT_TYPE_INT,    {.i64 = 2097152},     0, INT_MAX, E},
+    {"cseg_pool_idle_time", "set seconds after which idle segment memory is given back to system, 0 for never", OFFSET(pool_idle_time),    AV_OPT_TYPE_DOUBLE,  {.dbl = 0},     0, DBL_MAX, E},
 
     { NULL },
 };
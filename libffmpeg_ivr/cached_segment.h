@@ -25,6 +25,8 @@
 #include <float.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,20 +39,102 @@ extern "C" {
 struct CachedSegmentContext;
 typedef struct CachedSegmentContext CachedSegmentContext;
 
+#define CSEG_CHUNK_SIZE (64 * 1024)
+#define CSEG_WRITER_STATE_SIZE 256   /* max length of the writer state saved in journal */
+
+/* fixed-size piece of segment data, taken from the shared chunk pool */
+typedef struct CachedSegmentChunk {
+    struct CachedSegmentChunk *next;
+    int size;           /* used bytes in data */
+    uint8_t *data;      /* CSEG_CHUNK_SIZE bytes, page aligned */
+    int committed;      /* data pages may be resident */
+    int pinned;         /* data pages cannot be released, e.g. hugetlb pages */
+    int locked;         /* data pages are locked by mlock */
+    int64_t idle_since; /* time of entering the free list of pool */
+    int64_t idle_time;  /* in micro-seconds, released after idle for longer in free list, 0 for never */
+} CachedSegmentChunk;
+
+typedef enum CachedSegmentState {
+    CSEG_SEGMENT_IDLE = 0,      /* waiting to be written */
+    CSEG_SEGMENT_UPLOADING,     /* handed to an upload worker */
+    CSEG_SEGMENT_UPLOADED,      /* upload finished, waiting for commit */
+} CachedSegmentState;
+
+typedef enum CachedSegmentJournalState {
+    CSEG_JOURNAL_NONE = 0,      /* data of the journal record not written */
+    CSEG_JOURNAL_QUEUED,        /* queued to spool thread to write the data */
+    CSEG_JOURNAL_WRITING,       /* data being written, the segment must be kept */
+    CSEG_JOURNAL_STORED,        /* data written and synced */
+} CachedSegmentJournalState;
+
 typedef struct CachedSegment {
-    //uint8_t *buffer;
     int size;
     double start_ts; /* start timestamp, in seconds */
     double duration; /* in seconds */
     int64_t start_dts; /* start dts, in timebase */
     int64_t next_dts; /* start dts for next segment, in timebase */
     int64_t pos;
-    int buffer_max_size;   
+    int buffer_max_size;   /* 0 means no limit */
+    int release_pages;     /* give back the chunk pages to system on reset */
+    int pool_flags;        /* CSEG_FLAG_HUGEPAGE and CSEG_FLAG_MLOCK of the chunks taken */
+    int64_t pool_idle_time;/* idle_time of the chunks given back */
     int64_t sequence;
     struct CachedSegment *next;
-    uint8_t buffer[0];
+    int nb_chunks;
+    CachedSegmentChunk *first_chunk, *last_chunk;  /* segment data */
+    
+    volatile int state;    /* enum CachedSegmentState */
+    int upload_ret;        /* return code of upload_segment */
+    void *writer_data;     /* private data of writer for this segment, freed with the segment */
+    
+    struct AVMD5 *md5;     /* running MD5 of the data, NULL if not computed */
+    int has_md5;           /* md5_digest is valid, i.e. the segment is complete */
+    uint8_t md5_digest[16];
+    
+    /* streaming of the segment still being recorded, see stream_segment of writer */
+    volatile int recording;        /* the muxer is still writing the data */
+    int streamed;                  /* taken by the consumer for streaming, stream_ret is valid */
+    int stream_ret;                /* return code of stream_segment */
+    int dropped;                   /* the streamed segment is invalid and dropped by muxer */
+    CachedSegmentChunk *stream_chunk;  /* read position of cached_segment_stream_read() */
+    int stream_chunk_pos;
+    
+    int journal_index;     /* record of the segment in journal, -1 if not journaled */
+    int journal_state;     /* enum CachedSegmentJournalState, protected by the spool lock */
+    int journal_job;       /* slot in spool jobs while queued */
+    int64_t journal_offset;  /* data offset of the journal record in spool.dat */
 } CachedSegment;
 
+/* 
+ * fill iov with the data chunks of segment from the chunk start_chunk, 
+ * return the number of iovec filled 
+ */
+int cached_segment_iov(CachedSegment *segment, int start_chunk, 
+                       struct iovec *iov, int max_iov);
+
+/* 
+ * memory statistics of the shared chunk pool in bytes, 
+ * reserved is the mapped address space, committed is the part which may be resident, 
+ * in_use is the part held by segments
+ */
+void cached_chunk_pool_stat(int64_t *reserved, int64_t *committed, int64_t *in_use);
+
+/* 
+ * make the data written to fd in [offset, offset + len) durable by the policy durability. 
+ * For CSEG_DURABILITY_GROUP, the write-behind of the range is started, then it waits for 
+ * the next group commit, which fdatasync() the local files written by all the cseg outputs 
+ * in the last interval milliseconds. 
+ * return 0 on success, or a negative AVERROR
+ */
+int cached_file_sync(int fd, int64_t offset, int64_t len, int durability, int interval);
+
+/* 
+ * make the entry of the file just created at path durable, i.e. fsync() its directory, 
+ * unless durability is CSEG_DURABILITY_NONE. 
+ * return 0 on success, or a negative AVERROR
+ */
+int cached_dir_sync(const char *path, int durability);
+
 
 typedef struct CachedSegmentList {
     uint32_t seg_num;
@@ -63,6 +147,36 @@ CachedSegment * get_segment_list(CachedSegmentList *seg_list);
 void free_segment_list(CachedSegmentList *seg_list);
 
 
+/*
+ * bounded lock-free ring of segments for exactly one producer thread 
+ * and one consumer thread
+ */
+typedef struct CachedSegmentRing {
+    CachedSegment **slots;
+    uint32_t mask;              /* capacity - 1, capacity is a power of 2 */
+    volatile uint32_t head;     /* next slot to get, only written by consumer */
+    volatile uint32_t tail;     /* next slot to put, only written by producer */
+} CachedSegmentRing;
+
+//return 0 on success, a negative AVERROR on failure.
+int init_segment_ring(CachedSegmentRing *ring, uint32_t min_capacity);
+//producer side, return 0 on success, -1 if the ring is full
+int put_segment_ring(CachedSegmentRing *ring, CachedSegment * segment);
+//consumer side, get the index-th segment from the head without removing it
+CachedSegment * peek_segment_ring(CachedSegmentRing *ring, uint32_t index);
+//consumer side, remove the head segment
+CachedSegment * get_segment_ring(CachedSegmentRing *ring);
+uint32_t segment_ring_count(CachedSegmentRing *ring);
+//free the ring and all the segments in it, no other thread can access it
+void free_segment_ring(CachedSegmentRing *ring);
+
+
+
+typedef enum CachedSegmentWriterCaps {
+    CSEG_WRITER_CAP_ASYNC = (1 << 0),   /* implements submit_segment, segments complete asynchronously */
+    CSEG_WRITER_CAP_BATCH = (1 << 2),   /* can write several segments in one operation */
+    CSEG_WRITER_CAP_STREAM = (1 << 3),  /* implements stream_segment, uploads the segment while recording */
+} CachedSegmentWriterCaps;
 
 typedef struct CachedSegmentWriter {
     
@@ -94,15 +208,160 @@ typedef struct CachedSegmentWriter {
     int (*write_segment)(CachedSegmentContext *cseg, CachedSegment *segment);
     
     void (*uninit)(CachedSegmentContext *cseg);
+    
+    //optional, used instead of write_segment when cseg_upload_workers > 1.
+    //It is called by several upload workers at the same time, 
+    //worker is the index of the calling one in [0, cseg->nb_upload_workers).
+    //return the same as write_segment
+    int (*upload_segment)(CachedSegmentContext *cseg, CachedSegment *segment, int worker);
+    
+    //optional, called in sequence order after upload_segment returns, 
+    //upload_ret is the return code of upload_segment.
+    //return the same as write_segment, 1 means the segment would be uploaded again, 
+    //the writer may keep writer_data to only retry the commit then
+    //At exit, it is called with AVERROR_EXIT for the segments uploaded but not committed, 
+    //then the writer should discard the upload and free writer_data
+    int (*commit_segment)(CachedSegmentContext *cseg, CachedSegment *segment, int upload_ret);
+    
+    /* 
+     * asynchronous API (v2), used when capabilities has CSEG_WRITER_CAP_ASYNC. 
+     * Writers without it are driven through the blocking API above.
+     */
+    int capabilities;     // CachedSegmentWriterCaps
+    
+    //start writing the segment and return at once, the writer must call 
+    //cached_segment_complete() when it finished, from any thread. 
+    //return 0 if accepted, 1 if no more segment can be accepted for the moment, 
+    //a negative AVERROR if failed (the segment is completed with it)
+    int (*submit_segment)(CachedSegmentContext *cseg, CachedSegment *segment);
+    
+    //optional, for the writer without its own threads to progress the submitted segments,
+    //called by consumer when segments are in flight, block at most timeout ms.
+    //return 0 on success, a negative AVERROR on failure
+    int (*poll)(CachedSegmentContext *cseg, int timeout);
+    
+    //optional, for the writer with poll() run on the shared executor, 
+    //fill at most max_fds descriptors that poll() would wait for and set timeout (ms, -1 for none) 
+    //before which poll() must be called again. 
+    //return the number of descriptors needed (may exceed max_fds), a negative AVERROR on failure
+    int (*poll_fds)(CachedSegmentContext *cseg, struct pollfd *fds, int max_fds, int *timeout);
+    
+    //optional, abort a submitted segment, it must be completed still (with AVERROR_EXIT)
+    void (*cancel)(CachedSegmentContext *cseg, CachedSegment *segment);
+    
+    //optional, used instead of write_segment when capabilities has CSEG_WRITER_CAP_BATCH, 
+    //write the contiguous ready segments in sequence order at once. 
+    //nb_written returns the number of the leading segments which are written successfully, 
+    //return 0 if all written, otherwise the same as write_segment for the first unwritten one
+    int (*write_segments)(CachedSegmentContext *cseg, CachedSegment **segments, int nb_segments, 
+                          int *nb_written);
+    
+    /* 
+     * streaming API, used when capabilities has CSEG_WRITER_CAP_STREAM and cseg_stream is set. 
+     * Once the writer has caught up, the segment being recorded is handed to it before it ends.
+     */
+    
+    //upload the data of the segment still being recorded, read by cached_segment_stream_read() 
+    //until it returns 0 at the end of segment. Its duration and next_dts are not known yet.
+    //return 0 on success, a negative AVERROR on failure
+    int (*stream_segment)(CachedSegmentContext *cseg, CachedSegment *segment);
+    
+    //called instead of write_segment for the segment passed to stream_segment after it ended, 
+    //with the final duration and next_dts, stream_ret is the return of stream_segment. 
+    //The segment has dropped set if the muxer discarded it, whose data should be abandoned. 
+    //return the same as write_segment
+    int (*finish_segment)(CachedSegmentContext *cseg, CachedSegment *segment, int stream_ret);
+    
+    /* 
+     * journal API, optional, used when cseg_flags has journal. 
+     * The writer state is saved after each written segment and restored after restart.
+     */
+    
+    //fill state with a string of at most state_size bytes (including the terminating 0), 
+    //return 0 on success, a negative AVERROR if no state to save
+    int (*save_state)(CachedSegmentContext *cseg, char *state, int state_size);
+    
+    //called after init with the state saved by the last run
+    void (*restore_state)(CachedSegmentContext *cseg, const char *state);
 } CachedSegmentWriter;
     
 
 typedef enum CachedSegmentFlags {
     CSEG_FLAG_NONBLOCK = (1 << 0),
+    CSEG_FLAG_RELEASE_PAGES = (1 << 1),
+    CSEG_FLAG_HUGEPAGE = (1 << 2),
+    CSEG_FLAG_MLOCK = (1 << 3),
+    CSEG_FLAG_MD5 = (1 << 4),
+    CSEG_FLAG_JOURNAL = (1 << 5),
 } CachedSegmentFlags;
 
+/* when the data written to the local files is durable, before the segment is reported written */
+typedef enum CachedSegmentDurability {
+    CSEG_DURABILITY_NONE = 0,   /* left in page cache */
+    CSEG_DURABILITY_SEGMENT,    /* fdatasync() each segment */
+    CSEG_DURABILITY_GROUP,      /* write-behind each segment, fdatasync() the files together every sync interval */
+} CachedSegmentDurability;
+
+
+
+
+/* 
+ * local disk spool of the segments which cannot be written at the moment, 
+ * they are backfilled to the writer in order once it recovers. 
+ * With journal, every completed segment is recorded in it before being written, 
+ * so that the segments not written yet are backfilled after restart
+ */
+typedef struct CachedSegmentSpool {
+    pthread_mutex_t lock;   /* appended by both muxer and consumer, never held during data I/O */
+    int active;
+    int journal;            /* cseg_flags has journal */
+    int data_fd;            /* spool.dat, the data of spooled segments appended in order */
+    int index_fd;           /* spool.idx, one fixed-size record for each spooled segment */
+    int state_fd;           /* spool.state, the next sequence and writer state for journal */
+    int64_t data_size;      /* including the space reserved for the data being written */
+    int nb_writing;         /* data being written without record yet, no compaction until 0 */
+    int nb_records;         /* records in spool.idx */
+    int nb_pending;         /* records not done, spool is compacted when it drops to 0 */
+    volatile int nb_backfill;  /* pending records to backfill, i.e. not journaled by this run */
+    int head;               /* no record before it to backfill, only written by consumer */
+    int64_t pending_size;   /* bytes not done */
+    
+    /* journal state */
+    int has_state;          /* loaded from spool.state of the last run */
+    int64_t next_sequence;
+    char writer_state[CSEG_WRITER_STATE_SIZE];
+    
+    /* spool thread, writes the segments handed over by the muxer which never waits on disk */
+    pthread_t thread;
+    int has_thread;
+    int thread_exit;        /* protected by lock */
+    pthread_cond_t cond;    /* new work for spool thread or exit, with lock */
+    CachedSegmentList spills;  /* segments overflowed from cached ring, protected by lock */
+    CachedSegment **jobs;   /* ring of journaled segments whose data is to be written, NULL if canceled */
+    int jobs_size;
+    int jobs_head;
+    int nb_jobs;
+    pthread_cond_t done_cond;  /* a journal data write finished, with lock */
+    int index_dirty;        /* spool.idx to be synced by spool thread, protected by lock */
+    int state_dirty;        /* spool.state to be saved and synced by spool thread, protected by lock */
+    
+    /* backfill, only accessed by consumer */
+    CachedSegment *segment; /* spooled segment loaded for the writer */
+    int64_t next_time;      /* time (av_gettime_relative) of next backfill for rate limit or retry */
+    int64_t retry_delay;    /* in micro-seconds, backoff of the failed backfill */
+    
+    int64_t nb_spooled;
+    int64_t nb_backfilled;
+    int64_t nb_dropped;     /* segments not spooled or not backfilled for error */
+} CachedSegmentSpool;
 
 
+typedef struct CachedSegmentUploadWorker {
+    CachedSegmentContext *cseg;
+    int index;
+    pthread_t thread_id;
+} CachedSegmentUploadWorker;
+
 
 struct CachedSegmentContext {
     const AVClass *context_class;  // Class for private options.
@@ -124,7 +383,7 @@ struct CachedSegmentContext {
     double start_ts;        //the timestamp for the start_pts, start ts for the whole video
     double time;            // Set by a private option.
     int max_nb_segments;   // Set by a private option.
-    uint32_t max_seg_size;      // max size for a segment in bytes, set by a private option
+    uint32_t max_seg_size;      // max size for a segment in bytes, 0 for no limit, set by a private option
     uint32_t flags;        // enum HLSFlags
 
     int use_localtime;      ///< flag to expand filename with localtime
@@ -144,10 +403,55 @@ struct CachedSegmentContext {
 //#define CONSUMER_ERR_STR_LEN 1024
     //char consumer_err_str[CONSUMER_ERR_STR_LEN];
     
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    CachedSegmentList cached_list;
-    CachedSegmentList free_list;
+    CachedSegmentRing cached_ring;   // segments to write, muxer -> consumer
+    CachedSegmentRing recycle_ring;  // written segments, consumer -> muxer
+    CachedSegmentList free_list;     // free segments, only accessed by muxer
+    int not_empty_fd;      // eventfd to wakeup consumer 
+    int not_full_fd;       // eventfd to wakeup the muxer blocked on full cached_ring
+    volatile int producer_waiting;
+    int low_nb_segments;   // blocked muxer is resumed when cached_ring drains to it, set by a private option
+    
+    // cached_ring statistics
+    int64_t nb_full;        // times of cached_ring reaching max_nb_segments
+    int64_t nb_dropped;     // segments dropped for slow writer
+    int64_t wait_count;     // times of the muxer blocked on full cached_ring
+    int64_t wait_total_us;  // total blocked time of the muxer 
+    int64_t wait_max_us;    // max blocked time of the muxer
+    
+    uint32_t pause_tail;    // cached_ring tail when the writer paused, only accessed by consumer
+    int writer_paused;
+    double retry_min;       // min backoff in seconds to retry the paused writer, set by a private option
+    double retry_max;       // max backoff in seconds, set by a private option
+    int64_t retry_delay;    // current backoff in micro-seconds, 0 if not paused
+    int64_t retry_time;     // time (av_gettime_relative) to retry the paused writer, 0 for none
+    unsigned retry_seed;    // for backoff jitter
+    int64_t nb_retries;     // times of retrying the paused writer
+    
+    int nb_upload_workers;  // number of parallel upload workers, set by a private option
+    int parallel_upload;    // segments are written asynchronously, by upload workers or the writer
+    CachedSegmentUploadWorker *upload_workers;
+    pthread_mutex_t upload_mutex;
+    pthread_cond_t upload_cond;
+    CachedSegmentList upload_jobs;  // segments to upload, protected by upload_mutex
+    int upload_exit;
+    int nb_uploading;       // segments handed to workers and not committed, only accessed by consumer
+    int upload_cancel;      // upload workers skip the remained jobs, protected by upload_mutex
+    int max_inflight;       // max segments submitted to an asynchronous writer, set by a private option
+    int inflight_window;    // max segments in flight, for upload workers or asynchronous writer
+    
+    int nb_executor_threads;  // > 0 to run consumer on the shared executor, set by a private option
+    int on_executor;        // consumer is running on the shared executor
+    int exec_queued, exec_running, exec_pending, exec_done;  // protected by executor lock
+    int flushing;
+    CachedSegmentContext *exec_next;  // next runnable channel of executor
+    int exec_timer;         // in the timer list of executor, protected by executor lock
+    int64_t exec_deadline;  // retry time of the timer
+    CachedSegmentContext *exec_timer_next;
+    int exec_polling;       // in the poll list of executor, waiting for the I/O of writer
+    CachedSegmentContext *exec_poll_next;
+    int exec_poll_round;    // round of executor poll in which the fds below are collected
+    int exec_poll_first, exec_poll_nb;  // range of the writer fds in the executor poll set
+    int64_t exec_poll_deadline;  // time to call writer poll() again, 0 if none
     
     CachedSegmentWriter *writer;
     void * writer_priv;
@@ -159,6 +463,33 @@ struct CachedSegmentContext {
     int64_t correct_delta;
     
     int64_t fallocate_size;  // the size for fallocate buf file
+    int fs_uring;            // ivr writer writes the local files by io_uring in asynchronous mode
+    int fs_direct;           // ivr writer writes the aligned data of local files with O_DIRECT, needs fs_uring
+    int lease_num;           // number of file URIs leased ahead by ivr writer
+    int save_batch_num;      // number of op=save coalesced into one request by ivr writer
+    double save_batch_delay; // in seconds, max delay of a coalesced op=save
+    int http2;               // ivr writer uses HTTP/2 if the server supports it
+    int http_verbose;        // curl verbose output of ivr writer
+    int http_stat_level;     // log level of the request timing of ivr writer
+    int http_append_num;     // number of segments aggregated into one HTTP object by ivr writer
+    
+    int stream;              // upload the segment while recording if the writer supports it, set by a private option
+    CachedSegment * volatile live_segment;  // segment being recorded which the consumer can take for streaming
+    volatile int stream_waiting;            // consumer waits for the data of live segment
+    
+    char *spool_dir;         // directory to spool the segments which cannot be written, NULL to disable, set by a private option
+    int64_t spool_max_size;  // max bytes in spool, 0 for no limit, set by a private option
+    int64_t spool_rate;      // max bytes per second of backfill, 0 for no limit, set by a private option
+    CachedSegmentSpool spool;
+    
+    int durability;          // CSEG_DURABILITY_* of the local files written, set by a private option
+    int sync_interval;       // in milliseconds, interval of the group commit of local files, set by a private option
+    
+    int pool_size;           // number of segments pre-allocated in write_header, set by a private option
+    int pool_seg_size;       // bytes of chunks pre-warmed for each pre-allocated segment, set by a private option
+    double pool_idle_time;   // free chunks idle for longer are given back to system, set by a private option
+    int pool_attached;       // attached to the shared chunk pool
+    int pool_prewarmed;      // chunks pre-warmed, max free chunks of pool raised by this
     
 };
 
@@ -168,6 +499,30 @@ void register_segment_writer(CachedSegmentWriter * writer);
 
 void register_cseg(void);
 
+/* 
+ * called by the asynchronous writer when a submitted segment finished, 
+ * ret is the same as the return of write_segment
+ */
+void cached_segment_complete(CachedSegmentContext *cseg, CachedSegment *segment, int ret);
+
+/* 
+ * for stream_segment() of writer, copy the next data of segment to buf, 
+ * wait for the muxer if all the data recorded so far has been read. 
+ * return the number of bytes copied, 0 at the end of segment, 
+ * a negative AVERROR if the muxer has stopped
+ */
+int cached_segment_stream_read(CachedSegmentContext *cseg, CachedSegment *segment, 
+                               uint8_t *buf, int buf_size);
+
+/* number of segments waiting in the cached list of a cseg instance */
+int cached_segment_queue_depth(CachedSegmentContext *cseg);
+
+/* 
+ * statistics of the executor shared by cseg instances with cseg_executor_threads, 
+ * nb_channels is the number of attached instances, nb_runnable is the ones waiting for a thread
+ */
+void cached_segment_executor_stat(int *nb_threads, int *nb_channels, int *nb_runnable);
+
 #ifdef __cplusplus
 }
 #endif
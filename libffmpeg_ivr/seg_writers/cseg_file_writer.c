@@ -27,6 +27,8 @@
 #include <pthread.h>
 #include <math.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "libavutil/avassert.h"
 #include "libavutil/mathematics.h"
@@ -51,15 +53,41 @@ static int file_init(CachedSegmentContext *cseg)
 
 
 #define MAX_FILE_NAME 1024
+
+/* write all the chunks of segment to fd */
+static int file_write_data(int fd, CachedSegment *segment)
+{
+    CachedSegmentChunk *chunk;
+    uint8_t *p;
+    int left;
+    ssize_t written;
+    
+    for(chunk = segment->first_chunk; chunk != NULL; chunk = chunk->next){
+        p = chunk->data;
+        left = chunk->size;
+        while(left > 0){
+            written = write(fd, p, left);
+            if(written < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return AVERROR(errno);
+            }
+            p += written;
+            left -= written;
+        }
+    }
+    return 0;
+}
+
 static int file_write_segment(CachedSegmentContext *cseg, CachedSegment *segment)
 {
     char base_name[MAX_FILE_NAME];
     char file_name[MAX_FILE_NAME];
     char ext_name[32] = "";
+    const char *path;
     char *p;
-    AVIOContext *file_context;
-    int ret;
-    uint8_t *buf;
+    int fd, ret;
     
     //printf("file_write_segment is calle\n");
     
@@ -79,20 +107,39 @@ static int file_write_segment(CachedSegmentContext *cseg, CachedSegment *segment
              base_name, segment->start_ts, segment->duration, 
              (long long)segment->sequence, ext_name);
     
-    ret = avio_open(&file_context, file_name, AVIO_FLAG_WRITE);
-    if(ret < 0){
+    //written by the fd synced afterwards, a reopened fd may miss the writeback error
+    path = file_name;
+    av_strstart(file_name, "file:", &path);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd < 0){
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "[cseg_file_writer] open %s failed with errno(%d)\n", 
+               path, errno);
         return ret;
     }
     
-    avio_write(file_context, segment->buffer, segment->size);
-    ret = file_context->error;
+    ret = file_write_data(fd, segment);
     if(ret < 0){
-        avio_closep(&file_context);
-        return ret;
+        av_log(NULL, AV_LOG_ERROR, "[cseg_file_writer] write %s failed with error(%d)\n", 
+               path, ret);
     }
-    avio_closep(&file_context);
-    
-    return 0;
+    if(ret == 0){
+        ret = cached_file_sync(fd, 0, segment->size, cseg->durability, cseg->sync_interval);
+    }
+    if(close(fd) < 0 && ret == 0){
+        ret = AVERROR(errno);
+    }
+    if(ret == 0){
+        //each segment is a new file, its entry must be durable as its data
+        ret = cached_dir_sync(path, cseg->durability);
+    }
+    return ret;
+}
+
+/* each segment goes to its own file, so it is safe to be called in parallel */
+static int file_upload_segment(CachedSegmentContext *cseg, CachedSegment *segment, int worker)
+{
+    return file_write_segment(cseg, segment);
 }
 
 static void file_uninit(CachedSegmentContext *cseg)
@@ -106,5 +153,6 @@ CachedSegmentWriter cseg_file_writer = {
     .init           = file_init, 
     .write_segment  = file_write_segment, 
     .uninit         = file_uninit,
+    .upload_segment = file_upload_segment, 
 };
 
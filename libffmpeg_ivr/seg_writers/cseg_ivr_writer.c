@@ -22,12 +22,17 @@
 
 #define _LARGEFILE64_SOURCE 
 #define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <float.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <curl/curl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -36,59 +41,610 @@
 #include <fcntl.h>
 #include <linux/falloc.h>
 #include <errno.h>
+#ifdef HAVE_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "libavutil/avstring.h"
 #include "libavutil/opt.h"
 #include "libavutil/dict.h"
+#include "libavutil/time.h"
+#include "libavutil/base64.h"
 
 #include "libavformat/avformat.h"
     
 #include "../cached_segment.h"
-#include "../cJSON.h"
 
 #define MIN(a,b) ((a) > (b) ? (b) : (a))
 
-#define HTTP_DEFAULT_RETRY_NUM    2
+#define IVR_BREAKER_FAILURES   5       // consecutive failed requests to open the circuit breaker
+#define IVR_BREAKER_MIN_OPEN   1000000 // in micro-seconds, the first open time of breaker
+#define IVR_BREAKER_MAX_OPEN   30000000
+#define IVR_RETRY_BUDGET_MAX   10.0    // retries allowed in a burst
+#define IVR_RETRY_BUDGET_REFILL 0.2    // retries earned by a successful request
 
-#define RAMDOM_SLEEP_MAX_MS     47
 
 #define MAX_FILE_NAME 128
 #define MAX_URI_LEN 1024
-#define MAX_POST_STR_LEN 255
+#define MAX_POST_STR_LEN 383
+#define MAX_SAVE_JSON_LEN 384   // max length of one file in the op=save_batch body
 
 #define  IVR_NAME_FIELD_KEY  "name"
 #define  IVR_URI_FIELD_KEY  "uri"
 #define  IVR_ERR_INFO_FIELD_KEY "info"
 #define  IVR_NEXT_DTS_FIELD_KEY "next_dts"
+#define  IVR_FILES_FIELD_KEY "files"
+#define  IVR_UPLOAD_MODE_FIELD_KEY "upload_mode"
+#define  IVR_UPLOAD_MODE_RANGE "range"   // the upload URI accepts a PUT of a byte range
 
 #define MAX_HTTP_RESULT_SIZE  4096
 
-#define ENABLE_CURLOPT_VERBOSE
+#define IVR_HTTP_HTTP2    0x1   // use HTTP/2
+#define IVR_HTTP_VERBOSE  0x2   // curl verbose output to stderr
+
+#define HTTP_STAT_BUCKETS 16    // latency histogram buckets of [2^(i-1), 2^i) ms, the last one is unbounded
 
 #define HTTP_REQUEST_TIMEOUT 10000
 
+#define FS_WRITE_IOV_NUM 64
+#define FS_DIRECT_ALIGN  4096   // alignment of the offset, length and buffer of an O_DIRECT write
 
+#define MAX_IDLE_HANDLES 8   // curl handles kept for reuse by asynchronous transfers
 
-typedef struct IvrWriterPriv {
+
+
+/* the operations which requests are timed for */
+typedef enum IvrHttpOp {
+    IVR_OP_CREATE = 0,      // op=create and op=create_batch
+    IVR_OP_UPLOAD,          // PUT of segment
+    IVR_OP_SAVE,            // op=save, op=fail and op=save_batch
+    IVR_OP_OTHER,
+    IVR_OP_NB
+} IvrHttpOp;
+
+static const char * const http_op_names[IVR_OP_NB] = {
+    "create", "upload", "save", "other",
+};
+
+/* 
+ * timing of the requests of an operation, in seconds. 
+ * The times are from the start of request, as the CURLINFO_*_TIME
+ */
+typedef struct HttpOpStat {
+    int nb_requests;
+    double namelookup_time;
+    double connect_time;
+    double appconnect_time;
+    double starttransfer_time;
+    double total_time;
+    double bytes;           // uploaded and downloaded
+    int histogram[HTTP_STAT_BUCKETS];  // of total time
+} HttpOpStat;
+
+/* statistics of requests, to check keep-alive, TLS session resumption and where time goes */
+typedef struct HttpConnStat {
+    int nb_requests;
+    int nb_connects;            // new connections
+    double connect_time;        // in seconds, total time of TCP connect
+    int nb_tls_handshakes;
+    double tls_handshake_time;  // in seconds, total time of TLS handshake
+    HttpOpStat ops[IVR_OP_NB];
+} HttpConnStat;
+
+/* the class of a failed request, which decides how it is retried */
+typedef enum IvrErrClass {
+    IVR_ERR_NONE = 0,
+    IVR_ERR_CONNECT,        // resolve, connect, send or receive failed
+    IVR_ERR_TIMEOUT,        // the request timed out
+    IVR_ERR_THROTTLE,       // status 429 or 503
+    IVR_ERR_SERVER,         // other 5xx status
+    IVR_ERR_CLIENT,         // 4xx status
+    IVR_ERR_OTHER,
+    IVR_ERR_NB
+} IvrErrClass;
+
+typedef struct IvrRetryRule {
+    int max_tries;          // including the first one
+    int base_ms;            // min delay before retry
+    int cap_ms;             // max delay before retry
+    int put_only;           // only the idempotent PUT is retried
+} IvrRetryRule;
+
+/* 
+ * retry budget and circuit breaker of a writer, shared by the consumer thread 
+ * and upload workers. The breaker opens after IVR_BREAKER_FAILURES consecutive 
+ * failed requests, then one request is let through as probe when the open time is up
+ */
+typedef struct IvrRetryPolicy {
+    pthread_mutex_t lock;
+    unsigned int seed;
+    double budget;          // retries left, refilled by the successful requests
+    int nb_failures;        // consecutive failed requests
+    int64_t open_until;     // breaker is open until the time, 0 for closed
+    int64_t open_delay;     // in micro-seconds, doubled on every open
+    int probing;            // a probe request is in flight
+    int nb_retries;
+    int nb_opens;
+} IvrRetryPolicy;
+
+typedef struct IvrHttpHandle {
     CURL * easyhandle;
+    char http_response_buf[MAX_HTTP_RESULT_SIZE];
+    HttpConnStat stat;
+    IvrRetryPolicy * policy;
+} IvrHttpHandle;
+
+struct IvrTransfer;
+
+/* file URI created ahead of the segment */
+typedef struct IvrLease {
+    char filename[MAX_FILE_NAME];
+    char file_uri[MAX_URI_LEN];
+} IvrLease;
+
+/* the file info sent by op=save or op=fail */
+typedef struct IvrSaveInfo {
+    char filename[MAX_FILE_NAME];
+    int success;
+    int has_segment;      // the segment info is sent along, for the file leased before the segment finished
+    int size;
+    double start_ts;
+    double duration;
+    int64_t next_dts;
+    char md5[33];         // hex MD5 of segment, empty if not computed
+} IvrSaveInfo;
+
+typedef struct IvrWriterPriv {
+    IvrHttpHandle http;   // used by consumer thread
+    IvrHttpHandle * upload_http;  // one for each upload worker
+    int nb_upload_http;
+    
+    CURLM * multi;        // for asynchronous transfers
+    struct IvrTransfer * transfers;   // transfers in flight
+    struct pollfd * sockets;  // the sockets curl waits on, kept by CURLMOPT_SOCKETFUNCTION
+    struct pollfd * ready;    // copy of sockets polled, curl may change sockets meanwhile
+    int nb_sockets;
+    int sockets_size;
+    int64_t curl_timer;   // time (av_gettime_relative) curl must be called, 0 for none
+    CURL * idle_handles[MAX_IDLE_HANDLES];
+    int nb_idle_handles;
+    
+    IvrLease * leases;    // leased file URIs, the oldest first
+    int nb_leases;
+    int lease_num;        // number of leases to keep, 0 for disabled
+    int lease_pending;    // a lease request is in flight
+    int http_flags;       // IVR_HTTP_*
+    int http_stat_level;  // log level of the request timing
+    int append_num;       // segments aggregated into one HTTP object by IVR server, 0 for disabled
+    HttpConnStat transfer_stat;  // of the asynchronous transfers
+    IvrRetryPolicy retry;
+    
+    IvrSaveInfo * saves;  // saves waiting to be sent in one op=save_batch, in sequence order
+    int nb_saves;
+    int saves_size;       // capacity of saves
+    int save_batch_num;   // max number of saves in a batch, 0 for disabled
+    int64_t save_batch_delay; // in micro-seconds
+    int64_t save_batch_time;  // time of the first save in batch
+    
     char ivr_rest_uri[MAX_URI_LEN];
     char last_filename[MAX_FILE_NAME];
-    char http_response_buf[MAX_HTTP_RESULT_SIZE];
     
+    pthread_mutex_t fs_lock;  // protect the cached file among upload workers
     char cached_file_path[MAX_URI_LEN];
     int  cached_fd;
+    int  cached_direct_fd;    // the cached file opened with O_DIRECT, -1 if not used
     int64_t cached_offset;
     int64_t cached_file_reserve_size;
     int64_t fallocate_size;
+    struct IvrUring * uring;  // writes the local files of asynchronous transfers, NULL if not used
+    int fs_direct;            // write the aligned data of local files with O_DIRECT by uring
+    int durability;           // CSEG_DURABILITY_*
+    int sync_interval;        // in milliseconds, of the group commit
+    struct IvrTransfer * sync_transfers;  // written by uring and waiting for the group commit
+    int64_t sync_time;        // time of the next group commit of sync_transfers
 } IvrWriterPriv;
 
-static void random_msleep()
+/* writer_data of the uploaded segment */
+typedef struct IvrSegmentFile {
+    char filename[MAX_FILE_NAME];
+    int leased;     // created before the segment finished, its info is sent at save
+} IvrSegmentFile;
+
+static int set_segment_file(CachedSegment *segment, char * filename, int leased)
+{
+    IvrSegmentFile * file;
+    
+    av_freep(&segment->writer_data);
+    file = av_mallocz(sizeof(IvrSegmentFile));
+    if(file == NULL){
+        return AVERROR(ENOMEM);
+    }
+    av_strlcpy(file->filename, filename, MAX_FILE_NAME);
+    file->leased = leased;
+    segment->writer_data = file;
+    return 0;
+}
+
+/* 
+ * process-wide curl state. The DNS cache and TLS sessions are shared by 
+ * all the curl handles of ivr writers through ivr_curl_share, 
+ * the connections are kept alive in the cache of each handle
+ */
+static pthread_once_t ivr_curl_once = PTHREAD_ONCE_INIT;
+static CURLSH * ivr_curl_share = NULL;
+static pthread_mutex_t ivr_share_locks[CURL_LOCK_DATA_LAST];
+
+static void ivr_share_lock(CURL *handle, curl_lock_data data, 
+                           curl_lock_access access, void *userptr)
+{
+    pthread_mutex_lock(&ivr_share_locks[data]);
+}
+
+static void ivr_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    pthread_mutex_unlock(&ivr_share_locks[data]);
+}
+
+/* 
+ * curl_global_init() is not thread-safe, and curl_global_cleanup() is never called 
+ * because the other outputs of process may be still using curl
+ */
+static void ivr_curl_global_init(void)
+{
+    int i;
+    
+    curl_global_init(CURL_GLOBAL_ALL);
+    
+    for(i = 0; i < CURL_LOCK_DATA_LAST; i++){
+        pthread_mutex_init(&ivr_share_locks[i], NULL);
+    }
+    ivr_curl_share = curl_share_init();
+    if(ivr_curl_share == NULL){
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] curl_share_init() failed, DNS and TLS sessions are not shared\n");
+        return;
+    }
+    curl_share_setopt(ivr_curl_share, CURLSHOPT_LOCKFUNC, ivr_share_lock);
+    curl_share_setopt(ivr_curl_share, CURLSHOPT_UNLOCKFUNC, ivr_share_unlock);
+    curl_share_setopt(ivr_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(ivr_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+/* the share is kept by curl_easy_reset() */
+static CURL * http_handle_init(void)
+{
+    CURL * easyhandle = curl_easy_init();
+    
+    if(easyhandle != NULL && ivr_curl_share != NULL){
+        curl_easy_setopt(easyhandle, CURLOPT_SHARE, ivr_curl_share);
+    }
+    return easyhandle;
+}
+
+/* the connection options of each request */
+static int http_conn_setup(CURL * easyhandle, int flags)
+{
+#if LIBCURL_VERSION_NUM >= 0x071900
+    //keep the idle connection between segments alive through NAT and firewall
+    if(curl_easy_setopt(easyhandle, CURLOPT_TCP_KEEPALIVE, 1L)){
+        return AVERROR_EXTERNAL;
+    }
+#endif
+    if(flags & IVR_HTTP_VERBOSE){
+        if(curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1L)){
+            return AVERROR_EXTERNAL;
+        }
+    }
+    if(flags & IVR_HTTP_HTTP2){
+#if LIBCURL_VERSION_NUM >= 0x072100
+        //HTTP/1.1 is used if libcurl is built without HTTP/2
+        curl_easy_setopt(easyhandle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072B00
+        //wait for the connection in use to multiplex instead of opening a new one
+        curl_easy_setopt(easyhandle, CURLOPT_PIPEWAIT, 1L);
+#endif
+    }
+    return 0;
+}
+
+static const IvrRetryRule retry_rules[IVR_ERR_NB] = {
+    [IVR_ERR_NONE]     = {1, 0, 0, 0},
+    [IVR_ERR_CONNECT]  = {3, 10, 200, 0},
+    [IVR_ERR_TIMEOUT]  = {1, 0, 0, 0},       // writer_timeout is used up already
+    [IVR_ERR_THROTTLE] = {3, 100, 2000, 0},  // the request is not processed
+    [IVR_ERR_SERVER]   = {2, 50, 500, 1},    // op=create may be done, don't repeat it
+    //Jam(2017-1-2): for some time, Aliyun OSS would return a error status for a normal operation, 
+    // but try again we can get the correct result
+    [IVR_ERR_CLIENT]   = {2, 1, 47, 1},
+    [IVR_ERR_OTHER]    = {1, 0, 0, 0},
+};
+
+static IvrErrClass classify_error(CURLcode curl_res, long status)
+{
+    switch(curl_res){
+    case CURLE_OK:
+        break;
+    case CURLE_OPERATION_TIMEDOUT:
+        return IVR_ERR_TIMEOUT;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SSL_CONNECT_ERROR:
+        return IVR_ERR_CONNECT;
+    default:
+        return IVR_ERR_OTHER;
+    }
+    if(status == 429 || status == 503){
+        return IVR_ERR_THROTTLE;
+    }else if(status >= 500){
+        return IVR_ERR_SERVER;
+    }else if(status >= 400){
+        return IVR_ERR_CLIENT;
+    }
+    return IVR_ERR_NONE;
+}
+
+static void retry_policy_init(IvrRetryPolicy * policy)
+{
+    memset(policy, 0, sizeof(IvrRetryPolicy));
+    pthread_mutex_init(&policy->lock, NULL);
+    policy->seed = (unsigned int)av_gettime_relative() ^ (unsigned int)(intptr_t)policy;
+    policy->budget = IVR_RETRY_BUDGET_MAX;
+}
+
+/* 
+ * check if the request after tries should be retried for err, 
+ * delay is the previous delay in micro-seconds, and set to the next one 
+ * with decorrelated jitter: random in [base, delay * 3], at most cap
+ */
+static int retry_request(IvrRetryPolicy * policy, IvrErrClass err, int tries, int is_put, 
+                         int64_t * delay)
+{
+    const IvrRetryRule * rule = &retry_rules[err];
+    int64_t base = (int64_t)rule->base_ms * 1000;
+    int64_t cap = (int64_t)rule->cap_ms * 1000;
+    int64_t upper;
+    
+    if(tries >= rule->max_tries || (rule->put_only && !is_put)){
+        return 0;
+    }
+    pthread_mutex_lock(&policy->lock);
+    if(policy->budget < 1.0){
+        pthread_mutex_unlock(&policy->lock);
+        return 0;
+    }
+    policy->budget -= 1.0;
+    policy->nb_retries++;
+    upper = (*delay > base ? *delay : base) * 3;
+    *delay = base + rand_r(&policy->seed) % (upper - base + 1);
+    pthread_mutex_unlock(&policy->lock);
+    
+    if(*delay > cap){
+        *delay = cap;
+    }
+    return 1;
+}
+
+/* check if a request can be issued, take the probe if the breaker is half open */
+static int retry_allow(IvrRetryPolicy * policy)
+{
+    int allow = 1;
+    
+    pthread_mutex_lock(&policy->lock);
+    if(policy->open_until != 0){
+        if(policy->probing || av_gettime_relative() < policy->open_until){
+            allow = 0;
+        }else{
+            policy->probing = 1;
+        }
+    }
+    pthread_mutex_unlock(&policy->lock);
+    return allow;
+}
+
+/* the breaker is open, no request should be issued at the moment */
+static int breaker_open(IvrRetryPolicy * policy)
+{
+    int open;
+    
+    pthread_mutex_lock(&policy->lock);
+    open = policy->open_until != 0 && 
+           (policy->probing || av_gettime_relative() < policy->open_until);
+    pthread_mutex_unlock(&policy->lock);
+    return open;
+}
+
+/* 
+ * the last request failed for the server unavailable, or the breaker is open, 
+ * the writer should pause and try later instead of failing
+ */
+static int retry_pause(IvrRetryPolicy * policy)
+{
+    int pause;
+    
+    pthread_mutex_lock(&policy->lock);
+    pause = policy->nb_failures > 0 || policy->open_until != 0;
+    pthread_mutex_unlock(&policy->lock);
+    return pause;
+}
+
+/* update the breaker with the final result of a request */
+static void retry_record(IvrRetryPolicy * policy, IvrErrClass err)
+{
+    int64_t open_time;
+    
+    pthread_mutex_lock(&policy->lock);
+    if(err == IVR_ERR_CONNECT || err == IVR_ERR_TIMEOUT || 
+       err == IVR_ERR_THROTTLE || err == IVR_ERR_SERVER){
+        policy->nb_failures++;
+        if(policy->probing || policy->nb_failures >= IVR_BREAKER_FAILURES){
+            //open it for a random time in [open_delay / 2, open_delay], channels don't probe in lockstep
+            if(policy->open_delay == 0){
+                policy->open_delay = IVR_BREAKER_MIN_OPEN;
+            }else if(policy->open_delay < IVR_BREAKER_MAX_OPEN){
+                policy->open_delay = MIN(policy->open_delay * 2, IVR_BREAKER_MAX_OPEN);
+            }
+            open_time = policy->open_delay / 2 + rand_r(&policy->seed) % (policy->open_delay / 2 + 1);
+            policy->open_until = av_gettime_relative() + open_time;
+            policy->nb_failures = 0;
+            policy->nb_opens++;
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] circuit breaker open for %.3f s\n", 
+                   open_time / 1000000.0);
+        }
+    }else if(err != IVR_ERR_OTHER){
+        //the server is reachable, even for 4xx
+        if(policy->open_until != 0){
+            av_log(NULL, AV_LOG_INFO,  "[cseg_ivr_writer] circuit breaker closed\n");
+        }
+        policy->budget = MIN(policy->budget + IVR_RETRY_BUDGET_REFILL, IVR_RETRY_BUDGET_MAX);
+        policy->nb_failures = 0;
+        policy->open_until = 0;
+        policy->open_delay = 0;
+    }
+    //IVR_ERR_OTHER says nothing about the server, e.g. an aborted transfer, 
+    //only the probe is given up and the breaker is left as it is
+    policy->probing = 0;
+    pthread_mutex_unlock(&policy->lock);
+}
+
+/* a http or https URI is uploaded by PUT, others are local files */
+static int is_http_uri(const char * uri)
+{
+    return strncmp(uri, "http://", 7) == 0 || strncmp(uri, "https://", 8) == 0;
+}
+
+/* add the timing of the finished request of op to stat */
+static void http_op_stat(CURL * easyhandle, HttpOpStat * stat)
+{
+    double t = 0.0, upload = 0.0, download = 0.0;
+    int ms, i;
+    
+    stat->nb_requests++;
+    if(curl_easy_getinfo(easyhandle, CURLINFO_NAMELOOKUP_TIME, &t) == CURLE_OK){
+        stat->namelookup_time += t;
+    }
+    if(curl_easy_getinfo(easyhandle, CURLINFO_CONNECT_TIME, &t) == CURLE_OK){
+        stat->connect_time += t;
+    }
+    if(curl_easy_getinfo(easyhandle, CURLINFO_APPCONNECT_TIME, &t) == CURLE_OK){
+        stat->appconnect_time += t;
+    }
+    if(curl_easy_getinfo(easyhandle, CURLINFO_STARTTRANSFER_TIME, &t) == CURLE_OK){
+        stat->starttransfer_time += t;
+    }
+#if LIBCURL_VERSION_NUM >= 0x073700
+    {
+        curl_off_t upload_bytes = 0, download_bytes = 0;
+        curl_easy_getinfo(easyhandle, CURLINFO_SIZE_UPLOAD_T, &upload_bytes);
+        curl_easy_getinfo(easyhandle, CURLINFO_SIZE_DOWNLOAD_T, &download_bytes);
+        upload = upload_bytes;
+        download = download_bytes;
+    }
+#else
+    curl_easy_getinfo(easyhandle, CURLINFO_SIZE_UPLOAD, &upload);
+    curl_easy_getinfo(easyhandle, CURLINFO_SIZE_DOWNLOAD, &download);
+#endif
+    stat->bytes += upload + download;
+    
+    t = 0.0;
+    curl_easy_getinfo(easyhandle, CURLINFO_TOTAL_TIME, &t);
+    stat->total_time += t;
+    ms = (int)(t * 1000);
+    for(i = 0; i < HTTP_STAT_BUCKETS - 1 && ms >= (1 << i); i++);
+    stat->histogram[i]++;
+}
+
+/* add the connection info and timing of the finished request to stat */
+static void http_conn_stat(CURL * easyhandle, IvrHttpOp op, HttpConnStat * stat)
+{
+    long nb_connects = 0;
+    double connect_time = 0.0, appconnect_time = 0.0;
+    
+    http_op_stat(easyhandle, &stat->ops[op]);
+    stat->nb_requests++;
+    if(curl_easy_getinfo(easyhandle, CURLINFO_NUM_CONNECTS, &nb_connects) != CURLE_OK || 
+       nb_connects <= 0){
+        return; //connection reused
+    }
+    stat->nb_connects += nb_connects;
+    curl_easy_getinfo(easyhandle, CURLINFO_CONNECT_TIME, &connect_time);
+    stat->connect_time += connect_time;
+    //app connect time is 0 without TLS
+    if(curl_easy_getinfo(easyhandle, CURLINFO_APPCONNECT_TIME, &appconnect_time) == CURLE_OK && 
+       appconnect_time > connect_time){
+        stat->nb_tls_handshakes++;
+        stat->tls_handshake_time += appconnect_time - connect_time;
+    }
+}
+
+static void add_conn_stat(HttpConnStat * sum, HttpConnStat * stat)
+{
+    int op, i;
+    
+    sum->nb_requests += stat->nb_requests;
+    sum->nb_connects += stat->nb_connects;
+    sum->connect_time += stat->connect_time;
+    sum->nb_tls_handshakes += stat->nb_tls_handshakes;
+    sum->tls_handshake_time += stat->tls_handshake_time;
+    for(op = 0; op < IVR_OP_NB; op++){
+        HttpOpStat * s = &sum->ops[op], * o = &stat->ops[op];
+        s->nb_requests += o->nb_requests;
+        s->namelookup_time += o->namelookup_time;
+        s->connect_time += o->connect_time;
+        s->appconnect_time += o->appconnect_time;
+        s->starttransfer_time += o->starttransfer_time;
+        s->total_time += o->total_time;
+        s->bytes += o->bytes;
+        for(i = 0; i < HTTP_STAT_BUCKETS; i++){
+            s->histogram[i] += o->histogram[i];
+        }
+    }
+}
+
+/* log the timing of each operation, the times are averages in ms */
+static void log_op_stat(int level, HttpConnStat * stat)
 {
-    struct timeval tv;
-    int ms;
-    gettimeofday(&tv, NULL);
-    ms = tv.tv_usec % RAMDOM_SLEEP_MAX_MS + 1;
-    usleep(ms * 1000);
+    char histogram[HTTP_STAT_BUCKETS * 16];
+    int op, i, len;
+    
+    for(op = 0; op < IVR_OP_NB; op++){
+        HttpOpStat * o = &stat->ops[op];
+        double n = o->nb_requests;
+        if(o->nb_requests == 0){
+            continue;
+        }
+        histogram[0] = 0;
+        for(i = 0, len = 0; i < HTTP_STAT_BUCKETS; i++){
+            if(o->histogram[i] == 0){
+                continue;
+            }
+            if(i == HTTP_STAT_BUCKETS - 1){
+                len += snprintf(histogram + len, sizeof(histogram) - len, " >=%d:%d", 
+                                1 << (i - 1), o->histogram[i]);
+            }else{
+                len += snprintf(histogram + len, sizeof(histogram) - len, " <%d:%d", 
+                                1 << i, o->histogram[i]);
+            }
+        }
+        av_log(NULL, level, 
+               "[cseg_ivr_writer] %s: %d requests, dns %.1f, connect %.1f, tls %.1f, first byte %.1f, total %.1f ms, "
+               "%.0f bytes, %.1f KB/s, histogram(ms):%s\n", 
+               http_op_names[op], o->nb_requests, 
+               o->namelookup_time * 1000 / n, 
+               o->connect_time * 1000 / n, 
+               o->appconnect_time * 1000 / n, 
+               o->starttransfer_time * 1000 / n, 
+               o->total_time * 1000 / n, 
+               o->bytes, 
+               o->total_time > 0 ? o->bytes / 1024 / o->total_time : 0.0, 
+               histogram);
+    }
 }
 
 static int http_status_to_av_code(int status_code)
@@ -126,133 +682,202 @@ static size_t http_write_callback(char *ptr, size_t size, size_t nmemb, void *us
     return data_size;    
 }
 
+typedef struct HttpSegmentReader{
+    CachedSegment ** segments;   // sent in order as one body
+    int nb_segments;
+    int index;                   // segment of the current chunk
+    CachedSegmentChunk * chunk;  // current chunk to read
+    int chunk_pos;               // read position in the current chunk
+}HttpSegmentReader;
+
+static void http_segment_reader_rewind(HttpSegmentReader * reader)
+{
+    reader->index = 0;
+    reader->chunk = reader->nb_segments > 0 ? reader->segments[0]->first_chunk : NULL;
+    reader->chunk_pos = 0;
+}
+
 static size_t http_read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-    HttpBuf * http_buf = (HttpBuf *)userdata;
-    int data_size = MIN(size * nmemb, http_buf->buf_size - http_buf->pos);    
+    HttpSegmentReader * reader = (HttpSegmentReader *)userdata;
+    int buf_size = size * nmemb;
+    int data_size = 0;
     
-    memcpy(ptr, http_buf->buf + http_buf->pos, data_size);
-    http_buf->pos += data_size;
+    while(data_size < buf_size && reader->chunk != NULL){
+        int len = MIN(buf_size - data_size, reader->chunk->size - reader->chunk_pos);
+        memcpy(ptr + data_size, reader->chunk->data + reader->chunk_pos, len);
+        data_size += len;
+        reader->chunk_pos += len;
+        if(reader->chunk_pos >= reader->chunk->size){
+            reader->chunk = reader->chunk->next;
+            reader->chunk_pos = 0;
+            while(reader->chunk == NULL && ++reader->index < reader->nb_segments){
+                reader->chunk = reader->segments[reader->index]->first_chunk;
+            }
+        }
+    }
     return data_size;
 }
 
-static int http_post(CURL * easyhandle,
-                     char * http_uri, 
-                     int32_t io_timeout,  //in milli-seconds 
-                     char * post_content_type, 
-                     char * post_data, int post_len,
-                     int32_t retries,
-                     int * status_code,
-                     char * result_buf, int *buf_size)
-{
-    int ret = 0;
-    struct curl_slist *headers=NULL;
-    char content_type_header[128];
-    long status;
-    HttpBuf http_buf;
-    char err_buf[CURL_ERROR_SIZE] = "unknown";
-    CURLcode curl_res = CURLE_OK;
+/* reader of the segment still being recorded, for the chunked PUT */
+typedef struct HttpStreamReader{
+    CachedSegmentContext * cseg;
+    CachedSegment * segment;
+    int ret;    // error of cached_segment_stream_read()
+}HttpStreamReader;
 
-    memset(&http_buf, 0, sizeof(HttpBuf));  
+static size_t http_stream_read_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    HttpStreamReader * reader = (HttpStreamReader *)userdata;
+    int ret;
     
-    if(retries <= 0){
-        retries =  HTTP_DEFAULT_RETRY_NUM;       
+    //block until the muxer writes more data or the segment ends
+    ret = cached_segment_stream_read(reader->cseg, reader->segment, (uint8_t *)ptr, size * nmemb);
+    if(ret < 0){
+        reader->ret = ret;
+        return CURL_READFUNC_ABORT;
     }
+    return ret;
+}
 
-
-    if(post_content_type != NULL){
-        memset(content_type_header, 0, 128);
-        snprintf(content_type_header, 127, 
-                 "Content-Type: %s", post_content_type);
-        headers = curl_slist_append(headers, content_type_header);
-
-    }   
+/* 
+ * set the options of easyhandle for a POST, 
+ * the response is written to http_buf if it has buffer
+ */
+static int http_post_setup(CURL * easyhandle,
+                           int flags,
+                           char * http_uri, 
+                           int32_t io_timeout,  //in milli-seconds 
+                           struct curl_slist *headers,
+                           char * post_data, int post_len,
+                           HttpBuf * http_buf,
+                           char * err_buf)
+{
     curl_easy_reset(easyhandle);
     
+    if(http_conn_setup(easyhandle, flags)){
+        return AVERROR_EXTERNAL;
+    }
     if(curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, err_buf)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;               
+        return AVERROR_EXTERNAL;
     }    
 
     if(curl_easy_setopt(easyhandle, CURLOPT_URL, http_uri)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;
+        return AVERROR_EXTERNAL;
     }   
         
     if(headers != NULL){
         if(curl_easy_setopt(easyhandle, CURLOPT_HTTPHEADER, headers)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;               
+            return AVERROR_EXTERNAL;
         }            
     }
     if(curl_easy_setopt(easyhandle, CURLOPT_POSTFIELDS, post_data)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;          
+        return AVERROR_EXTERNAL;
     }  
     if(curl_easy_setopt(easyhandle, CURLOPT_POSTFIELDSIZE, post_len)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;             
+        return AVERROR_EXTERNAL;
     }  
 
     if(io_timeout > 0){
         if(curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS , io_timeout)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;                  
+            return AVERROR_EXTERNAL;
         }
     } 
-    if(result_buf != NULL && buf_size != NULL && (*buf_size) != 0){
-        http_buf.buf = result_buf;
-        http_buf.buf_size = (*buf_size);
-        http_buf.pos = 0;
-            
+    if(http_buf != NULL && http_buf->buf != NULL){
         if(curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, http_write_callback)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;             
+            return AVERROR_EXTERNAL;
         }
-        if(curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, &http_buf)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;                
+        if(curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, http_buf)){
+            return AVERROR_EXTERNAL;
         }
     }  
 
- #ifdef ENABLE_CURLOPT_VERBOSE   
-    if(curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;               
-    }    
- #endif
+    return 0;
+}
+
+static int http_post(IvrHttpHandle * http,
+                     int flags,
+                     IvrHttpOp op,
+                     char * http_uri, 
+                     int32_t io_timeout,  //in milli-seconds 
+                     char * post_content_type, 
+                     char * post_data, int post_len,
+                     int * status_code,
+                     char * result_buf, int *buf_size)
+{
+    CURL * easyhandle = http->easyhandle;
+    int ret = 0;
+    struct curl_slist *headers=NULL;
+    char content_type_header[128];
+    long status = 0;
+    HttpBuf http_buf;
+    char err_buf[CURL_ERROR_SIZE] = "unknown";
+    CURLcode curl_res = CURLE_OK;
+    IvrErrClass err = IVR_ERR_NONE;
+    int64_t delay = 0;
+    int tries;
+
+    memset(&http_buf, 0, sizeof(HttpBuf));  
+    
+
+    if(post_content_type != NULL){
+        memset(content_type_header, 0, 128);
+        snprintf(content_type_header, 127, 
+                 "Content-Type: %s", post_content_type);
+        headers = curl_slist_append(headers, content_type_header);
+
+    }   
+    if(result_buf != NULL && buf_size != NULL && (*buf_size) != 0){
+        http_buf.buf = result_buf;
+        http_buf.buf_size = (*buf_size);
+        http_buf.pos = 0;
+    }
+    
+    ret = http_post_setup(easyhandle, flags, http_uri, io_timeout, headers, 
+                          post_data, post_len, &http_buf, err_buf);
+    if(ret){
+        goto fail;
+    }
+    if(!retry_allow(http->policy)){
+        strcpy(err_buf, "circuit breaker open");
+        ret = AVERROR(EAGAIN);
+        goto fail;
+    }
         
-    while(retries-- > 0){
+    for(tries = 1; ; tries++){
         ret = 0;
+        status = 0;
         strcpy(err_buf, "unknown");
         http_buf.pos = 0;
         
-        if((curl_res = curl_easy_perform(easyhandle)) != CURLE_OK){
-            ret = AVERROR_EXTERNAL;            
-            if(curl_res == CURLE_OPERATION_TIMEDOUT ){
-                break;
-            }else{
-                //retry
-                random_msleep(); //sleep random 1 ~ 50 ms
-                continue;
-            }
-        }
-    
-        if(curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+        curl_res = curl_easy_perform(easyhandle);
+        http_conn_stat(easyhandle, op, &http->stat);
+        if(curl_res == CURLE_OK && 
+           curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
             ret = AVERROR_EXTERNAL;
+            err = IVR_ERR_OTHER;
             break;
-        }    
-        
+        }
+        err = classify_error(curl_res, status);
+        if(err == IVR_ERR_NONE || !retry_request(http->policy, err, tries, 0, &delay)){
+            break;
+        }
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] HTTP POST retry in %d ms(status:%d):%s\n", 
+               (int)(delay / 1000), (int)status, err_buf);
+        usleep(delay);
+    }
+    retry_record(http->policy, err);
+    
+    if(ret == 0 && curl_res != CURLE_OK){
+        ret = AVERROR_EXTERNAL;
+    }else if(ret == 0){
         if(status_code){
             *status_code = status;
         }
         if(buf_size != NULL){
             (*buf_size) = http_buf.pos;
         }
-
-        break;   // successful, then exit the loop
-    }//while(retries-- > 0){
-    
+    }
     
 fail:    
     if(ret < 0){
@@ -268,126 +893,195 @@ fail:
     return ret;
 }
 
-static int http_put(CURL * easyhandle,
-                    char * http_uri, 
-                    int32_t io_timeout,  //in milli-seconds 
-                    char * content_type, 
-                    char * buf, int buf_size,
-                    int32_t retries,
-                    int * status_code)
+/* lowercase hex MD5 of segment, empty string if the muxer did not compute it */
+static void segment_md5_hex(CachedSegment *segment, char hex[33])
+{
+    int i;
+    
+    hex[0] = 0;
+    if(!segment->has_md5){
+        return;
+    }
+    for(i = 0; i < 16; i++){
+        snprintf(hex + i * 2, 3, "%02x", segment->md5_digest[i]);
+    }
+}
+
+/* 
+ * headers for PUT of segment, free by curl_slist_free_all(). 
+ * Content-MD5 lets the storage reject the body corrupted on the way. 
+ * If offset >= 0, the body of size bytes is written at offset of the object
+ */
+static struct curl_slist * http_put_headers(char * content_type, CachedSegment *segment, 
+                                            int64_t offset, int64_t size)
 {
-    int ret = 0;
     struct curl_slist *headers=NULL;
     char content_type_header[128];
     char expect_header[128];
-    long status;
-    HttpBuf http_buf;
-    char err_buf[CURL_ERROR_SIZE] = "unknown";   
-    CURLcode curl_res = CURLE_OK; 
-    
-    if(retries <= 0){
-        retries =  HTTP_DEFAULT_RETRY_NUM;       
-    }    
+    char md5_header[64];
+    char md5_b64[32];
+    char range_header[96];
     
-    memset(&http_buf, 0, sizeof(HttpBuf));
-
     if(content_type != NULL){
         memset(content_type_header, 0, 128);
         snprintf(content_type_header, 127, 
                  "Content-Type: %s", content_type);
         headers = curl_slist_append(headers, content_type_header);
     }   
+    if(segment != NULL && segment->has_md5 &&
+       av_base64_encode(md5_b64, sizeof(md5_b64), segment->md5_digest, 16) != NULL){
+        snprintf(md5_header, sizeof(md5_header), "Content-MD5: %s", md5_b64);
+        headers = curl_slist_append(headers, md5_header);
+    }
+    if(offset >= 0 && size > 0){
+        snprintf(range_header, sizeof(range_header), "Content-Range: bytes %lld-%lld/*", 
+                 (long long)offset, (long long)(offset + size - 1));
+        headers = curl_slist_append(headers, range_header);
+    }
     //disable "Expect: 100-continue"  header
     memset(expect_header, 0, 128);
     strcpy(expect_header, "Expect:");
     headers = curl_slist_append(headers, expect_header);   
+    
+    return headers;
+}
 
+/* 
+ * set the options of easyhandle for a PUT of the segments as one body, 
+ * reader is used to read the segments, segments must be valid until the PUT finished
+ */
+static int http_put_setup(CURL * easyhandle,
+                          int flags,
+                          char * http_uri, 
+                          int32_t io_timeout,  //in milli-seconds 
+                          struct curl_slist *headers,
+                          CachedSegment **segments, int nb_segments,
+                          HttpSegmentReader * reader,
+                          char * err_buf)
+{
+    long size = 0;
+    int i;
+    
+    for(i = 0; i < nb_segments; i++){
+        size += segments[i]->size;
+    }
     curl_easy_reset(easyhandle);
 
+    if(http_conn_setup(easyhandle, flags)){
+        return AVERROR_EXTERNAL;
+    }
     if(curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, err_buf)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;               
+        return AVERROR_EXTERNAL;
     }
 
     if(curl_easy_setopt(easyhandle, CURLOPT_URL, http_uri)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;                 
+        return AVERROR_EXTERNAL;
     }   
         
     if(curl_easy_setopt(easyhandle, CURLOPT_UPLOAD, 1L)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;                 
+        return AVERROR_EXTERNAL;
     }   
     
   
     if(curl_easy_setopt(easyhandle, CURLOPT_HTTPHEADER, headers)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;                   
+        return AVERROR_EXTERNAL;
     }
        
-    if(curl_easy_setopt(easyhandle, CURLOPT_INFILESIZE, buf_size)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;                  
+    if(curl_easy_setopt(easyhandle, CURLOPT_INFILESIZE, size)){
+        return AVERROR_EXTERNAL;
     }    
 
     if(io_timeout > 0){
         if(curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS , io_timeout)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;                   
+            return AVERROR_EXTERNAL;
         }
     }   
     
-    if(buf != NULL && buf_size != 0){
-        http_buf.buf = buf;
-        http_buf.buf_size = buf_size;
-        http_buf.pos = 0;
+    memset(reader, 0, sizeof(HttpSegmentReader));
+    if(size != 0){
+        reader->segments = segments;
+        reader->nb_segments = nb_segments;
+        http_segment_reader_rewind(reader);
             
         if(curl_easy_setopt(easyhandle, CURLOPT_READFUNCTION, http_read_callback)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;                   
+            return AVERROR_EXTERNAL;
         }
-        if(curl_easy_setopt(easyhandle, CURLOPT_READDATA, &http_buf)){
-            ret = AVERROR_EXTERNAL;
-            goto fail;                   
+        if(curl_easy_setopt(easyhandle, CURLOPT_READDATA, reader)){
+            return AVERROR_EXTERNAL;
         }
     }
     
         
-#ifdef ENABLE_CURLOPT_VERBOSE   
-    if(curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1)){
-        ret = AVERROR_EXTERNAL;
-        goto fail;                    
-    }    
-#endif
+    return 0;
+}
 
-    while(retries-- > 0){
-        
+/* PUT the segments as one body, at offset of the object if offset >= 0 */
+static int http_put(IvrHttpHandle * http,
+                    int flags,
+                    IvrHttpOp op,
+                    char * http_uri, 
+                    int32_t io_timeout,  //in milli-seconds 
+                    char * content_type, 
+                    CachedSegment **segments, int nb_segments,
+                    int64_t offset,
+                    int * status_code)
+{
+    CURL * easyhandle = http->easyhandle;
+    int ret = 0;
+    struct curl_slist *headers=NULL;
+    long status = 0;
+    HttpSegmentReader reader;
+    char err_buf[CURL_ERROR_SIZE] = "unknown";   
+    CURLcode curl_res = CURLE_OK; 
+    IvrErrClass err = IVR_ERR_NONE;
+    int64_t delay = 0;
+    int64_t size = 0;
+    int tries, i;
+    
+    for(i = 0; i < nb_segments; i++){
+        size += segments[i]->size;
+    }
+    headers = http_put_headers(content_type, nb_segments == 1 ? segments[0] : NULL, offset, size);
+    ret = http_put_setup(easyhandle, flags, http_uri, io_timeout, headers, 
+                         segments, nb_segments, &reader, err_buf);
+    if(ret){
+        goto fail;
+    }
+    if(!retry_allow(http->policy)){
+        strcpy(err_buf, "circuit breaker open");
+        ret = AVERROR(EAGAIN);
+        goto fail;
+    }
+
+    for(tries = 1; ; tries++){
         ret = 0;
+        status = 0;
         strcpy(err_buf, "unknown");
-        http_buf.pos = 0;  
+        http_segment_reader_rewind(&reader);  
         
-        if((curl_res = curl_easy_perform(easyhandle)) != CURLE_OK){
-            ret = AVERROR_EXTERNAL;            
-            if(curl_res == CURLE_OPERATION_TIMEDOUT ){
-                break;
-            }else{
-                //retry
-                random_msleep(); //sleep random 1 ~ 50 ms
-                continue;
-            }
-        }
-    
-        if(curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+        curl_res = curl_easy_perform(easyhandle);
+        http_conn_stat(easyhandle, op, &http->stat);
+        if(curl_res == CURLE_OK && 
+           curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
             ret = AVERROR_EXTERNAL;
+            err = IVR_ERR_OTHER;
             break;
-        }    
-        
-        if(status_code){
-            *status_code = status;
         }
-        
-        break;   // successful, then exit the loop
-    }//while(retries-- > 0){    
+        err = classify_error(curl_res, status);
+        if(err == IVR_ERR_NONE || !retry_request(http->policy, err, tries, 1, &delay)){
+            break;
+        }
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] HTTP PUT retry in %d ms(status:%d):%s\n", 
+               (int)(delay / 1000), (int)status, err_buf);
+        usleep(delay);
+    }
+    retry_record(http->policy, err);
+    
+    if(ret == 0 && curl_res != CURLE_OK){
+        ret = AVERROR_EXTERNAL;
+    }else if(ret == 0 && status_code){
+        *status_code = status;
+    }
 fail:    
 
     if(ret < 0){
@@ -404,12 +1098,97 @@ fail:
     return ret;
 }
 
+/* 
+ * PUT the segment while it is being recorded, its size is unknown so that 
+ * the body is sent in chunked transfer encoding (or DATA frames on HTTP/2). 
+ * No retry here, the segment is uploaded as a whole after it ended on failure
+ */
+static int http_put_stream(IvrHttpHandle * http,
+                           int flags,
+                           char * http_uri, 
+                           int32_t io_timeout,  //in milli-seconds 
+                           char * content_type, 
+                           CachedSegmentContext *cseg,
+                           CachedSegment *segment,
+                           int * status_code)
+{
+    CURL * easyhandle = http->easyhandle;
+    int ret = 0;
+    struct curl_slist *headers=NULL;
+    long status = 0;
+    HttpSegmentReader seg_reader;
+    HttpStreamReader reader;
+    char err_buf[CURL_ERROR_SIZE] = "unknown";   
+    CURLcode curl_res = CURLE_OK; 
+    
+    //MD5 is not known until the end, it is sent by op=save. 
+    //libcurl sends the unknown size in chunked encoding on HTTP/1.1 by itself
+    headers = http_put_headers(content_type, NULL, -1, 0);
+    ret = http_put_setup(easyhandle, flags, http_uri, io_timeout, headers, 
+                         NULL, 0, &seg_reader, err_buf);
+    if(ret){
+        goto fail;
+    }
+    reader.cseg = cseg;
+    reader.segment = segment;
+    reader.ret = 0;
+    if(curl_easy_setopt(easyhandle, CURLOPT_INFILESIZE, -1L) || 
+       curl_easy_setopt(easyhandle, CURLOPT_READFUNCTION, http_stream_read_callback) ||
+       curl_easy_setopt(easyhandle, CURLOPT_READDATA, &reader)){
+        ret = AVERROR_EXTERNAL;
+        goto fail;
+    }
+    if(!retry_allow(http->policy)){
+        strcpy(err_buf, "circuit breaker open");
+        ret = AVERROR(EAGAIN);
+        goto fail;
+    }
+    
+    curl_res = curl_easy_perform(easyhandle);
+    http_conn_stat(easyhandle, IVR_OP_UPLOAD, &http->stat);
+    if(curl_res == CURLE_OK && 
+       curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+        ret = AVERROR_EXTERNAL;
+    }
+    //always record the outcome, the probe of a half open breaker ends here
+    retry_record(http->policy, ret ? IVR_ERR_OTHER : classify_error(curl_res, status));
+    
+    if(ret){
+        strcpy(err_buf, "get response code failed");
+    }else if(reader.ret < 0){
+        ret = reader.ret;
+        strcpy(err_buf, "recording aborted");
+    }else if(curl_res != CURLE_OK){
+        ret = AVERROR_EXTERNAL;
+    }else if(status_code){
+        *status_code = status;
+    }
+fail:    
+
+    if(ret < 0){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP streaming PUT failed:%s\n", err_buf);        
+    }
+
+    if(headers != NULL){
+        curl_slist_free_all(headers);
+        headers = NULL;
+    }    
+
+    curl_easy_reset(easyhandle);   
+    
+    return ret;
+}
+
 
 static int close_cached_file(IvrWriterPriv * priv)
 {
     if(priv->cached_fd >= 0){
         close(priv->cached_fd);
         priv->cached_fd = -1;
+        if(priv->cached_direct_fd >= 0){
+            close(priv->cached_direct_fd);
+            priv->cached_direct_fd = -1;
+        }
         priv->cached_file_reserve_size = 0;
         priv->cached_offset = 0;
         priv->cached_file_path[0] = 0;
@@ -417,13 +1196,13 @@ static int close_cached_file(IvrWriterPriv * priv)
     
 }
 
-static int open_cached_file(IvrWriterPriv * priv, char * filename, char * file_uri, int64_t write_size)
+/* split the fs file_uri into the file path and the offset parameter */
+static void parse_cached_file_uri(const char * file_uri, char * file_path, int path_size, int64_t * offset)
 {
-    int fd;
-    char file_path;
-    char * p = NULL;
+    const char * p = NULL;
     int ret;
-    int64_t offset = 0;
+    
+    *offset = 0;
     
     /* anylize the file_uri to */
     p = strchr(file_uri, '?');
@@ -435,7 +1214,7 @@ static int open_cached_file(IvrWriterPriv * priv, char * filename, char * file_u
             AVDictionaryEntry * entry;
             entry = av_dict_get(params, "offset", NULL, 0);
             if(entry){
-                offset = atoll(entry->value);
+                *offset = atoll(entry->value);
             }
         }else{
             av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] file url(%s) parse failed\n", 
@@ -443,49 +1222,130 @@ static int open_cached_file(IvrWriterPriv * priv, char * filename, char * file_u
         }
         av_dict_free(&params);
     }
+    av_strlcpy(file_path, file_uri, p ? MIN(path_size, p - file_uri + 1) : path_size);
+}
+
+/* 
+ * the offset parameter of the HTTP file_uri, where the segment is written in an object 
+ * aggregating several segments, return -1 if the segment is a whole object
+ */
+static int64_t http_uri_offset(const char * file_uri)
+{
+    char file_path[MAX_URI_LEN];
+    const char * p = strchr(file_uri, '?');
+    int64_t offset = 0;
+    
+    if(p == NULL || (strncmp(p + 1, "offset=", 7) != 0 && strstr(p, "&offset=") == NULL)){
+        return -1;
+    }
+    parse_cached_file_uri(file_uri, file_path, MAX_URI_LEN, &offset);
+    return offset;
+}
+
+/* get the fd of file_path, which is kept open until another file is written */
+static int get_cached_fd(IvrWriterPriv * priv, const char * file_path)
+{
+    int ret, created = 0;
     
-    // get fd
-    if(p) *p = 0; //make file_uri to file_path
-    if(strcmp(priv->cached_file_path, file_uri) != 0){   
+    if(strcmp(priv->cached_file_path, file_path) != 0){   
         close_cached_file(priv); 
-        priv->cached_fd = open(file_uri, O_CREAT | O_WRONLY , 0666);        
+        priv->cached_fd = open(file_path, O_WRONLY);
+        if(priv->cached_fd < 0 && errno == ENOENT){
+            priv->cached_fd = open(file_path, O_CREAT | O_WRONLY , 0666);        
+            created = 1;
+        }
         if(priv->cached_fd < 0) {
             av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] open fs file failed, open() failed with errorno(%d)\n", 
                        errno);            
             ret = AVERROR(errno);  
-            if(p) *p = '?';
-            goto failed;
+            return ret ? ret : AVERROR(EIO);
         }
-        strcpy(priv->cached_file_path, file_uri);
+        if(created){
+            //the new file must survive as its data, which is saved to IVR once synced
+            ret = cached_dir_sync(file_path, priv->durability);
+            if(ret < 0){
+                close(priv->cached_fd);
+                priv->cached_fd = -1;
+                return ret;
+            }
+        }
+        strcpy(priv->cached_file_path, file_path);
+        
+        if(priv->fs_direct){
+            priv->cached_direct_fd = open(file_path, O_WRONLY | O_DIRECT);
+            if(priv->cached_direct_fd < 0){
+                av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] filesystem not support O_DIRECT(errno:%d), miss it\n", 
+                       errno);
+                priv->fs_direct = 0;
+            }
+        }
+    }
+    return priv->cached_fd;
+}
 
+/* 
+ * the range to fallocate before the cached file is written up to end, 
+ * return its length, 0 if the reserve is enough or fallocate is disabled
+ */
+static int64_t cached_file_reserve_range(IvrWriterPriv * priv, int64_t end, int64_t * reserve_offset)
+{
+    int64_t new_reserve_size;
+    
+    if(priv->fallocate_size == 0 || end < priv->cached_file_reserve_size){
+        return 0;
     }
-    fd = priv->cached_fd;
-    if(p) *p = '?'; //restore the file_uri
+    new_reserve_size = (end + priv->fallocate_size) - 
+                       (end + priv->fallocate_size) % priv->fallocate_size;
+    *reserve_offset = priv->cached_file_reserve_size;
+    return new_reserve_size - priv->cached_file_reserve_size;
+}
 
+/* fallocate the cached file for the write up to end */
+static int reserve_cached_file(IvrWriterPriv * priv, int fd, int64_t end)
+{
+    int64_t reserve_offset = 0, reserve_len;
+    int ret;
     
- 
-    if(priv->fallocate_size != 0 && offset + write_size >= priv->cached_file_reserve_size){
-        int64_t new_reserve_size = 
-            (offset + write_size + priv->fallocate_size) -
-            (offset + write_size + priv->fallocate_size) % priv->fallocate_size;
-        ret = fallocate(fd, FALLOC_FL_KEEP_SIZE, 
-                priv->cached_file_reserve_size, 
-                new_reserve_size - priv->cached_file_reserve_size);
-        if(ret){
-            if(errno == EOPNOTSUPP || errno == ENOSYS ){
-                av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] filesystem or kernel not support fallocate, miss it\n");
-                priv->fallocate_size = 0; //disable fallocate mechanism
-                new_reserve_size = 0;
-                priv->cached_file_reserve_size = 0;
-            }else{
-                av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] fallocate file failed with errorno(%d)\n", 
-                           errno);            
-                ret = AVERROR(errno)?AVERROR(errno):AVERROR(EIO);  
-                goto failed;        
-            }
+    reserve_len = cached_file_reserve_range(priv, end, &reserve_offset);
+    if(reserve_len == 0){
+        return 0;
+    }
+    ret = fallocate(fd, FALLOC_FL_KEEP_SIZE, reserve_offset, reserve_len);
+    if(ret){
+        if(errno == EOPNOTSUPP || errno == ENOSYS ){
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] filesystem or kernel not support fallocate, miss it\n");
+            priv->fallocate_size = 0; //disable fallocate mechanism
+            priv->cached_file_reserve_size = 0;
+            return 0;
         }
-        priv->cached_file_reserve_size = new_reserve_size;
-    }   
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] fallocate file failed with errorno(%d)\n", 
+                   errno);            
+        return AVERROR(errno)?AVERROR(errno):AVERROR(EIO);  
+    }
+    priv->cached_file_reserve_size = reserve_offset + reserve_len;
+    return 0;
+}
+
+static int open_cached_file(IvrWriterPriv * priv, char * filename, char * file_uri, int64_t write_size)
+{
+    int fd;
+    char file_path[MAX_URI_LEN];
+    int ret;
+    int64_t offset = 0;
+    
+    parse_cached_file_uri(file_uri, file_path, MAX_URI_LEN, &offset);
+    
+    // get fd
+    fd = get_cached_fd(priv, file_path);
+    if(fd < 0){
+        ret = fd;
+        goto failed;
+    }
+    
+    ret = reserve_cached_file(priv, fd, offset + write_size);
+    if(ret < 0){
+        goto failed;
+    }
    
     if(offset != priv->cached_offset){
         off64_t result_offset;
@@ -514,321 +1374,2386 @@ failed:
 }
 
 
-static int create_file(IvrWriterPriv * priv,
-                       int32_t io_timeout, 
-                       CachedSegment *segment, 
-                       char * filename, int filename_size,
-                       char * file_uri, int file_uri_size)
+/* 
+ * write all the chunks of the segments to fd in order, 
+ * the chunks of several segments are gathered into one writev() as possible, 
+ * return 0 on success, or a negative AVERROR 
+ */
+static int write_segments_fd(int fd, CachedSegment **segments, int nb_segments)
 {
-    char post_data_str[MAX_POST_STR_LEN + 1];
-    char * http_response_json = priv->http_response_buf;
-    cJSON * json_root = NULL;
-    cJSON * json_name = NULL;
-    cJSON * json_uri = NULL;    
-    cJSON * json_info = NULL;        
-    int ret;
-    int status_code = 200;
-    int response_size = MAX_HTTP_RESULT_SIZE - 1;
+    struct iovec iov[FS_WRITE_IOV_NUM];
+    int seg_index = 0, start_chunk = 0;
+    int iovcnt, n, i;
+    ssize_t written;
     
-    if(filename_size){
-        filename[0] = 0;
+    while(seg_index < nb_segments){
+        //fill iov from the chunks of the segments
+        iovcnt = 0;
+        while(iovcnt < FS_WRITE_IOV_NUM && seg_index < nb_segments){
+            n = cached_segment_iov(segments[seg_index], start_chunk, 
+                                   iov + iovcnt, FS_WRITE_IOV_NUM - iovcnt);
+            iovcnt += n;
+            start_chunk += n;
+            if(start_chunk >= segments[seg_index]->nb_chunks){
+                seg_index++;
+                start_chunk = 0;
+            }
+        }
+        if(iovcnt == 0){
+            continue;
+        }
+        i = 0;
+        while(i < iovcnt){
+            written = writev(fd, iov + i, iovcnt - i);
+            if(written < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return errno ? AVERROR(errno) : AVERROR(EIO);
+            }
+            //skip the written iovec
+            while(i < iovcnt && written >= (ssize_t)iov[i].iov_len){
+                written -= iov[i].iov_len;
+                i++;
+            }
+            if(i < iovcnt){
+                iov[i].iov_base = (uint8_t *)iov[i].iov_base + written;
+                iov[i].iov_len -= written;
+            }
+        }
     }
-    if(file_uri_size){
-        file_uri[0] = 0;
-    }    
-    
+    return 0;
+}
 
-    //av_md5_sum(checksum, segment->buffer, segment->size);
-    //av_base64_encode(checksum_b64, 32, checksum, 16);
-    //url_encode(checksum_b64_escape, checksum_b64);
+static int write_segment_fd(int fd, CachedSegment *segment)
+{
+    return write_segments_fd(fd, &segment, 1);
+}
 
-    //prepare post_data
-    if(strlen(priv->last_filename) == 0){
-        snprintf(post_data_str,
-                MAX_POST_STR_LEN,
-                "op=create&content_type=video%%2Fmp2t&size=%d&start=%.6f&duration=%.6f&next_dts=%lld",
-                segment->size,
-                segment->start_ts, 
-                segment->duration,
-                (long long)segment->next_dts);  
-    }else{
-        snprintf(post_data_str, 
-                 MAX_POST_STR_LEN,
-                "op=create&content_type=video%%2Fmp2t&size=%d&start=%.6f&duration=%.6f&next_dts=%lld&last_file_name=%s",
-                segment->size,
-                segment->start_ts, 
-                segment->duration,
-                (long long)segment->next_dts,
-                priv->last_filename);          
+/* 
+ * make the data just written to the cached fd durable by priv->durability. 
+ * It's called with fs_lock, which is released during the sync so that 
+ * the other upload workers go on writing and join the same group commit
+ */
+static int sync_cached_write(IvrWriterPriv * priv, int fd, int64_t offset, int64_t len)
+{
+    int sync_fd, ret;
+    
+    if(priv->durability == CSEG_DURABILITY_NONE){
+        return 0;
     }
-    post_data_str[MAX_POST_STR_LEN] = 0;
-
-    //issue HTTP request
-    ret = http_post(priv->easyhandle,
-                    priv->ivr_rest_uri, 
-                    io_timeout,
-                    NULL, 
-                    post_data_str, strlen(post_data_str), 
-                    HTTP_DEFAULT_RETRY_NUM,
-                    &status_code,
-                    http_response_json, &response_size);
-    if(ret){
-        goto failed;       
+    //the cached fd may be closed for another file meanwhile
+    sync_fd = dup(fd);
+    if(sync_fd < 0){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] dup fs file failed with errno(%d)\n", 
+               errno);
+        return AVERROR(errno);
     }
+    pthread_mutex_unlock(&priv->fs_lock);
+    ret = cached_file_sync(sync_fd, offset, len, priv->durability, priv->sync_interval);
+    close(sync_fd);
+    pthread_mutex_lock(&priv->fs_lock);
+    return ret;
+}
 
-    http_response_json[response_size] = 0;
+//////////////////////////
+//io_uring of the local files
+
+/* 
+ * The segments of asynchronous transfers are written to the local files by io_uring, 
+ * so a slow disk holds the transfer of that segment only, not the consumer thread. 
+ * The system calls are issued directly as no liburing is required. 
+ * Completions signal the eventfd of ring, which is waited along with the curl sockets.
+ */
+#ifdef HAVE_IO_URING
+
+typedef struct IvrUring {
+    int fd;
+    int event_fd;             // signaled by the completions
+    unsigned sq_entries;
+    unsigned sqe_tail;        // sqes filled, published to the kernel by uring_submit()
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;            // the same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int nb_inflight;          // operations filled but not completed
+    int has_fallocate;        // IORING_OP_FALLOCATE is supported by kernel
+} IvrUring;
+
+static void uring_free(IvrUring * ring);
+
+/* the ring for entries operations in flight, NULL if io_uring cannot be used */
+static IvrUring * uring_init(unsigned entries)
+{
+    struct io_uring_params params;
+    struct io_uring_probe * probe = NULL;
+    IvrUring * ring;
     
-    //parse the result
-    if(status_code >= 200 && status_code < 300){
-        json_root = cJSON_Parse(http_response_json);
-        if(json_root== NULL){
-            ret = AVERROR(EINVAL);
-            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json parse failed(%s)\n", http_response_json);
-            goto failed;
-        }
-        json_name = cJSON_GetObjectItem(json_root, IVR_NAME_FIELD_KEY);
-        if(json_name && json_name->type == cJSON_String && json_name->valuestring){
-            av_strlcpy(filename, json_name->valuestring, filename_size);
-        }else{
-            ret = AVERROR(EINVAL);
-            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json for create file invalid(%s)\n", http_response_json);
-            goto failed;           
-        }
-        json_uri = cJSON_GetObjectItem(json_root, IVR_URI_FIELD_KEY);
-        if(json_uri && json_uri->type == cJSON_String && json_uri->valuestring){
-            av_strlcpy(file_uri, json_uri->valuestring, file_uri_size);
-        }else{
-            ret = AVERROR(EINVAL);
-            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json for create file invalid(%s)\n", http_response_json);
-            goto failed;           
-        }
+    ring = av_mallocz(sizeof(IvrUring));
+    if(ring == NULL){
+        return NULL;
+    }
+    ring->event_fd = -1;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0){
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] io_uring_setup() failed with errno(%d)\n", 
+               errno);
+        goto fail;
+    }
+    
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        ring->sq_ring_size = ring->cq_ring_size = FFMAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, 
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED){
+        ring->sq_ring = NULL;
+        goto map_fail;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        ring->cq_ring = ring->sq_ring;
     }else{
-
-        ret = http_status_to_av_code(status_code);
-        if(response_size != 0){
-            json_root = cJSON_Parse(http_response_json);
-            if(json_root== NULL){
-                av_log(NULL, AV_LOG_ERROR, "[cseg_ivr_writer] HTTP create file (%s) status code(%d):%s\n", 
-                       priv->ivr_rest_uri, status_code, http_response_json);
-            }else{
-                json_info = cJSON_GetObjectItem(json_root, IVR_ERR_INFO_FIELD_KEY);
-                if(json_info && json_info->type == cJSON_String && json_info->valuestring){            
-                    av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP create file status code(%d):%s\n", 
-                           status_code, json_info->valuestring);
-                }        
-            }//if(json_root== NULL)
-            
-        }//if(response_size != 0)
-        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] POST data:%s\n", 
-                           post_data_str);
-        goto failed;
-        
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, 
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED){
+            ring->cq_ring = NULL;
+            goto map_fail;
+        }
     }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, 
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        ring->sqes = NULL;
+        goto map_fail;
+    }
+    ring->sq_head  = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head  = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ring + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
     
-
-failed:
-    if(json_root){
-        cJSON_Delete(json_root); 
-        json_root = NULL;
+    //the operations supported by kernel, probe is added in Linux 5.6 along with fallocate
+    probe = av_mallocz(sizeof(struct io_uring_probe) + 
+                       IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if(probe == NULL ||
+       syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0 ||
+       probe->last_op < IORING_OP_WRITEV || 
+       !(probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED)){
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] io_uring of kernel not support writev\n");
+        goto fail;
     }
-       
-    return ret;
+    ring->has_fallocate = probe->last_op >= IORING_OP_FALLOCATE && 
+                          (probe->ops[IORING_OP_FALLOCATE].flags & IO_URING_OP_SUPPORTED);
+    av_freep(&probe);
+    
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ring->event_fd < 0 || 
+       syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0){
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] register eventfd of io_uring failed with errno(%d)\n", 
+               errno);
+        goto fail;
+    }
+    return ring;
+    
+map_fail:
+    av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] mmap io_uring failed with errno(%d)\n", 
+           errno);
+fail:
+    av_free(probe);
+    uring_free(ring);
+    return NULL;
 }
 
-static int upload_file(IvrWriterPriv * priv,
-                       CachedSegment *segment, 
-                       int32_t io_timeout, 
-                       char * filename,
-                       char * file_uri)
+/* the free sqes */
+static unsigned uring_sq_space(IvrUring * ring)
 {
-    int status_code = 200;
-    int ret = 0;  
-    int fd;
-    AVIOContext *file_context;
+    return ring->sq_entries - 
+           (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* a cleared sqe, the caller checks uring_sq_space() first */
+static struct io_uring_sqe * uring_get_sqe(IvrUring * ring, uint64_t user_data, int link)
+{
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[index];
     
-    if(strncmp(file_uri, "http://", 7) == 0){
-        //for http upload
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    //the linked operation runs after this one even if it failed
+    sqe->flags = link ? IOSQE_IO_HARDLINK : 0;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->nb_inflight++;
+    return sqe;
+}
+
+static void uring_prep_writev(IvrUring * ring, int fd, const struct iovec * iov, int iovcnt, 
+                              int64_t offset, uint64_t user_data, int link)
+{
+    struct io_uring_sqe * sqe = uring_get_sqe(ring, user_data, link);
     
-        ret = http_put(priv->easyhandle, 
-                       file_uri, io_timeout, "video/mp2t",
-                       segment->buffer, segment->size, 
-                       HTTP_DEFAULT_RETRY_NUM,
-                       &status_code);
-        if(ret){
-            return ret;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = iovcnt;
+}
+
+static void uring_prep_fallocate(IvrUring * ring, int fd, int mode, int64_t offset, int64_t len, 
+                                 uint64_t user_data, int link)
+{
+    struct io_uring_sqe * sqe = uring_get_sqe(ring, user_data, link);
+    
+    sqe->opcode = IORING_OP_FALLOCATE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = len;
+    sqe->len = mode;
+}
+
+static void uring_prep_fsync(IvrUring * ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe * sqe = uring_get_sqe(ring, user_data, 0);
+    
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+/* 
+ * pass the filled sqes to the kernel. 
+ * The sqes refused for the moment are kept in ring, and submitted by the next call
+ */
+static int uring_submit(IvrUring * ring)
+{
+    unsigned to_submit;
+    int ret;
+    
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while(to_submit > 0){
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 0, 0, NULL, 0);
+        if(ret < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] io_uring_enter() failed with errno(%d)\n", 
+                   errno);
+            return AVERROR(errno);
         }
-        //Jam(2017-1-2): for some time, Aliyun OSS would return a error status for a normal operation, 
-        // but try again we can get the correct result
-        if(status_code >= 400){ //try to reconnect for one more time
-            random_msleep();        
-            ret = http_put(priv->easyhandle, 
-                       file_uri, io_timeout, "video/mp2t",
-                       segment->buffer, segment->size, 
-                       HTTP_DEFAULT_RETRY_NUM,
-                       &status_code);
-            if(ret){
-                return ret;
+        to_submit -= FFMIN(ret, to_submit);
+    }
+    return 0;
+}
+
+/* take a completion, return 0 if none */
+static int uring_get_cqe(IvrUring * ring, uint64_t * user_data, int * res)
+{
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe * cqe;
+    
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        return 0;
+    }
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->nb_inflight--;
+    return 1;
+}
+
+/* wait for the operations in flight, which use the memory of caller */
+static void uring_free(IvrUring * ring)
+{
+    uint64_t user_data;
+    int res;
+    
+    if(ring == NULL){
+        return;
+    }
+    while(ring->fd >= 0 && ring->sqes != NULL && ring->nb_inflight > 0){
+        while(uring_get_cqe(ring, &user_data, &res)){
+        }
+        if(ring->nb_inflight == 0 || uring_submit(ring) < 0 ||
+           (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && 
+            errno != EINTR)){
+            break;
+        }
+    }
+    if(ring->sqes != NULL){
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring){
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if(ring->sq_ring != NULL){
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if(ring->event_fd >= 0){
+        close(ring->event_fd);
+    }
+    if(ring->fd >= 0){
+        close(ring->fd);
+    }
+    av_free(ring);
+}
+
+#else
+
+typedef struct IvrUring IvrUring;
+
+static IvrUring * uring_init(unsigned entries)
+{
+    av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] io_uring is not supported by this build\n");
+    return NULL;
+}
+
+static void uring_free(IvrUring * ring)
+{
+}
+
+#endif
+
+//////////////////////////
+//REST request and response text
+
+/* 
+ * bounded builder of the request body, 
+ * the overflow is remembered instead of silently sending a truncated request
+ */
+typedef struct IvrPostBuf {
+    char * buf;
+    int size;       // including the terminating 0
+    int len;
+    int overflow;
+} IvrPostBuf;
+
+static void post_buf_init(IvrPostBuf * pb, char * buf, int size)
+{
+    pb->buf = buf;
+    pb->size = size;
+    pb->len = 0;
+    pb->overflow = 0;
+    buf[0] = 0;
+}
+
+static av_printf_format(2, 3) void post_buf_printf(IvrPostBuf * pb, const char * fmt, ...)
+{
+    va_list vl;
+    int len;
+    
+    if(pb->overflow){
+        return;
+    }
+    va_start(vl, fmt);
+    len = vsnprintf(pb->buf + pb->len, pb->size - pb->len, fmt, vl);
+    va_end(vl);
+    if(len < 0 || len >= pb->size - pb->len){
+        pb->buf[pb->len] = 0;   // keep the complete part for the log
+        pb->overflow = 1;
+        return;
+    }
+    pb->len += len;
+}
+
+/* return the length of body, or AVERROR(ENAMETOOLONG) if it does not fit */
+static int post_buf_finish(IvrPostBuf * pb, const char * what)
+{
+    if(pb->overflow){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] %s request exceeds %d bytes:%s...\n", 
+               what, pb->size - 1, pb->buf);
+        return AVERROR(ENAMETOOLONG);
+    }
+    return pb->len;
+}
+
+/* 
+ * The responses of IVR server are small flat objects, only a few known keys 
+ * are looked up, so they are scanned in place instead of being parsed to a 
+ * tree. The helpers take the position of a value and return NULL if 
+ * the text is malformed
+ */
+static const char * json_skip_ws(const char * p)
+{
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'){
+        p++;
+    }
+    return p;
+}
+
+/* skip the string starting at the quote, return the position after the closing quote */
+static const char * json_skip_string(const char * p)
+{
+    for(p++; *p != '"'; p++){
+        if(*p == 0){
+            return NULL;
+        }else if(*p == '\\'){
+            p++;
+            if(*p == 0){
+                return NULL;
             }
-        } 
-        
-        if(status_code < 200 || status_code >= 300){
-            ret = http_status_to_av_code(status_code);
-            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] http upload file failed with status(%d)\n", 
-                       status_code);       
-            return ret;
-        } 
-    }else{
-        //for file system
-        fd = open_cached_file(priv, filename, file_uri, segment->size);
-        if(fd < 0) {
-            return fd;            
         }
-        ret = write(fd, segment->buffer, segment->size);   
-        if(ret < 0) {
-            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] write fs file failed, write() failed with errno(%d)\n", 
-                       errno);
-            return AVERROR(errno); 
+    }
+    return p + 1;
+}
+
+/* skip one value of any type, return the position after it */
+static const char * json_skip_value(const char * p)
+{
+    int depth = 0;
+    const char * start;
+    
+    p = json_skip_ws(p);
+    if(*p == '"'){
+        return json_skip_string(p);
+    }else if(*p == '{' || *p == '['){
+        while(*p){
+            if(*p == '"'){
+                p = json_skip_string(p);
+                if(p == NULL){
+                    return NULL;
+                }
+                continue;
+            }else if(*p == '{' || *p == '['){
+                depth++;
+            }else if(*p == '}' || *p == ']'){
+                if(--depth == 0){
+                    return p + 1;
+                }
+            }
+            p++;
+        }
+        return NULL;
+    }
+    
+    //number, true, false or null
+    start = p;
+    while(*p && *p != ',' && *p != '}' && *p != ']' && 
+          *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'){
+        p++;
+    }
+    return p == start ? NULL : p;
+}
+
+/* look up key in the object, return the position of its value, NULL if not found */
+static const char * json_find(const char * obj, const char * key)
+{
+    const char * p = json_skip_ws(obj);
+    const char * name;
+    int key_len = strlen(key);
+    int matched;
+    
+    if(*p != '{'){
+        return NULL;
+    }
+    p++;
+    for(;;){
+        p = json_skip_ws(p);
+        if(*p != '"'){
+            return NULL; // end of object or malformed
+        }
+        name = p + 1;
+        p = json_skip_string(p);
+        if(p == NULL){
+            return NULL;
+        }
+        matched = (p - 1 - name == key_len && memcmp(name, key, key_len) == 0);
+        p = json_skip_ws(p);
+        if(*p != ':'){
+            return NULL;
+        }
+        p = json_skip_ws(p + 1);
+        if(matched){
+            return p;
+        }
+        p = json_skip_value(p);
+        if(p == NULL){
+            return NULL;
+        }
+        p = json_skip_ws(p);
+        if(*p != ','){
+            return NULL;
+        }
+        p++;
+    }
+}
+
+static int json_hex4(const char * p)
+{
+    int i, c, v = 0;
+    
+    for(i = 0; i < 4; i++){
+        c = p[i];
+        if(c >= '0' && c <= '9'){
+            v = (v << 4) | (c - '0');
+        }else if(c >= 'a' && c <= 'f'){
+            v = (v << 4) | (c - 'a' + 10);
+        }else if(c >= 'A' && c <= 'F'){
+            v = (v << 4) | (c - 'A' + 10);
+        }else{
+            return -1;
+        }
+    }
+    return v;
+}
+
+/* 
+ * copy the unescaped string value to buf, 
+ * return its length, AVERROR(EINVAL) if not a string, AVERROR(ENAMETOOLONG) if buf is too small
+ */
+static int json_get_string(const char * value, char * buf, int buf_size)
+{
+    const char * p = value;
+    char utf8[4];
+    int len = 0, n, c;
+    
+    if(p == NULL || *p != '"' || buf_size <= 0){
+        return AVERROR(EINVAL);
+    }
+    for(p++; *p != '"'; p++){
+        n = 1;
+        if(*p == 0){
+            return AVERROR(EINVAL);
+        }else if(*p != '\\'){
+            utf8[0] = *p;
+        }else{
+            p++;
+            switch(*p){
+            case 'b': utf8[0] = '\b'; break;
+            case 'f': utf8[0] = '\f'; break;
+            case 'n': utf8[0] = '\n'; break;
+            case 'r': utf8[0] = '\r'; break;
+            case 't': utf8[0] = '\t'; break;
+            case '"': case '\\': case '/': utf8[0] = *p; break;
+            case 'u':
+                //only BMP is expected in names and URIs, surrogates are replaced
+                c = json_hex4(p + 1);
+                if(c < 0){
+                    return AVERROR(EINVAL);
+                }
+                p += 4;
+                if(c >= 0xd800 && c < 0xe000){
+                    c = '?';
+                }
+                if(c < 0x80){
+                    utf8[0] = c;
+                }else if(c < 0x800){
+                    utf8[0] = 0xc0 | (c >> 6);
+                    utf8[1] = 0x80 | (c & 0x3f);
+                    n = 2;
+                }else{
+                    utf8[0] = 0xe0 | (c >> 12);
+                    utf8[1] = 0x80 | ((c >> 6) & 0x3f);
+                    utf8[2] = 0x80 | (c & 0x3f);
+                    n = 3;
+                }
+                break;
+            default:
+                return AVERROR(EINVAL);
+            }
+        }
+        if(len + n >= buf_size){
+            buf[len] = 0;
+            return AVERROR(ENAMETOOLONG);
         }
-        priv->cached_offset += ret;
+        memcpy(buf + len, utf8, n);
+        len += n;
     }
+    buf[len] = 0;
+    return len;
+}
+
+/* return 0 and the number value, AVERROR(EINVAL) if not a number */
+static int json_get_number(const char * value, double * number)
+{
+    char * end;
     
+    if(value == NULL || !(*value == '-' || (*value >= '0' && *value <= '9'))){
+        return AVERROR(EINVAL);
+    }
+    *number = strtod(value, &end);
+    if(end == value){
+        return AVERROR(EINVAL);
+    }
     return 0;
+}
+
+/* return the position of the first element of array, NULL if empty or not an array */
+static const char * json_array_first(const char * array)
+{
+    const char * p = json_skip_ws(array);
+    
+    if(*p != '['){
+        return NULL;
+    }
+    p = json_skip_ws(p + 1);
+    return *p == ']' ? NULL : p;
+}
+
+/* return the position of the element after elem, NULL if elem is the last */
+static const char * json_array_next(const char * elem)
+{
+    const char * p = json_skip_value(elem);
+    
+    if(p == NULL){
+        return NULL;
+    }
+    p = json_skip_ws(p);
+    return *p == ',' ? json_skip_ws(p + 1) : NULL;
+}
+
+/* log the info of an error response if available, or the whole response */
+static void log_error_response(const char * what, int status_code, 
+                               const char * http_response_json, int response_size)
+{
+    char info[256];
+    
+    if(response_size == 0){
+        return;
+    }
+    if(json_get_string(json_find(http_response_json, IVR_ERR_INFO_FIELD_KEY), 
+                       info, sizeof(info)) >= 0){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP %s status code(%d):%s\n", 
+               what, status_code, info);
+    }else{
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP %s status code(%d):%s\n", 
+               what, status_code, http_response_json);
+    }
+}
+
+/* 
+ * prepare the POST data of op=create for segment. 
+ * With append_num, IVR server may place the segment in an object shared with 
+ * the neighbours and return its URI with the offset, the byte range of 
+ * each segment is known by IVR server from the offset and size. 
+ * For an HTTP URI the server must also return "upload_mode":"range", which 
+ * tells its storage accepts a PUT with the Content-Range of the segment
+ */
+static int build_create_post(char * post_data_str, CachedSegment *segment, char * last_filename, 
+                             int append_num)
+{
+    IvrPostBuf pb;
+    char md5[33];
+    
+    //the checksum has been computed by the muxer while serializing the segment
+    segment_md5_hex(segment, md5);
+
+    post_buf_init(&pb, post_data_str, MAX_POST_STR_LEN + 1);
+    post_buf_printf(&pb, 
+                    "op=create&content_type=video%%2Fmp2t&size=%d&start=%.6f&duration=%.6f&next_dts=%lld",
+                    segment->size,
+                    segment->start_ts, 
+                    segment->duration,
+                    (long long)segment->next_dts);  
+    if(last_filename != NULL && strlen(last_filename) != 0){
+        post_buf_printf(&pb, "&last_file_name=%s", last_filename);
+    }
+    if(md5[0]){
+        post_buf_printf(&pb, "&md5=%s", md5);
+    }
+    if(append_num > 1){
+        post_buf_printf(&pb, "&append_num=%d", append_num);
+    }
+    return post_buf_finish(&pb, "create file");
+}
+
+#define IVR_CREATE_WHOLE 2   // placed at an offset of HTTP object without range upload, fail and create it again
+
+/* 
+ * get the filename and file_uri from the response of op=create, 
+ * http_response_json must have one more byte than response_size. 
+ * Return IVR_CREATE_WHOLE with filename kept if the file must be failed and created again
+ */
+static int parse_create_response(IvrWriterPriv * priv, 
+                                 char * http_response_json, int response_size, 
+                                 int status_code, char * post_data_str,
+                                 char * filename, int filename_size,
+                                 char * file_uri, int file_uri_size)
+{
+    int ret = 0;
+    
+    if(filename_size){
+        filename[0] = 0;
+    }
+    if(file_uri_size){
+        file_uri[0] = 0;
+    }    
+
+    http_response_json[response_size] = 0;
+    
+    //parse the result
+    if(status_code >= 200 && status_code < 300){
+        if(json_get_string(json_find(http_response_json, IVR_NAME_FIELD_KEY), 
+                           filename, filename_size) < 0 ||
+           json_get_string(json_find(http_response_json, IVR_URI_FIELD_KEY), 
+                           file_uri, file_uri_size) < 0){
+            ret = AVERROR(EINVAL);
+            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json for create file invalid(%s)\n", http_response_json);
+            goto failed;           
+        }
+        if(is_http_uri(file_uri) && http_uri_offset(file_uri) >= 0){
+            //a partial PUT is not valid HTTP, only write a range if the server's storage accepts it
+            char upload_mode[16];
+            if(json_get_string(json_find(http_response_json, IVR_UPLOAD_MODE_FIELD_KEY), 
+                               upload_mode, sizeof(upload_mode)) < 0 || 
+               strcmp(upload_mode, IVR_UPLOAD_MODE_RANGE) != 0){
+                av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] IVR server placed the file at an offset of HTTP object "
+                       "without upload_mode range, disable http_append_num\n");
+                __atomic_store_n(&priv->append_num, 0, __ATOMIC_RELAXED);
+                file_uri[0] = 0;
+                ret = IVR_CREATE_WHOLE;
+            }
+        }
+    }else{
 
+        ret = http_status_to_av_code(status_code);
+        log_error_response("create file", status_code, http_response_json, response_size);
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] POST data:%s\n", 
+                           post_data_str);
+        goto failed;
+        
+    }
     
+
+failed:
+    return ret;
 }
 
 static int save_file( IvrWriterPriv * priv,
+                      IvrHttpHandle * http,
                       int32_t io_timeout,
                       char * filename,
-                      int success)
+                      int success,
+                      CachedSegment *segment);
+
+static int create_file_once(IvrWriterPriv * priv,
+                            IvrHttpHandle * http, 
+                            char * last_filename,
+                            int32_t io_timeout, 
+                            CachedSegment *segment, 
+                            char * filename, int filename_size,
+                            char * file_uri, int file_uri_size)
 {
-    char post_data_str[MAX_POST_STR_LEN + 1];  
+    char post_data_str[MAX_POST_STR_LEN + 1];
+    char * http_response_json = http->http_response_buf;
+    int ret;
     int status_code = 200;
-    int ret = 0;
-    char * http_response_json = priv->http_response_buf;
-    cJSON * json_root = NULL;
-    cJSON * json_info = NULL; 
-    int response_size = MAX_HTTP_RESULT_SIZE - 1;    
+    int response_size = MAX_HTTP_RESULT_SIZE - 1;
     
+    if(filename_size){
+        filename[0] = 0;
+    }
+    if(file_uri_size){
+        file_uri[0] = 0;
+    }    
+
     //prepare post_data
-    if(success){
-        snprintf(post_data_str, MAX_POST_STR_LEN, "op=save&name=%s", filename);
-                
-    }else{
-        snprintf(post_data_str, MAX_POST_STR_LEN, "op=fail&name=%s", filename);        
+    ret = build_create_post(post_data_str, segment, last_filename, 
+                            __atomic_load_n(&priv->append_num, __ATOMIC_RELAXED));
+    if(ret < 0){
+        return ret;
     }
-    post_data_str[MAX_POST_STR_LEN] = 0;
-    
+
     //issue HTTP request
-    ret = http_post(priv->easyhandle,
+    ret = http_post(http, priv->http_flags, IVR_OP_CREATE,
                     priv->ivr_rest_uri, 
                     io_timeout,
                     NULL, 
                     post_data_str, strlen(post_data_str), 
-                    HTTP_DEFAULT_RETRY_NUM,
                     &status_code,
-                    http_response_json, &response_size); 
+                    http_response_json, &response_size);
     if(ret){
-        goto failed;
+        return ret;       
     }
+
+    return parse_create_response(priv, http_response_json, response_size, 
+                                 status_code, post_data_str, 
+                                 filename, filename_size, 
+                                 file_uri, file_uri_size);
+}
+
+/* 
+ * create the file for segment, a file placed in an HTTP object without range upload 
+ * is failed and created again as a whole with the same last_filename
+ */
+static int create_file(IvrWriterPriv * priv,
+                       IvrHttpHandle * http, 
+                       char * last_filename,
+                       int32_t io_timeout, 
+                       CachedSegment *segment, 
+                       char * filename, int filename_size,
+                       char * file_uri, int file_uri_size)
+{
+    int ret, tries;
     
-    http_response_json[response_size] = 0;    
+    for(tries = 0; ; tries++){
+        ret = create_file_once(priv, http, last_filename, io_timeout, segment, 
+                               filename, filename_size, file_uri, file_uri_size);
+        if(ret != IVR_CREATE_WHOLE){
+            return ret;
+        }
+        save_file(priv, http, io_timeout, filename, 0, NULL);
+        filename[0] = 0;
+        if(tries > 0){
+            //append_num is disabled already, the server still places it at an offset
+            return AVERROR(EINVAL);
+        }
+    }
+}
+
+/* write the segment to the local file of file_uri */
+static int upload_fs_file(IvrWriterPriv * priv,
+                          CachedSegment *segment, 
+                          char * filename,
+                          char * file_uri)
+{
+    int64_t offset;
+    int fd;
+    int ret;
     
-    if(status_code < 200 || status_code >= 300){
+    pthread_mutex_lock(&priv->fs_lock);
+    fd = open_cached_file(priv, filename, file_uri, segment->size);
+    if(fd < 0) {
+        pthread_mutex_unlock(&priv->fs_lock);
+        return fd;            
+    }
+    ret = write_segment_fd(fd, segment);   
+    if(ret < 0) {
+        pthread_mutex_unlock(&priv->fs_lock);
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] write fs file failed, writev() failed with errno(%d)\n", 
+                   AVUNERROR(ret));
+        return ret; 
+    }
+    offset = priv->cached_offset;
+    priv->cached_offset += segment->size;
+    ret = sync_cached_write(priv, fd, offset, segment->size);
+    pthread_mutex_unlock(&priv->fs_lock);
+    
+    return ret;
+}
 
-        ret = http_status_to_av_code(status_code);
-        if(response_size != 0){
-            json_root = cJSON_Parse(http_response_json);
-            if(json_root== NULL){
-                av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP save file (%s) status code(%d):%s\n", 
-                       priv->ivr_rest_uri, status_code, http_response_json);                           
-            }else{
-                json_info = cJSON_GetObjectItem(json_root, IVR_ERR_INFO_FIELD_KEY);
-                if(json_info && json_info->type == cJSON_String && json_info->valuestring){
-                    av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP create file status code(%d):%s\n", 
-                       status_code, json_info->valuestring);
-                }        
-            }
+static int upload_file(IvrWriterPriv * priv,
+                       IvrHttpHandle * http,
+                       CachedSegment *segment, 
+                       int32_t io_timeout, 
+                       char * filename,
+                       char * file_uri)
+{
+    int status_code = 200;
+    int ret = 0;  
+    AVIOContext *file_context;
+    
+    if(is_http_uri(file_uri)){
+        //for http upload
+    
+        ret = http_put(http, priv->http_flags, IVR_OP_UPLOAD, 
+                       file_uri, io_timeout, "video/mp2t",
+                       &segment, 1, http_uri_offset(file_uri), 
+                       &status_code);
+        if(ret){
+            return ret;
+        }
+        
+        if(status_code < 200 || status_code >= 300){
+            ret = http_status_to_av_code(status_code);
+            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] http upload file failed with status(%d)\n", 
+                       status_code);       
+            return ret;
+        } 
+    }else{
+        //for file system
+        return upload_fs_file(priv, segment, filename, file_uri);
+    }
+    
+    return 0;
+
+    
+}
+
+/* check the response of op=save or op=fail */
+static int parse_save_response(IvrWriterPriv * priv, 
+                               char * http_response_json, int response_size, 
+                               int status_code)
+{
+    http_response_json[response_size] = 0;    
+    
+    if(status_code < 200 || status_code >= 300){
+        log_error_response("save file", status_code, http_response_json, response_size);
+        return http_status_to_av_code(status_code);
+    }
+    return 0;
+}
+
+/* 
+ * the info of segment is sent along if not NULL, for the file leased before the segment finished
+ */
+static void fill_save_info(IvrSaveInfo * info, char * filename, int success, CachedSegment *segment)
+{
+    av_strlcpy(info->filename, filename, MAX_FILE_NAME);
+    info->success = success;
+    info->has_segment = (success && segment != NULL);
+    if(info->has_segment){
+        info->size = segment->size;
+        info->start_ts = segment->start_ts;
+        info->duration = segment->duration;
+        info->next_dts = segment->next_dts;
+        segment_md5_hex(segment, info->md5);
+    }
+}
+
+/* prepare the POST data of op=save or op=fail */
+static int build_save_post(char * post_data_str, IvrSaveInfo * info)
+{
+    IvrPostBuf pb;
+    
+    post_buf_init(&pb, post_data_str, MAX_POST_STR_LEN + 1);
+    if(info->has_segment){
+        post_buf_printf(&pb, 
+                        "op=save&name=%s&size=%d&start=%.6f&duration=%.6f&next_dts=%lld%s%s", 
+                        info->filename,
+                        info->size,
+                        info->start_ts, 
+                        info->duration,
+                        (long long)info->next_dts,
+                        info->md5[0] ? "&md5=" : "",
+                        info->md5);  
+    }else{
+        post_buf_printf(&pb, "op=%s&name=%s", info->success ? "save" : "fail", info->filename);
+    }
+    return post_buf_finish(&pb, "save file");
+}
+
+static int post_save(IvrWriterPriv * priv,
+                     IvrHttpHandle * http,
+                     int32_t io_timeout,
+                     IvrSaveInfo * info)
+{
+    char post_data_str[MAX_POST_STR_LEN + 1];  
+    int status_code = 200;
+    int ret = 0;
+    char * http_response_json = http->http_response_buf;
+    int response_size = MAX_HTTP_RESULT_SIZE - 1;    
+    
+    //prepare post_data
+    ret = build_save_post(post_data_str, info);
+    if(ret < 0){
+        return ret;
+    }
+    
+    //issue HTTP request
+    ret = http_post(http, priv->http_flags, IVR_OP_SAVE,
+                    priv->ivr_rest_uri, 
+                    io_timeout,
+                    NULL, 
+                    post_data_str, strlen(post_data_str), 
+                    &status_code,
+                    http_response_json, &response_size); 
+    if(ret){
+        return ret;
+    }
+    
+    return parse_save_response(priv, http_response_json, response_size, status_code);
+}
+
+static int save_file( IvrWriterPriv * priv,
+                      IvrHttpHandle * http,
+                      int32_t io_timeout,
+                      char * filename,
+                      int success,
+                      CachedSegment *segment)
+{
+    IvrSaveInfo info;
+    
+    fill_save_info(&info, filename, success, segment);
+    return post_save(priv, http, io_timeout, &info);
+}
+
+/* 
+ * prepare the JSON body of op=save_batch, e.g.
+ * {"op":"save_batch","files":[{"name":"a","op":"save","size":1,...},{"name":"b","op":"fail"}]}
+ */
+static int build_save_batch_body(char * body, int body_size, IvrSaveInfo * saves, int nb_saves)
+{
+    IvrPostBuf pb;
+    int i;
+    
+    post_buf_init(&pb, body, body_size);
+    post_buf_printf(&pb, "{\"op\":\"save_batch\",\"" IVR_FILES_FIELD_KEY "\":[");
+    for(i = 0; i < nb_saves; i++){
+        IvrSaveInfo * info = &saves[i];
+        if(info->has_segment){
+            post_buf_printf(&pb, 
+                            "%s{\"name\":\"%s\",\"op\":\"save\",\"size\":%d,\"start\":%.6f,\"duration\":%.6f,\"next_dts\":%lld%s%s%s}", 
+                            i ? "," : "",
+                            info->filename,
+                            info->size,
+                            info->start_ts, 
+                            info->duration,
+                            (long long)info->next_dts,
+                            info->md5[0] ? ",\"md5\":\"" : "",
+                            info->md5,
+                            info->md5[0] ? "\"" : "");
+        }else{
+            post_buf_printf(&pb, 
+                            "%s{\"name\":\"%s\",\"op\":\"%s\"}", 
+                            i ? "," : "",
+                            info->filename, 
+                            info->success ? "save" : "fail");
+        }
+    }
+    post_buf_printf(&pb, "]}");
+    return post_buf_finish(&pb, "save batch");
+}
+
+/* 
+ * send the batched saves in one op=save_batch request. 
+ * If the IVR server does not support it, batch is disabled and 
+ * the saves are sent one by one in the original form. 
+ * The saves not sent are kept in queue and sent again after save_batch_delay
+ */
+static int flush_saves(IvrWriterPriv * priv, IvrHttpHandle * http, int32_t io_timeout)
+{
+    char * body = NULL;
+    int body_size;
+    int status_code = 200;
+    int response_size = MAX_HTTP_RESULT_SIZE - 1;    
+    int ret = 0, i;
+    int nb_sent = 0;
+    
+    if(priv->nb_saves == 0){
+        return 0;
+    }
+    if(priv->nb_saves > 1 && priv->save_batch_num > 0){
+        body_size = priv->nb_saves * MAX_SAVE_JSON_LEN + 64;
+        body = av_malloc(body_size);
+        if(body == NULL){
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ret = build_save_batch_body(body, body_size, priv->saves, priv->nb_saves);
+        if(ret < 0){
+            goto fail;
+        }
+        ret = http_post(http, priv->http_flags, IVR_OP_SAVE,
+                        priv->ivr_rest_uri, 
+                        io_timeout,
+                        "application/json", 
+                        body, ret, 
+                        &status_code,
+                        http->http_response_buf, &response_size); 
+        if(ret){
+            goto fail;
+        }
+        if(status_code == 400 || status_code == 404 || status_code == 405 || 
+           status_code == 415 || status_code == 501){
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] IVR server does not support save batch(status:%d), disable it\n", 
+                   status_code);
+            priv->save_batch_num = 0;
+        }else{
+            ret = parse_save_response(priv, http->http_response_buf, response_size, status_code);
+            if(ret == 0){
+                nb_sent = priv->nb_saves;
+            }
+            goto fail;
+        }
+    }
+    
+    //fallback to one request for each file
+    for(i = 0; i < priv->nb_saves; i++){
+        ret = post_save(priv, http, io_timeout, &priv->saves[i]);
+        if(ret){
+            break;
+        }
+        nb_sent++;
+    }
+    
+fail:
+    if(nb_sent > 0){
+        priv->nb_saves -= nb_sent;
+        memmove(priv->saves, priv->saves + nb_sent, sizeof(IvrSaveInfo) * priv->nb_saves);
+    }
+    if(priv->nb_saves > 0){
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] %d saves are not sent, try again later\n", 
+               priv->nb_saves);
+        priv->save_batch_time = av_gettime_relative();
+    }
+    av_free(body);
+    return ret;
+}
+
+/* 
+ * save or fail the file, batched with others if enabled. 
+ * The saves in batch are sent when full or the first one has waited for save_batch_delay. 
+ * Return 0 if the save is sent or kept in queue until sent, otherwise it's not accepted
+ */
+static int queue_save(IvrWriterPriv * priv, char * filename, int success, CachedSegment *segment)
+{
+    int ret;
+    
+    if(priv->save_batch_num == 0){
+        //the saves left before batch disabled go first
+        ret = flush_saves(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+        if(ret == 0){
+            ret = save_file(priv, &priv->http, HTTP_REQUEST_TIMEOUT, 
+                            filename, success, segment);
+        }
+        return ret;
+    }
+    if(priv->nb_saves >= priv->saves_size){
+        //full of the saves failed to send
+        ret = flush_saves(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+        if(ret){
+            return ret;
+        }
+    }
+    if(priv->nb_saves == 0){
+        priv->save_batch_time = av_gettime_relative();
+    }
+    fill_save_info(&priv->saves[priv->nb_saves++], filename, success, segment);
+    if(priv->nb_saves >= priv->save_batch_num || 
+       av_gettime_relative() - priv->save_batch_time >= priv->save_batch_delay){
+        //on failure the save stays in queue
+        flush_saves(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+    }
+    return 0;
+}
+
+/* send the batched saves if the first one has waited for save_batch_delay */
+static int check_saves(IvrWriterPriv * priv)
+{
+    if(priv->nb_saves > 0 && 
+       av_gettime_relative() - priv->save_batch_time >= priv->save_batch_delay){
+        return flush_saves(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+    }
+    return 0;
+}
+
+static int build_lease_post(char * post_data_str, int count)
+{
+    IvrPostBuf pb;
+    
+    post_buf_init(&pb, post_data_str, MAX_POST_STR_LEN + 1);
+    post_buf_printf(&pb, "op=create_batch&content_type=video%%2Fmp2t&count=%d", count);
+    return post_buf_finish(&pb, "lease files");
+}
+
+/* 
+ * add the files in the response of op=create_batch to the lease pool, 
+ * leasing is disabled if the IVR server does not support it
+ */
+static int parse_lease_response(IvrWriterPriv * priv, 
+                                char * http_response_json, int response_size, 
+                                int status_code)
+{
+    const char * json_files;
+    const char * json_file;
+    
+    http_response_json[response_size] = 0;
+    
+    if(status_code == 400 || status_code == 404 || status_code == 405 || status_code == 501){
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] IVR server does not support file lease(status:%d), disable it\n", 
+               status_code);
+        priv->lease_num = 0;
+        return 0;
+    }else if(status_code < 200 || status_code >= 300){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP lease files status code(%d):%s\n", 
+               status_code, http_response_json);
+        return http_status_to_av_code(status_code);
+    }
+    
+    json_files = json_find(http_response_json, IVR_FILES_FIELD_KEY);
+    if(json_files == NULL || *json_files != '['){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json for lease files invalid(%s)\n", http_response_json);
+        return AVERROR(EINVAL);
+    }
+    for(json_file = json_array_first(json_files); 
+        json_file != NULL && priv->nb_leases < priv->lease_num; 
+        json_file = json_array_next(json_file)){
+        IvrLease * lease = &priv->leases[priv->nb_leases];
+        if(json_get_string(json_find(json_file, IVR_NAME_FIELD_KEY), 
+                           lease->filename, MAX_FILE_NAME) >= 0 && 
+           json_get_string(json_find(json_file, IVR_URI_FIELD_KEY), 
+                           lease->file_uri, MAX_URI_LEN) >= 0){
+            priv->nb_leases++;
+        }
+    }
+    return 0;
+}
+
+/* fill the lease pool in a blocking way */
+static int lease_files(IvrWriterPriv * priv, IvrHttpHandle * http, int32_t io_timeout)
+{
+    char post_data_str[MAX_POST_STR_LEN + 1];
+    int status_code = 200;
+    int response_size = MAX_HTTP_RESULT_SIZE - 1;    
+    int ret;
+    
+    if(priv->lease_num == 0 || priv->nb_leases >= priv->lease_num){
+        return 0;
+    }
+    ret = build_lease_post(post_data_str, priv->lease_num - priv->nb_leases);
+    if(ret < 0){
+        return ret;
+    }
+    ret = http_post(http, priv->http_flags, IVR_OP_CREATE,
+                    priv->ivr_rest_uri, 
+                    io_timeout,
+                    NULL, 
+                    post_data_str, strlen(post_data_str), 
+                    &status_code,
+                    http->http_response_buf, &response_size); 
+    if(ret){
+        return ret;
+    }
+    return parse_lease_response(priv, http->http_response_buf, response_size, status_code);
+}
+
+/* take the oldest leased file, return 0 if none */
+static int take_lease(IvrWriterPriv * priv, char * filename, char * file_uri)
+{
+    if(priv->nb_leases == 0){
+        return 0;
+    }
+    av_strlcpy(filename, priv->leases[0].filename, MAX_FILE_NAME);
+    av_strlcpy(file_uri, priv->leases[0].file_uri, MAX_URI_LEN);
+    priv->nb_leases--;
+    memmove(priv->leases, priv->leases + 1, sizeof(IvrLease) * priv->nb_leases);
+    return 1;
+}
+
+static int get_next_dts(IvrWriterPriv * priv,
+                        int32_t io_timeout, 
+                        int64_t * next_dts)
+{
+    char post_data_str[MAX_POST_STR_LEN + 1];
+    char * http_response_json = priv->http.http_response_buf;
+    double value;
+    int ret = 0;
+    int status_code = 200;
+    int response_size = MAX_HTTP_RESULT_SIZE - 1;
+    
+    if(next_dts == NULL){
+        return 0;
+    }
+    
+    //prepare post_data
+    av_strlcpy(post_data_str, "op=next_dts", sizeof(post_data_str));
+
+    //issue HTTP request
+    ret = http_post(&priv->http, priv->http_flags, IVR_OP_OTHER,
+                    priv->ivr_rest_uri, 
+                    io_timeout,
+                    NULL, 
+                    post_data_str, strlen(post_data_str), 
+                    &status_code,
+                    http_response_json, &response_size);
+    if(ret){
+        goto failed;       
+    }
+
+    http_response_json[response_size] = 0;
+    
+    //parse the result
+    if(status_code >= 200 && status_code < 300){
+        if(json_get_number(json_find(http_response_json, IVR_NEXT_DTS_FIELD_KEY), &value) == 0 && 
+           value > 0.1){
+            *next_dts = (int64_t)value;
+        }
+    }else{
+        /* dts correction disabled */
+        goto failed;
+        
+    }
+    
+
+failed:
+    return ret;
+}
+
+
+
+//////////////////////////
+//asynchronous transfers on curl multi interface
+
+typedef enum IvrTransferStage {
+    IVR_STAGE_CREATE = 0,   // POST op=create
+    IVR_STAGE_UPLOAD,       // PUT segment to the file URI
+    IVR_STAGE_FAIL,         // POST op=fail after upload failed
+    IVR_STAGE_LEASE,        // POST op=create_batch to refill the lease pool, no segment
+} IvrTransferStage;
+
+static const IvrHttpOp transfer_ops[] = {
+    [IVR_STAGE_CREATE] = IVR_OP_CREATE,
+    [IVR_STAGE_UPLOAD] = IVR_OP_UPLOAD,
+    [IVR_STAGE_FAIL]   = IVR_OP_SAVE,
+    [IVR_STAGE_LEASE]  = IVR_OP_CREATE,
+};
+
+/* a write of the segment to the local file by uring */
+typedef struct IvrFsWrite {
+    struct IvrTransfer * transfer;
+    int fd;
+    int direct;             // fd is opened with O_DIRECT
+    int64_t offset;
+    struct iovec * iov;
+    int iovcnt;
+    size_t len;
+} IvrFsWrite;
+
+/* the requests for a submitted segment */
+typedef struct IvrTransfer {
+    struct IvrTransfer * next;
+    CachedSegment * segment;
+    CURL * easyhandle;
+    int added;              // easyhandle is added to multi
+    IvrTransferStage stage;
+    int tries;              // tries of the request of current stage
+    int64_t retry_delay;    // in micro-seconds, the last delay before retry
+    int64_t retry_at;       // time to issue the request again, 0 for none
+    int leased;             // file is taken from the lease pool
+    struct curl_slist * headers;
+    HttpBuf http_buf;
+    HttpSegmentReader reader;
+    char err_buf[CURL_ERROR_SIZE];
+    char post_data_str[MAX_POST_STR_LEN + 1];
+    char response_buf[MAX_HTTP_RESULT_SIZE];
+    char filename[MAX_FILE_NAME];
+    char file_uri[MAX_URI_LEN];
+    struct iovec * fs_iov;  // the chunks of segment written by uring
+    IvrFsWrite fs_writes[2];// the O_DIRECT part and the buffered part
+    IvrFsWrite fs_sync;     // fdatasync after the writes, without iov
+    int fs_fd;              // dup of the cached fds, the writes in flight outlive the switch of file
+    int fs_direct_fd;
+    int64_t fs_offset;
+    int fs_pending;         // writes in flight
+    int fs_ret;
+    int fs_synced;          // the sync is issued after the writes
+    struct IvrTransfer * sync_next;  // in priv->sync_transfers
+    int canceled;           // failed with AVERROR_EXIT once the writes in flight finished
+    int fail_ret;           // the upload error, the FAIL stage completes with it
+    int recreate;           // 1 if the FAIL stage goes to CREATE again, 2 after that
+} IvrTransfer;
+
+static CURL * get_idle_handle(IvrWriterPriv * priv)
+{
+    if(priv->nb_idle_handles > 0){
+        return priv->idle_handles[--priv->nb_idle_handles];
+    }
+    return http_handle_init();
+}
+
+/* keep the handle for reuse of its connection */
+static void put_idle_handle(IvrWriterPriv * priv, CURL * easyhandle)
+{
+    if(priv->nb_idle_handles < MAX_IDLE_HANDLES){
+        priv->idle_handles[priv->nb_idle_handles++] = easyhandle;
+    }else{
+        curl_easy_cleanup(easyhandle);
+    }
+}
+
+static void free_transfer(IvrWriterPriv * priv, IvrTransfer * transfer)
+{
+    IvrTransfer ** p = &priv->transfers;
+    
+    while(*p != NULL){
+        if(*p == transfer){
+            *p = transfer->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    if(transfer->easyhandle != NULL){
+        if(transfer->added){
+            curl_multi_remove_handle(priv->multi, transfer->easyhandle);
+        }
+        curl_easy_reset(transfer->easyhandle);
+        put_idle_handle(priv, transfer->easyhandle);
+    }
+    if(transfer->headers != NULL){
+        curl_slist_free_all(transfer->headers);
+    }
+    for(p = &priv->sync_transfers; *p != NULL; p = &(*p)->sync_next){
+        if(*p == transfer){
+            *p = transfer->sync_next;
+            break;
+        }
+    }
+    if(transfer->segment != NULL){
+        if(transfer->fs_fd >= 0){
+            close(transfer->fs_fd);
+        }
+        if(transfer->fs_direct_fd >= 0){
+            close(transfer->fs_direct_fd);
+        }
+    }
+    av_free(transfer->fs_iov);
+    av_free(transfer);
+}
+
+static void finish_transfer(CachedSegmentContext *cseg, IvrTransfer * transfer, int ret)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    CachedSegment * segment = transfer->segment;
+    
+    if(ret == 0){
+        //keep the filename to save at commit
+        ret = set_segment_file(segment, transfer->filename, transfer->leased);
+    }else if(ret < 0 && retry_pause(&priv->retry)){
+        ret = 1; //upload it again after the breaker closed
+    }
+    free_transfer(priv, transfer);
+    cached_segment_complete(cseg, segment, ret);
+}
+
+static int start_transfer_stage(CachedSegmentContext *cseg, IvrTransfer * transfer, 
+                                IvrTransferStage stage);
+
+/* 
+ * the upload failed with ret, fail the file on IVR. The transfer completes with 
+ * the upload error whatever the result of op=fail, the file is never saved
+ */
+static void fail_transfer(CachedSegmentContext *cseg, IvrTransfer * transfer, int ret)
+{
+    transfer->fail_ret = ret;
+    if(start_transfer_stage(cseg, transfer, IVR_STAGE_FAIL) == 0){
+        return;
+    }
+    finish_transfer(cseg, transfer, ret);
+}
+
+/* (re)issue the request of the current stage */
+static int add_transfer(IvrWriterPriv * priv, IvrTransfer * transfer)
+{
+    if(transfer->added){
+        curl_multi_remove_handle(priv->multi, transfer->easyhandle);
+        transfer->added = 0;
+    }
+    strcpy(transfer->err_buf, "unknown");
+    transfer->http_buf.pos = 0;
+    http_segment_reader_rewind(&transfer->reader);
+    if(curl_multi_add_handle(priv->multi, transfer->easyhandle) != CURLM_OK){
+        return AVERROR_EXTERNAL;
+    }
+    transfer->added = 1;
+    return 0;
+}
+
+static int start_transfer_stage(CachedSegmentContext *cseg, IvrTransfer * transfer, 
+                                IvrTransferStage stage)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrSaveInfo save_info;
+    int ret;
+    
+    if(transfer->added){
+        curl_multi_remove_handle(priv->multi, transfer->easyhandle);
+        transfer->added = 0;
+    }
+    if(transfer->headers != NULL){
+        curl_slist_free_all(transfer->headers);
+        transfer->headers = NULL;
+    }
+    transfer->stage = stage;
+    transfer->tries = 0;
+    transfer->retry_delay = 0;
+    transfer->retry_at = 0;
+    transfer->http_buf.buf = transfer->response_buf;
+    transfer->http_buf.buf_size = MAX_HTTP_RESULT_SIZE - 1;
+    transfer->http_buf.pos = 0;
+    memset(&transfer->reader, 0, sizeof(HttpSegmentReader));
+    
+    switch(stage){
+    case IVR_STAGE_CREATE:
+        //no last_file_name, the files are saved in order at commit
+        ret = build_create_post(transfer->post_data_str, transfer->segment, NULL, 
+                                __atomic_load_n(&priv->append_num, __ATOMIC_RELAXED));
+        if(ret < 0){
+            break;
+        }
+        ret = http_post_setup(transfer->easyhandle, priv->http_flags, priv->ivr_rest_uri, 
+                              HTTP_REQUEST_TIMEOUT, NULL, 
+                              transfer->post_data_str, strlen(transfer->post_data_str), 
+                              &transfer->http_buf, transfer->err_buf);
+        break;
+    case IVR_STAGE_UPLOAD:
+        transfer->headers = http_put_headers("video/mp2t", transfer->segment, 
+                                             http_uri_offset(transfer->file_uri), 
+                                             transfer->segment->size);
+        ret = http_put_setup(transfer->easyhandle, priv->http_flags, transfer->file_uri, 
+                             cseg->writer_timeout, transfer->headers, 
+                             &transfer->segment, 1, &transfer->reader, 
+                             transfer->err_buf);
+        break;
+    case IVR_STAGE_LEASE:
+        ret = build_lease_post(transfer->post_data_str, priv->lease_num - priv->nb_leases);
+        if(ret < 0){
+            break;
+        }
+        ret = http_post_setup(transfer->easyhandle, priv->http_flags, priv->ivr_rest_uri, 
+                              HTTP_REQUEST_TIMEOUT, NULL, 
+                              transfer->post_data_str, strlen(transfer->post_data_str), 
+                              &transfer->http_buf, transfer->err_buf);
+        break;
+    case IVR_STAGE_FAIL:
+    default:
+        fill_save_info(&save_info, transfer->filename, 0, NULL);
+        ret = build_save_post(transfer->post_data_str, &save_info);
+        if(ret < 0){
+            break;
+        }
+        ret = http_post_setup(transfer->easyhandle, priv->http_flags, priv->ivr_rest_uri, 
+                              HTTP_REQUEST_TIMEOUT, NULL, 
+                              transfer->post_data_str, strlen(transfer->post_data_str), 
+                              &transfer->http_buf, transfer->err_buf);
+        break;
+    }
+    if(ret){
+        return ret;
+    }
+    if(curl_easy_setopt(transfer->easyhandle, CURLOPT_PRIVATE, transfer)){
+        return AVERROR_EXTERNAL;
+    }
+    return add_transfer(priv, transfer);
+}
+
+#ifdef HAVE_IO_URING
+
+/* 
+ * split the iov at the end of the data which can be written with O_DIRECT, 
+ * the iov array has one more element for the split chunk, 
+ * return the number of iovec in the O_DIRECT part
+ */
+static int split_direct_iov(struct iovec * iov, int * iovcnt, size_t * direct_len)
+{
+    size_t head;
+    int n = 0;
+    
+    *direct_len = 0;
+    while(n < *iovcnt && ((uintptr_t)iov[n].iov_base % FS_DIRECT_ALIGN) == 0 && 
+          (iov[n].iov_len % FS_DIRECT_ALIGN) == 0){
+        *direct_len += iov[n].iov_len;
+        n++;
+    }
+    if(n < *iovcnt && ((uintptr_t)iov[n].iov_base % FS_DIRECT_ALIGN) == 0 && 
+       iov[n].iov_len > FS_DIRECT_ALIGN){
+        //the aligned head of the partial chunk
+        head = iov[n].iov_len - iov[n].iov_len % FS_DIRECT_ALIGN;
+        memmove(iov + n + 2, iov + n + 1, (*iovcnt - n - 1) * sizeof(struct iovec));
+        iov[n + 1].iov_base = (uint8_t *)iov[n].iov_base + head;
+        iov[n + 1].iov_len = iov[n].iov_len - head;
+        iov[n].iov_len = head;
+        *direct_len += head;
+        (*iovcnt)++;
+        n++;
+    }
+    return n;
+}
+
+static void set_fs_write(IvrFsWrite * w, IvrTransfer * transfer, int fd, int direct, 
+                         int64_t offset, struct iovec * iov, int iovcnt, size_t len)
+{
+    w->transfer = transfer;
+    w->fd = fd;
+    w->direct = direct;
+    w->offset = offset;
+    w->iov = iov;
+    w->iovcnt = iovcnt;
+    w->len = len;
+}
+
+/* 
+ * write the segment of transfer to the local file by uring, 
+ * return 0 if the writes are submitted, the transfer goes on at their completion, 
+ * 1 if it should be written synchronously, or a negative AVERROR
+ */
+static int upload_fs_uring(CachedSegmentContext *cseg, IvrTransfer * transfer)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrUring * ring = priv->uring;
+    CachedSegment * segment = transfer->segment;
+    char file_path[MAX_URI_LEN];
+    int64_t offset = 0, reserve_offset = 0, reserve_len;
+    size_t direct_len = 0;
+    int fd, iovcnt, nb_direct = 0, nb_writes, i;
+    int ret = 0;
+    
+    //a fallocate and two writes at most
+    if(segment->size == 0 || segment->nb_chunks >= IOV_MAX || uring_sq_space(ring) < 3){
+        return 1;
+    }
+    transfer->fs_iov = av_malloc(sizeof(struct iovec) * (segment->nb_chunks + 1));
+    if(transfer->fs_iov == NULL){
+        return AVERROR(ENOMEM);
+    }
+    iovcnt = cached_segment_iov(segment, 0, transfer->fs_iov, segment->nb_chunks);
+    parse_cached_file_uri(transfer->file_uri, file_path, MAX_URI_LEN, &offset);
+    
+    pthread_mutex_lock(&priv->fs_lock);
+    fd = get_cached_fd(priv, file_path);
+    if(fd < 0){
+        close_cached_file(priv);
+        pthread_mutex_unlock(&priv->fs_lock);
+        return fd;
+    }
+    reserve_len = cached_file_reserve_range(priv, offset + segment->size, &reserve_offset);
+    if(reserve_len != 0 && !ring->has_fallocate){
+        ret = reserve_cached_file(priv, fd, offset + segment->size);
+        reserve_len = 0;
+    }else if(reserve_len != 0){
+        //the reserve is kept even if the fallocate failed, the write goes on
+        priv->cached_file_reserve_size = reserve_offset + reserve_len;
+    }
+    if(ret == 0){
+        transfer->fs_fd = dup(fd);
+        if(priv->fs_direct && priv->cached_direct_fd >= 0 && (offset % FS_DIRECT_ALIGN) == 0){
+            transfer->fs_direct_fd = dup(priv->cached_direct_fd);
+        }
+        if(transfer->fs_fd < 0){
+            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] dup fs file failed with errno(%d)\n", 
+                   errno);
+            ret = AVERROR(errno);
+        }
+    }
+    //the writes of uring don't move the file position
+    priv->cached_offset = -1;
+    pthread_mutex_unlock(&priv->fs_lock);
+    if(ret < 0){
+        return ret;
+    }
+    
+    if(transfer->fs_direct_fd >= 0){
+        nb_direct = split_direct_iov(transfer->fs_iov, &iovcnt, &direct_len);
+    }
+    nb_writes = 0;
+    if(nb_direct > 0){
+        set_fs_write(&transfer->fs_writes[nb_writes++], transfer, transfer->fs_direct_fd, 1, 
+                     offset, transfer->fs_iov, nb_direct, direct_len);
+    }
+    if(nb_direct < iovcnt){
+        set_fs_write(&transfer->fs_writes[nb_writes++], transfer, transfer->fs_fd, 0, 
+                     offset + direct_len, transfer->fs_iov + nb_direct, iovcnt - nb_direct, 
+                     segment->size - direct_len);
+    }
+    
+    //the linked operations are run in order
+    if(reserve_len != 0){
+        uring_prep_fallocate(ring, transfer->fs_fd, FALLOC_FL_KEEP_SIZE, 
+                             reserve_offset, reserve_len, 0, 1);
+    }
+    for(i = 0; i < nb_writes; i++){
+        uring_prep_writev(ring, transfer->fs_writes[i].fd, 
+                          transfer->fs_writes[i].iov, transfer->fs_writes[i].iovcnt, 
+                          transfer->fs_writes[i].offset, 
+                          (uintptr_t)&transfer->fs_writes[i], i + 1 < nb_writes);
+    }
+    transfer->fs_offset = offset;
+    transfer->fs_pending = nb_writes;
+    transfer->fs_ret = 0;
+    
+    //the sqes refused by kernel are submitted again at reaping
+    uring_submit(ring);
+    return 0;
+}
+
+static void on_fs_fallocate_done(IvrWriterPriv * priv, int res)
+{
+    if(res == 0){
+        return;
+    }
+    pthread_mutex_lock(&priv->fs_lock);
+    if(res == -EOPNOTSUPP || res == -ENOSYS){
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] filesystem or kernel not support fallocate, miss it\n");
+        priv->fallocate_size = 0; //disable fallocate mechanism
+        priv->cached_file_reserve_size = 0;
+    }else{
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] fallocate file failed with errorno(%d)\n", 
+               -res);
+    }
+    pthread_mutex_unlock(&priv->fs_lock);
+}
+
+/* 
+ * make the segment written by uring durable, return 0 if the sync is issued or queued 
+ * for the group commit, the transfer goes on when it completed
+ */
+static int sync_transfer(CachedSegmentContext *cseg, IvrTransfer * transfer)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer ** p;
+    
+    transfer->fs_synced = 1;
+    set_fs_write(&transfer->fs_sync, transfer, transfer->fs_fd, 0, transfer->fs_offset, NULL, 0, 0);
+    if(priv->durability == CSEG_DURABILITY_GROUP){
+        //start writeback at once, the commit finds the data mostly on disk
+        sync_file_range(transfer->fs_fd, transfer->fs_offset, transfer->segment->size, 
+                        SYNC_FILE_RANGE_WRITE);
+        if(priv->sync_transfers == NULL){
+            priv->sync_time = av_gettime_relative() + (int64_t)priv->sync_interval * 1000;
+        }
+        for(p = &priv->sync_transfers; *p != NULL; p = &(*p)->sync_next){
+        }
+        transfer->sync_next = NULL;
+        *p = transfer;
+        return 0;
+    }
+    if(uring_sq_space(priv->uring) == 0){
+        return 1;
+    }
+    uring_prep_fsync(priv->uring, transfer->fs_fd, (uintptr_t)&transfer->fs_sync);
+    transfer->fs_pending = 1;
+    uring_submit(priv->uring);
+    return 0;
+}
+
+/* issue the fdatasync of the transfers waiting for group commit when the interval is up */
+static void commit_fs_syncs(CachedSegmentContext *cseg)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer * transfer;
+    
+    if(priv->sync_transfers == NULL || av_gettime_relative() < priv->sync_time){
+        return;
+    }
+    while((transfer = priv->sync_transfers) != NULL && uring_sq_space(priv->uring) > 0){
+        priv->sync_transfers = transfer->sync_next;
+        transfer->sync_next = NULL;
+        uring_prep_fsync(priv->uring, transfer->fs_fd, (uintptr_t)&transfer->fs_sync);
+        transfer->fs_pending = 1;
+    }
+    uring_submit(priv->uring);
+}
+
+/* a write of transfer completed with res, return 1 if the transfer goes to the next stage */
+static int on_fs_write_done(CachedSegmentContext *cseg, IvrFsWrite * w, int res)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer * transfer = w->transfer;
+    int ret;
+    
+    if(!transfer->canceled && uring_sq_space(priv->uring) > 0){
+        if(res == -EINVAL && w->direct){
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] O_DIRECT write refused by filesystem, miss it\n");
+            priv->fs_direct = 0;
+            w->fd = transfer->fs_fd;
+            w->direct = 0;
+            uring_prep_writev(priv->uring, w->fd, w->iov, w->iovcnt, w->offset, (uintptr_t)w, 0);
+            uring_submit(priv->uring);
+            return 0;
+        }else if(res > 0 && res < w->len){
+            //short write, write the rest
+            w->offset += res;
+            w->len -= res;
+            while(res >= w->iov->iov_len){
+                res -= w->iov->iov_len;
+                w->iov++;
+                w->iovcnt--;
+            }
+            w->iov->iov_base = (uint8_t *)w->iov->iov_base + res;
+            w->iov->iov_len -= res;
+            uring_prep_writev(priv->uring, w->fd, w->iov, w->iovcnt, w->offset, (uintptr_t)w, 0);
+            uring_submit(priv->uring);
+            return 0;
+        }
+    }
+    if(res < 0){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] write fs file failed, %s() failed with errno(%d)\n", 
+                   w->iov != NULL ? "writev" : "fdatasync", -res);
+        transfer->fs_ret = AVERROR(-res);
+    }else if(res < w->len && transfer->fs_ret == 0){
+        transfer->fs_ret = AVERROR(EIO);
+    }
+    if(--transfer->fs_pending > 0){
+        return 0;
+    }
+    
+    ret = transfer->canceled ? AVERROR_EXIT : transfer->fs_ret;
+    if(ret == 0 && priv->durability != CSEG_DURABILITY_NONE && !transfer->fs_synced){
+        //save the file to IVR after its data is durable
+        if(sync_transfer(cseg, transfer) == 0){
+            return 0;
+        }
+        ret = cached_file_sync(transfer->fs_fd, transfer->fs_offset, transfer->segment->size, 
+                               priv->durability, priv->sync_interval);
+    }
+    if(ret){
+        //fail the file, remove it from IVR
+        fail_transfer(cseg, transfer, ret);
+        return 1;
+    }
+    finish_transfer(cseg, transfer, ret);
+    return 1;
+}
+
+/* handle the completed operations of uring, return the number of transfers gone on */
+static int reap_fs_writes(CachedSegmentContext *cseg)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrUring * ring = priv->uring;
+    uint64_t user_data, events;
+    int res, nb_done = 0;
+    
+    if(ring == NULL || ring->nb_inflight == 0){
+        return 0;
+    }
+    //clear the eventfd before the completions are taken, no wakeup is lost
+    while(read(ring->event_fd, &events, sizeof(events)) < 0 && errno == EINTR){
+    }
+    if(*ring->sq_tail != __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)){
+        uring_submit(ring);
+    }
+    while(uring_get_cqe(ring, &user_data, &res)){
+        if(user_data == 0){
+            on_fs_fallocate_done(priv, res);
+        }else{
+            nb_done += on_fs_write_done(cseg, (IvrFsWrite *)(uintptr_t)user_data, res);
+        }
+    }
+    return nb_done;
+}
+
+/* the fd to wait for the completions of uring, -1 if nothing in flight */
+static int fs_writes_event_fd(IvrWriterPriv * priv)
+{
+    return priv->uring != NULL && priv->uring->nb_inflight > 0 ? priv->uring->event_fd : -1;
+}
+
+#else
+
+static int upload_fs_uring(CachedSegmentContext *cseg, IvrTransfer * transfer)
+{
+    return 1;
+}
+
+static void commit_fs_syncs(CachedSegmentContext *cseg)
+{
+}
+
+static int reap_fs_writes(CachedSegmentContext *cseg)
+{
+    return 0;
+}
+
+static int fs_writes_event_fd(IvrWriterPriv * priv)
+{
+    return -1;
+}
+
+#endif
+
+/* upload the segment to the file of transfer, fail the file if upload failed */
+static void upload_transfer(CachedSegmentContext *cseg, IvrTransfer * transfer)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    int ret;
+    
+    if(is_http_uri(transfer->file_uri)){
+        ret = start_transfer_stage(cseg, transfer, IVR_STAGE_UPLOAD);
+        if(ret == 0){
+            return;
+        }
+    }else{
+        ret = 1;
+        if(priv->uring != NULL){
+            ret = upload_fs_uring(cseg, transfer);
+            if(ret == 0){
+                return; //go on when the writes completed
+            }
+        }
+        if(ret > 0){
+            ret = upload_fs_file(priv, transfer->segment, 
+                                 transfer->filename, transfer->file_uri);
+        }
+    }
+    if(ret){
+        //fail the file, remove it from IVR
+        fail_transfer(cseg, transfer, ret);
+        return;
+    }
+    finish_transfer(cseg, transfer, ret);
+}
+
+/* request more files for the lease pool when it runs low */
+static void refill_leases(CachedSegmentContext *cseg)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer * transfer;
+    
+    if(priv->lease_num == 0 || priv->lease_pending || 
+       priv->nb_leases > priv->lease_num / 2){
+        return;
+    }
+    transfer = av_mallocz(sizeof(IvrTransfer));
+    if(transfer == NULL){
+        return;
+    }
+    transfer->easyhandle = get_idle_handle(priv);
+    transfer->next = priv->transfers;
+    priv->transfers = transfer;
+    if(transfer->easyhandle == NULL || 
+       start_transfer_stage(cseg, transfer, IVR_STAGE_LEASE) != 0){
+        free_transfer(priv, transfer);
+        return;
+    }
+    priv->lease_pending = 1;
+}
+
+/* the request of transfer finished with curl_res, go to the next stage */
+static void on_transfer_done(CachedSegmentContext *cseg, IvrTransfer * transfer, CURLcode curl_res)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    const char * method = transfer->stage == IVR_STAGE_UPLOAD ? "PUT" : "POST";
+    IvrErrClass err;
+    long status = 0;
+    int ret = 0;
+    
+    if(curl_res == CURLE_OK && 
+       curl_easy_getinfo(transfer->easyhandle, CURLINFO_RESPONSE_CODE, &status)){
+        ret = AVERROR_EXTERNAL;
+    }
+    err = ret ? IVR_ERR_OTHER : classify_error(curl_res, status);
+    transfer->tries++;
+    if(err != IVR_ERR_NONE && 
+       retry_request(&priv->retry, err, transfer->tries, 
+                     transfer->stage == IVR_STAGE_UPLOAD, &transfer->retry_delay)){
+        //issued again by perform_transfers() when the time is up
+        av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] HTTP %s retry in %d ms(status:%d):%s\n", 
+               method, (int)(transfer->retry_delay / 1000), (int)status, transfer->err_buf);
+        curl_multi_remove_handle(priv->multi, transfer->easyhandle);
+        transfer->added = 0;
+        transfer->retry_at = av_gettime_relative() + transfer->retry_delay;
+        return;
+    }
+    retry_record(&priv->retry, err);
+    if(curl_res != CURLE_OK){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP %s failed:%s\n", 
+               method, transfer->err_buf);        
+        ret = AVERROR_EXTERNAL;
+    }
+    
+    switch(transfer->stage){
+    case IVR_STAGE_CREATE:
+        if(ret == 0){
+            ret = parse_create_response(priv, transfer->response_buf, transfer->http_buf.pos,
+                                        status, transfer->post_data_str, 
+                                        transfer->filename, MAX_FILE_NAME,
+                                        transfer->file_uri, MAX_URI_LEN);
+        }
+        if(ret == IVR_CREATE_WHOLE){
+            //fail the file placed at an offset, then create it again as a whole
+            if(transfer->recreate){
+                fail_transfer(cseg, transfer, AVERROR(EINVAL));
+                return;
+            }
+            transfer->recreate = 1;
+            ret = start_transfer_stage(cseg, transfer, IVR_STAGE_FAIL);
+            if(ret == 0){
+                return;
+            }
+        }
+        if(ret){
+            break;
+        }
+        if(strlen(transfer->filename) == 0 || strlen(transfer->file_uri) == 0){
+            ret = 1; //cannot upload at the moment
+            break;
+        }
+        upload_transfer(cseg, transfer);
+        return;
+        
+    case IVR_STAGE_UPLOAD:
+        if(ret == 0 && (status < 200 || status >= 300)){
+            ret = http_status_to_av_code(status);
+            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] http upload file failed with status(%d)\n", 
+                       (int)status);       
+        }
+        if(ret){
+            //fail the file, remove it from IVR
+            fail_transfer(cseg, transfer, ret);
+            return;
+        }
+        break;
+        
+    case IVR_STAGE_LEASE:
+        if(ret == 0){
+            parse_lease_response(priv, transfer->response_buf, transfer->http_buf.pos, 
+                                 status);
+        }
+        priv->lease_pending = 0;
+        free_transfer(priv, transfer);
+        return;
+        
+    case IVR_STAGE_FAIL:
+    default:
+        if(ret == 0){
+            parse_save_response(priv, transfer->response_buf, transfer->http_buf.pos, 
+                                status);
+        }
+        if(transfer->recreate == 1){
+            transfer->recreate = 2;
+            ret = start_transfer_stage(cseg, transfer, IVR_STAGE_CREATE);
+            if(ret == 0){
+                return;
+            }
+            break;
+        }
+        //the segment is not written whatever op=fail returned
+        ret = transfer->fail_ret;
+        break;
+    }
+    
+    finish_transfer(cseg, transfer, ret);
+}
+
+static int ivr_submit_segment(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer * transfer;
+    int ret;
+    
+    if(breaker_open(&priv->retry)){
+        return 1;
+    }
+    if(segment->writer_data != NULL){
+        //uploaded already, only its save failed, which is retried at commit
+        cached_segment_complete(cseg, segment, 0);
+        return 0;
+    }
+    
+    transfer = av_mallocz(sizeof(IvrTransfer));
+    if(transfer == NULL){
+        return AVERROR(ENOMEM);
+    }
+    transfer->segment = segment;
+    transfer->fs_fd = -1;
+    transfer->fs_direct_fd = -1;
+    transfer->easyhandle = get_idle_handle(priv);
+    transfer->next = priv->transfers;
+    priv->transfers = transfer;
+    if(transfer->easyhandle == NULL){
+        free_transfer(priv, transfer);
+        return AVERROR(ENOMEM);
+    }
+    
+    //upload at once if there is a leased file
+    if(take_lease(priv, transfer->filename, transfer->file_uri)){
+        transfer->leased = 1;
+        refill_leases(cseg);
+        upload_transfer(cseg, transfer);
+        return 0;
+    }
+    refill_leases(cseg);
+    
+    ret = start_transfer_stage(cseg, transfer, IVR_STAGE_CREATE);
+    if(ret){
+        free_transfer(priv, transfer);
+        return ret;
+    }
+    return 0;
+}
+
+/* 
+ * keep the sockets curl waits on, any fd number can be polled, 
+ * unlike the fd_set of curl_multi_fdset()
+ */
+static int ivr_socket_cb(CURL *easyhandle, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )userp;
+    struct pollfd * sockets;
+    int i, size;
+    
+    for(i = 0; i < priv->nb_sockets && priv->sockets[i].fd != fd; i++){
+    }
+    if(what == CURL_POLL_REMOVE){
+        if(i < priv->nb_sockets){
+            priv->sockets[i] = priv->sockets[--priv->nb_sockets];
+        }
+        return 0;
+    }
+    if(i == priv->nb_sockets){
+        if(priv->nb_sockets >= priv->sockets_size){
+            //one more for the eventfd of uring in ready
+            size = priv->sockets_size ? priv->sockets_size * 2 : 8;
+            sockets = av_realloc(priv->sockets, sizeof(struct pollfd) * size);
+            if(sockets == NULL){
+                return -1;
+            }
+            priv->sockets = sockets;
+            sockets = av_realloc(priv->ready, sizeof(struct pollfd) * (size + 1));
+            if(sockets == NULL){
+                return -1;
+            }
+            priv->ready = sockets;
+            priv->sockets_size = size;
+        }
+        priv->sockets[i].fd = fd;
+        priv->nb_sockets++;
+    }
+    priv->sockets[i].events = ((what & CURL_POLL_IN) ? POLLIN : 0) | 
+                              ((what & CURL_POLL_OUT) ? POLLOUT : 0);
+    priv->sockets[i].revents = 0;
+    return 0;
+}
+
+static int ivr_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )userp;
+    
+    priv->curl_timer = timeout_ms < 0 ? 0 : av_gettime_relative() + (int64_t)timeout_ms * 1000;
+    return 0;
+}
+
+/* milliseconds until curl must be called, at most timeout, -1 for none */
+static int curl_timer_timeout(IvrWriterPriv * priv, int timeout)
+{
+    int64_t remain;
+    
+    if(priv->curl_timer == 0){
+        return timeout;
+    }
+    remain = (priv->curl_timer - av_gettime_relative() + 999) / 1000;
+    if(remain < 0){
+        remain = 0;
+    }
+    return timeout < 0 || remain < timeout ? (int)remain : timeout;
+}
+
+/* wait for the socket events of transfers, at most timeout ms */
+static int wait_transfers(IvrWriterPriv * priv, int timeout)
+{
+    int event_fd = fs_writes_event_fd(priv);
+    int nb_fds = priv->nb_sockets;
+    struct pollfd extra_fd;
+    struct pollfd * fds = &extra_fd;
+    
+    if(nb_fds > 0){
+        memcpy(priv->ready, priv->sockets, sizeof(struct pollfd) * nb_fds);
+        fds = priv->ready;
+    }
+    if(event_fd >= 0){
+        //the completions of local file writes
+        fds[nb_fds].fd = event_fd;
+        fds[nb_fds].events = POLLIN;
+        nb_fds++;
+    }
+    timeout = curl_timer_timeout(priv, timeout);
+    if(poll(fds, nb_fds, timeout) < 0 && errno != EINTR){
+        return AVERROR(errno);
+    }
+    return 0;
+}
+
+/* let curl handle the ready sockets and the expired timer */
+static void drive_multi(IvrWriterPriv * priv)
+{
+    int i, nb_fds = priv->nb_sockets;
+    int running, mask;
+    
+    //the callbacks change sockets, the ready ones are handled on the copy
+    if(nb_fds > 0){
+        memcpy(priv->ready, priv->sockets, sizeof(struct pollfd) * nb_fds);
+        if(poll(priv->ready, nb_fds, 0) > 0){
+            for(i = 0; i < nb_fds; i++){
+                if(priv->ready[i].revents == 0){
+                    continue;
+                }
+                mask = ((priv->ready[i].revents & (POLLIN | POLLHUP)) ? CURL_CSELECT_IN : 0) | 
+                       ((priv->ready[i].revents & POLLOUT) ? CURL_CSELECT_OUT : 0) | 
+                       ((priv->ready[i].revents & (POLLERR | POLLNVAL)) ? CURL_CSELECT_ERR : 0);
+                curl_multi_socket_action(priv->multi, priv->ready[i].fd, mask, &running);
+            }
+        }
+    }
+    if(priv->curl_timer != 0 && av_gettime_relative() >= priv->curl_timer){
+        priv->curl_timer = 0;
+        curl_multi_socket_action(priv->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    }
+}
+
+/* drive the transfers and handle the finished requests, return the number of them */
+static int perform_transfers(CachedSegmentContext *cseg)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer * transfer, * next;
+    CURLMsg * msg;
+    int msgs_left;
+    int nb_done = 0;
+    int64_t now = av_gettime_relative();
+    
+    nb_done += reap_fs_writes(cseg);
+    commit_fs_syncs(cseg);
+    
+    //issue the requests to retry
+    for(transfer = priv->transfers; transfer != NULL; transfer = next){
+        next = transfer->next;
+        if(transfer->retry_at != 0 && now >= transfer->retry_at){
+            transfer->retry_at = 0;
+            if(add_transfer(priv, transfer)){
+                on_transfer_done(cseg, transfer, CURLE_FAILED_INIT);
+                nb_done++;
+            }
+        }
+    }
+    
+    drive_multi(priv);
+    while((msg = curl_multi_info_read(priv->multi, &msgs_left)) != NULL){
+        IvrTransfer * transfer = NULL;
+        if(msg->msg != CURLMSG_DONE){
+            continue;
+        }
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+        if(transfer != NULL){
+            http_conn_stat(msg->easy_handle, transfer_ops[transfer->stage], &priv->transfer_stat);
+            on_transfer_done(cseg, transfer, msg->data.result);
+            nb_done++;
+        }
+    }
+    return nb_done;
+}
+
+static int ivr_poll(CachedSegmentContext *cseg, int timeout)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    int ret;
+    
+    IvrTransfer * transfer;
+    int running = 0;
+    int64_t now;
+    
+    //the saves failed are kept and sent again, only fail on the error not to retry
+    ret = check_saves(priv);
+    if(ret < 0 && !retry_pause(&priv->retry)){
+        return ret;
+    }
+    if(priv->transfers == NULL){
+        return 0;
+    }
+    if(perform_transfers(cseg) == 0 && timeout > 0 && priv->transfers != NULL){
+        //wake up for the retry time
+        now = av_gettime_relative();
+        for(transfer = priv->transfers; transfer != NULL; transfer = transfer->next){
+            running += transfer->added;
+            if(transfer->retry_at != 0 && (transfer->retry_at - now) / 1000 < timeout){
+                timeout = FFMAX((transfer->retry_at - now) / 1000, 0) + 1;
+            }
+        }
+        if(priv->sync_transfers != NULL && (priv->sync_time - now) / 1000 < timeout){
+            timeout = FFMAX((priv->sync_time - now) / 1000, 0) + 1;
+        }
+        if(running == 0 && fs_writes_event_fd(priv) < 0){
+            //nothing for curl to wait
+            usleep(timeout * 1000);
+        }else if((ret = wait_transfers(priv, timeout)) < 0){
+            return ret;
         }
-        
-        goto failed;
-      
+        perform_transfers(cseg);
     }
-
-failed:
-    if(json_root){
-        cJSON_Delete(json_root); 
-        json_root = NULL;
-    }       
-    return ret;
+    return 0;
 }
 
-static int get_next_dts(IvrWriterPriv * priv,
-                        int32_t io_timeout, 
-                        int64_t * next_dts)
+/* the descriptors and timeout waited in wait_transfers(), for the shared executor */
+static int ivr_poll_fds(CachedSegmentContext *cseg, struct pollfd *fds, int max_fds, int *timeout)
 {
-    char post_data_str[MAX_POST_STR_LEN + 1];
-    char * http_response_json = priv->http_response_buf;
-    cJSON * json_root = NULL;
-    cJSON * json_next_dts = NULL;      
-    int ret = 0;
-    int status_code = 200;
-    int response_size = MAX_HTTP_RESULT_SIZE - 1;
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer * transfer;
+    int64_t now = av_gettime_relative();
+    int event_fd = fs_writes_event_fd(priv);
+    int nb_fds = priv->nb_sockets;
     
-    if(next_dts == NULL){
+    *timeout = -1;
+    if(priv->transfers == NULL){
         return 0;
     }
+    *timeout = curl_timer_timeout(priv, -1);
+    for(transfer = priv->transfers; transfer != NULL; transfer = transfer->next){
+        if(transfer->retry_at != 0 && (*timeout < 0 || (transfer->retry_at - now) / 1000 < *timeout)){
+            *timeout = FFMAX((transfer->retry_at - now) / 1000, 0) + 1;
+        }
+    }
+    if(priv->sync_transfers != NULL && (*timeout < 0 || (priv->sync_time - now) / 1000 < *timeout)){
+        *timeout = FFMAX((priv->sync_time - now) / 1000, 0) + 1;
+    }
     
-    //prepare post_data
-    snprintf(post_data_str, MAX_POST_STR_LEN, "op=next_dts");  
-
-    post_data_str[MAX_POST_STR_LEN] = 0;
-
-    //issue HTTP request
-    ret = http_post(priv->easyhandle,
-                    priv->ivr_rest_uri, 
-                    io_timeout,
-                    NULL, 
-                    post_data_str, strlen(post_data_str), 
-                    HTTP_DEFAULT_RETRY_NUM,
-                    &status_code,
-                    http_response_json, &response_size);
-    if(ret){
-        goto failed;       
+    memcpy(fds, priv->sockets, sizeof(struct pollfd) * FFMIN(nb_fds, max_fds));
+    if(event_fd >= 0){
+        if(nb_fds < max_fds){
+            fds[nb_fds].fd = event_fd;
+            fds[nb_fds].events = POLLIN;
+        }
+        nb_fds++;
     }
+    return nb_fds;
+}
 
-    http_response_json[response_size] = 0;
+static void ivr_cancel(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrTransfer * transfer;
     
-    //parse the result
-    if(status_code >= 200 && status_code < 300){
-        json_root = cJSON_Parse(http_response_json);
-        if(json_root== NULL){
-            ret = AVERROR(EINVAL);
-            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] HTTP response Json parse failed(%s)\n", http_response_json);
-            goto failed;
+    for(transfer = priv->transfers; transfer != NULL; transfer = transfer->next){
+        if(transfer->segment == segment){
+            if(transfer->fs_pending > 0){
+                //the writes use the chunks of segment
+                transfer->canceled = 1;
+            }else if(transfer->stage == IVR_STAGE_UPLOAD){
+                //the file is created, fail it not to be left on IVR
+                fail_transfer(cseg, transfer, AVERROR_EXIT);
+            }else if(transfer->stage != IVR_STAGE_FAIL){
+                finish_transfer(cseg, transfer, AVERROR_EXIT);
+            }
+            break;
         }
-        json_next_dts = cJSON_GetObjectItem(json_root, IVR_NEXT_DTS_FIELD_KEY);
-        if(json_next_dts && json_next_dts->type == cJSON_Number && json_next_dts->valuedouble > 0.1){
-            *next_dts = (int64_t)json_next_dts->valuedouble;
+    }
+}
+
+static void free_http_handles(IvrWriterPriv * priv)
+{
+    int i;
+    
+    if(priv->http.easyhandle != NULL){
+        curl_easy_cleanup(priv->http.easyhandle); 
+        priv->http.easyhandle = NULL;
+    }
+    for(i = 0; i < priv->nb_upload_http; i++){
+        if(priv->upload_http[i].easyhandle != NULL){
+            curl_easy_cleanup(priv->upload_http[i].easyhandle); 
+            priv->upload_http[i].easyhandle = NULL;
         }
-    }else{
-        /* dts correction disabled */
-        goto failed;
-        
     }
+    av_freep(&priv->upload_http);
+    priv->nb_upload_http = 0;
     
-
-failed:
-    if(json_root){
-        cJSON_Delete(json_root); 
-        json_root = NULL;
+    if(priv->multi != NULL){
+        while(priv->transfers != NULL){
+            free_transfer(priv, priv->transfers);
+        }
+        curl_multi_cleanup(priv->multi);
+        priv->multi = NULL;
     }
-       
-    return ret;
+    av_freep(&priv->sockets);
+    av_freep(&priv->ready);
+    priv->nb_sockets = priv->sockets_size = 0;
+    for(i = 0; i < priv->nb_idle_handles; i++){
+        curl_easy_cleanup(priv->idle_handles[i]);
+    }
+    priv->nb_idle_handles = 0;
 }
 
-
-
 static int ivr_init(CachedSegmentContext *cseg)
 {
     int ret = 0; 
@@ -836,7 +3761,7 @@ static int ivr_init(CachedSegmentContext *cseg)
     IvrWriterPriv * priv = NULL;
 
     //init curl lib
-    curl_global_init(CURL_GLOBAL_ALL); 
+    pthread_once(&ivr_curl_once, ivr_curl_global_init); 
     
     //check filename
     if(cseg->filename == NULL || strlen(cseg->filename) == 0){
@@ -856,6 +3781,8 @@ static int ivr_init(CachedSegmentContext *cseg)
         ret = AVERROR(ENOMEM);
         goto fail;
     }
+    retry_policy_init(&priv->retry);
+    priv->http.policy = &priv->retry;
 
     // ivr_rest_uri
     strcpy((char *)priv->ivr_rest_uri, "http"); 
@@ -868,33 +3795,110 @@ static int ivr_init(CachedSegmentContext *cseg)
         goto fail;
     }  
 
-    priv->easyhandle = curl_easy_init();
-    if(priv->easyhandle == NULL){
+    priv->http.easyhandle = http_handle_init();
+    if(priv->http.easyhandle == NULL){
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    
+    //each upload worker has its own curl handle
+    if(cseg->nb_upload_workers > 1){
+        int i;
+        priv->upload_http = av_mallocz(sizeof(IvrHttpHandle) * cseg->nb_upload_workers);
+        if(priv->upload_http == NULL){
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        priv->nb_upload_http = cseg->nb_upload_workers;
+        for(i = 0; i < priv->nb_upload_http; i++){
+            priv->upload_http[i].easyhandle = http_handle_init();
+            priv->upload_http[i].policy = &priv->retry;
+            if(priv->upload_http[i].easyhandle == NULL){
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+        }
+    }
+    priv->multi = curl_multi_init();
+    if(priv->multi == NULL){
         ret = AVERROR(ENOMEM);
         goto fail;
     }
+    //driven by curl_multi_socket_action() on the sockets and timer it reports
+    curl_multi_setopt(priv->multi, CURLMOPT_SOCKETFUNCTION, ivr_socket_cb);
+    curl_multi_setopt(priv->multi, CURLMOPT_SOCKETDATA, priv);
+    curl_multi_setopt(priv->multi, CURLMOPT_TIMERFUNCTION, ivr_timer_cb);
+    curl_multi_setopt(priv->multi, CURLMOPT_TIMERDATA, priv);
+    priv->http_flags = (cseg->http2 ? IVR_HTTP_HTTP2 : 0) | 
+                       (cseg->http_verbose ? IVR_HTTP_VERBOSE : 0);
+    priv->http_stat_level = cseg->http_stat_level;
+    priv->append_num = cseg->http_append_num;
+#ifdef CURLPIPE_MULTIPLEX
+    if(priv->http_flags & IVR_HTTP_HTTP2){
+        curl_multi_setopt(priv->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+#endif
+    pthread_mutex_init(&priv->fs_lock, NULL);
     
     priv->fallocate_size = cseg->fallocate_size;
     priv->cached_fd = -1;
+    priv->cached_direct_fd = -1;
+    priv->durability = cseg->durability;
+    priv->sync_interval = cseg->sync_interval;
+    
+    //only the asynchronous transfers write the local files by uring, 
+    //each has a fallocate and two writes at most
+    if(cseg->fs_uring && cseg->max_inflight > 1){
+        priv->uring = uring_init(cseg->max_inflight * 3);
+        if(priv->uring == NULL){
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] io_uring unavailable, write local files synchronously\n");
+        }else{
+            priv->fs_direct = cseg->fs_direct;
+        }
+    }
+    
+    //leased files are only taken by the asynchronous submission and streaming, 
+    //which always needs one
+    if((cseg->lease_num > 0 && cseg->max_inflight > 1) || cseg->stream){
+        priv->lease_num = FFMAX(cseg->lease_num, 1);
+        priv->leases = av_mallocz(sizeof(IvrLease) * priv->lease_num);
+        if(priv->leases == NULL){
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+    if(cseg->save_batch_num > 1){
+        priv->saves = av_mallocz(sizeof(IvrSaveInfo) * cseg->save_batch_num);
+        if(priv->saves == NULL){
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        priv->saves_size = cseg->save_batch_num;
+        priv->save_batch_num = cseg->save_batch_num;
+        priv->save_batch_delay = (int64_t)(cseg->save_batch_delay * 1000000);
+    }
     
     cseg->writer_priv = priv;    
     
     get_next_dts(priv, HTTP_REQUEST_TIMEOUT, &cseg->correct_start_dts);
     
+    //lease files ahead, the first segments don't wait for op=create
+    lease_files(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+    
     return 0;
     
 fail:
  
     if(priv != NULL){  
-        if(priv->easyhandle != NULL){
-            curl_easy_cleanup(priv->easyhandle); 
-            priv->easyhandle = NULL;
-        }
+        uring_free(priv->uring);
+        free_http_handles(priv);
+        av_freep(&priv->leases);
+        av_freep(&priv->saves);
+        pthread_mutex_destroy(&priv->retry.lock);
         av_free(priv);
         priv = NULL;
     }
     
-    curl_global_cleanup();
     return ret;       
 }
 
@@ -907,9 +3911,19 @@ static int ivr_write_segment(CachedSegmentContext *cseg, CachedSegment *segment)
     char *p;
     int ret = 0;
 
+    if(breaker_open(&priv->retry)){
+        return 1;
+    }
+    
+    //the batched saves go before the last file saved by op=create
+    ret = flush_saves(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+    if(ret){
+        goto fail;
+    }
     
     //get URI of the file for segment
-    ret = create_file(priv, 
+    ret = create_file(priv, &priv->http, 
+                      priv->last_filename,
                       HTTP_REQUEST_TIMEOUT,
                       segment, 
                       filename, MAX_FILE_NAME,
@@ -929,7 +3943,7 @@ static int ivr_write_segment(CachedSegmentContext *cseg, CachedSegment *segment)
     }else{    
         
         //upload segment to the file URI
-        ret = upload_file(priv, segment, 
+        ret = upload_file(priv, &priv->http, segment, 
                           cseg->writer_timeout,
                           filename,
                           file_uri);                      
@@ -939,9 +3953,9 @@ static int ivr_write_segment(CachedSegmentContext *cseg, CachedSegment *segment)
 
         }else{
             //fail the file, remove it from IVR
-            ret = save_file(priv, 
+            ret = save_file(priv, &priv->http, 
                             HTTP_REQUEST_TIMEOUT,
-                            filename, 0);
+                            filename, 0, NULL);
             priv->last_filename[0] = 0;
     
         }//if(ret == 0){
@@ -952,7 +3966,378 @@ static int ivr_write_segment(CachedSegmentContext *cseg, CachedSegment *segment)
     }  
 
 fail:
-   
+    if(ret < 0 && retry_pause(&priv->retry)){
+        ret = 1; //pause the writer instead of failing on the unavailable server
+    }
+    return ret;
+}
+
+typedef struct IvrBatchFile {
+    char filename[MAX_FILE_NAME];
+    char file_uri[MAX_URI_LEN];
+    int ret;    // result of upload
+} IvrBatchFile;
+
+/* write the data of segments[start, end) which are placed contiguously in one fs file */
+static int upload_fs_run(IvrWriterPriv * priv, CachedSegment **segments, IvrBatchFile *files, 
+                         int start, int end)
+{
+    int64_t run_size = 0;
+    int fd, i, ret;
+    
+    for(i = start; i < end; i++){
+        run_size += segments[i]->size;
+    }
+    pthread_mutex_lock(&priv->fs_lock);
+    fd = open_cached_file(priv, files[start].filename, files[start].file_uri, run_size);
+    if(fd < 0) {
+        ret = fd;
+    }else{
+        ret = write_segments_fd(fd, segments + start, end - start);   
+        if(ret < 0) {
+            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] write fs file failed, writev() failed with errno(%d)\n", 
+                       AVUNERROR(ret));
+        }else{
+            priv->cached_offset += run_size;
+            ret = sync_cached_write(priv, fd, priv->cached_offset - run_size, run_size);
+        }
+    }
+    pthread_mutex_unlock(&priv->fs_lock);
+    
+    for(i = start; i < end; i++){
+        files[i].ret = ret;
+    }
+    return ret;
+}
+
+/* PUT the segments[start, end) placed contiguously in one HTTP object by a single request */
+static int upload_http_run(IvrWriterPriv * priv, int32_t io_timeout, 
+                           CachedSegment **segments, IvrBatchFile *files, 
+                           int start, int end)
+{
+    int status_code = 200;
+    int i, ret;
+    
+    ret = http_put(&priv->http, priv->http_flags, IVR_OP_UPLOAD, 
+                   files[start].file_uri, io_timeout, "video/mp2t",
+                   segments + start, end - start, http_uri_offset(files[start].file_uri), 
+                   &status_code);
+    if(ret == 0 && (status_code < 200 || status_code >= 300)){
+        ret = http_status_to_av_code(status_code);
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] http upload %d segments failed with status(%d)\n", 
+               end - start, status_code);
+    }
+    
+    for(i = start; i < end; i++){
+        files[i].ret = ret;
+    }
+    return ret;
+}
+
+/* 
+ * write the ready segments at once when the consumer falls behind. 
+ * The files are created in order first, and the data of the ones placed 
+ * contiguously in the same fs file or HTTP object are written by a single 
+ * writev() or PUT. 
+ * Only the first file is created with last_file_name, because the previous 
+ * one must not be saved until its data is written, so the files except 
+ * the last one are saved explicitly.
+ */
+static int ivr_write_segments(CachedSegmentContext *cseg, CachedSegment **segments, int nb_segments, 
+                              int *nb_written)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrBatchFile * files = NULL;
+    char path[MAX_URI_LEN], run_path[MAX_URI_LEN];
+    int64_t offset, run_end = 0;
+    int nb_created = 0, run_start = -1, run_http = 0, http;
+    int i, ret = 0, create_ret = 0;
+    int nb_done;
+    
+    *nb_written = 0;
+    if(breaker_open(&priv->retry)){
+        return 1;
+    }
+    if(nb_segments == 1){
+        ret = ivr_write_segment(cseg, segments[0]);
+        *nb_written = (ret == 0);
+        return ret;
+    }
+    
+    files = av_mallocz(sizeof(IvrBatchFile) * nb_segments);
+    if(files == NULL){
+        return AVERROR(ENOMEM);
+    }
+    
+    //create the files
+    for(i = 0; i < nb_segments; i++){
+        create_ret = create_file(priv, &priv->http, 
+                                 i == 0 ? priv->last_filename : NULL, 
+                                 HTTP_REQUEST_TIMEOUT,
+                                 segments[i], 
+                                 files[i].filename, MAX_FILE_NAME,
+                                 files[i].file_uri, MAX_URI_LEN);
+        priv->last_filename[0] = 0;
+        if(create_ret == 0 && 
+           (strlen(files[i].filename) == 0 || strlen(files[i].file_uri) == 0)){
+            create_ret = 1; //cannot upload at the moment
+        }
+        if(create_ret){
+            break;
+        }
+        nb_created++;
+    }
+    
+    //upload the data, gather the contiguous fs files or ranges of HTTP object
+    for(i = 0; i < nb_created; i++){
+        http = is_http_uri(files[i].file_uri);
+        parse_cached_file_uri(files[i].file_uri, path, MAX_URI_LEN, &offset);
+        if(http){
+            offset = http_uri_offset(files[i].file_uri);
+        }
+        if(run_start >= 0 && 
+           (http != run_http || offset < 0 || strcmp(path, run_path) != 0 || offset != run_end)){
+            if(run_http){
+                upload_http_run(priv, cseg->writer_timeout, segments, files, run_start, i);
+            }else{
+                upload_fs_run(priv, segments, files, run_start, i);
+            }
+            run_start = -1;
+        }
+        if(offset < 0){
+            //a whole HTTP object
+            files[i].ret = upload_file(priv, &priv->http, segments[i], 
+                                       cseg->writer_timeout,
+                                       files[i].filename,
+                                       files[i].file_uri);
+            continue;
+        }
+        if(run_start < 0){
+            run_start = i;
+            run_http = http;
+            av_strlcpy(run_path, path, MAX_URI_LEN);
+            run_end = offset;
+        }
+        run_end += segments[i]->size;
+    }
+    if(run_start >= 0){
+        if(run_http){
+            upload_http_run(priv, cseg->writer_timeout, segments, files, run_start, nb_created);
+        }else{
+            upload_fs_run(priv, segments, files, run_start, nb_created);
+        }
+    }
+    
+    //save the uploaded files in order up to the first failure, a save in queue is 
+    //sent later, so its segment is written
+    for(i = 0; i < nb_created && files[i].ret == 0; i++){
+        if(i == nb_created - 1){
+            //store the last successful filename to send at next create
+            strcpy(priv->last_filename, files[i].filename);
+            ret = 0;
+        }else{
+            ret = queue_save(priv, files[i].filename, 1, NULL);
+        }
+        if(ret){
+            break;
+        }
+    }
+    nb_done = i;
+    *nb_written = nb_done;
+    if(ret == 0 && nb_done < nb_created){
+        ret = files[nb_done].ret;
+    }
+    if(ret == 0 && nb_created < nb_segments){
+        ret = create_ret;
+    }
+    //decide before the fails below are sent, their success resets the failures
+    if(ret < 0 && retry_pause(&priv->retry)){
+        ret = 1;
+    }
+    
+    //the files after are failed, not to be orphaned on IVR, their segments are written again
+    for(i = nb_done; i < nb_created; i++){
+        if(queue_save(priv, files[i].filename, 0, NULL)){
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] fail file %s not accepted, left on IVR\n", 
+                   files[i].filename);
+        }
+    }
+    //on failure the saves stay in queue and are sent again before the next create
+    flush_saves(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+    
+    av_free(files);
+    return ret;
+}
+
+/* 
+ * called by upload workers in parallel, the file is created without last_file_name 
+ * because the previous one may be not finished, and saved later by ivr_commit_segment
+ */
+static int ivr_upload_segment(CachedSegmentContext *cseg, CachedSegment *segment, int worker)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrHttpHandle * http = &priv->upload_http[worker];
+    char file_uri[MAX_URI_LEN];
+    char filename[MAX_FILE_NAME];
+    int ret = 0;
+    
+    if(breaker_open(&priv->retry)){
+        return 1;
+    }
+    if(segment->writer_data != NULL){
+        //uploaded already, only its save failed, which is retried at commit
+        return 0;
+    }
+    
+    ret = create_file(priv, http, NULL, 
+                      HTTP_REQUEST_TIMEOUT,
+                      segment, 
+                      filename, MAX_FILE_NAME,
+                      file_uri, MAX_URI_LEN);
+    if(ret){
+        goto fail;
+    }
+    if(strlen(filename) == 0 || strlen(file_uri) == 0){
+        return 1; //cannot upload at the moment
+    }
+    
+    ret = upload_file(priv, http, segment, 
+                      cseg->writer_timeout,
+                      filename,
+                      file_uri);  
+    if(ret){
+        //fail the file, remove it from IVR
+        ret = save_file(priv, http, 
+                        HTTP_REQUEST_TIMEOUT,
+                        filename, 0, NULL);
+        goto fail;
+    }
+    
+    //keep the filename to save at commit
+    return set_segment_file(segment, filename, 0);
+    
+fail:
+    if(ret < 0 && retry_pause(&priv->retry)){
+        ret = 1;
+    }
+    return ret;
+}
+
+/* save the uploaded files in sequence order */
+static int ivr_commit_segment(CachedSegmentContext *cseg, CachedSegment *segment, int upload_ret)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    int ret = upload_ret;
+    
+    if(upload_ret == 0 && segment->writer_data != NULL){
+        IvrSegmentFile * file = (IvrSegmentFile *)segment->writer_data;
+        ret = queue_save(priv, file->filename, 1, 
+                         file->leased ? segment : NULL);
+        if(ret < 0 && retry_pause(&priv->retry)){
+            //the file is kept, only its save is retried after the breaker closed
+            return 1;
+        }
+    }else if(segment->writer_data != NULL){
+        //the upload is discarded at exit, fail its file not to be left on IVR, 
+        //the fail in queue is sent at uninit at last
+        IvrSegmentFile * file = (IvrSegmentFile *)segment->writer_data;
+        if(queue_save(priv, file->filename, 0, NULL)){
+            av_log(NULL, AV_LOG_WARNING,  "[cseg_ivr_writer] fail file %s not accepted, left on IVR\n", 
+                   file->filename);
+        }
+    }
+    av_freep(&segment->writer_data);
+    
+    return ret;
+}
+
+/* 
+ * upload the segment being recorded to a leased file, 
+ * the info of segment is sent by op=save at finish
+ */
+static int ivr_stream_segment(CachedSegmentContext *cseg, CachedSegment *segment)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    char file_uri[MAX_URI_LEN];
+    char filename[MAX_FILE_NAME];
+    int status_code = 200;
+    int32_t io_timeout = cseg->writer_timeout;
+    int ret = 0;
+    
+    av_freep(&segment->writer_data);
+    if(breaker_open(&priv->retry)){
+        return AVERROR(EAGAIN);
+    }
+    if(!take_lease(priv, filename, file_uri)){
+        ret = lease_files(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+        if(ret){
+            return ret;
+        }
+        if(!take_lease(priv, filename, file_uri)){
+            return AVERROR(ENOSYS); //IVR server does not support file lease
+        }
+    }
+    if(!is_http_uri(file_uri)){
+        //the cached file on fs is written as a whole
+        save_file(priv, &priv->http, HTTP_REQUEST_TIMEOUT, filename, 0, NULL);
+        return AVERROR(ENOSYS);
+    }
+    
+    //the request lasts as long as the segment, which is about cseg_time
+    if(io_timeout > 0){
+        io_timeout += (int32_t)(cseg->time * 2000);
+    }
+    ret = http_put_stream(&priv->http, priv->http_flags, 
+                          file_uri, io_timeout, "video/mp2t",
+                          cseg, segment, 
+                          &status_code);
+    if(ret == 0 && (status_code < 200 || status_code >= 300)){
+        av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] http stream file failed with status(%d)\n", 
+               status_code);
+        ret = http_status_to_av_code(status_code);
+    }
+    if(ret){
+        //fail the file, the segment is uploaded again at finish
+        save_file(priv, &priv->http, HTTP_REQUEST_TIMEOUT, filename, 0, NULL);
+        return ret;
+    }
+    return set_segment_file(segment, filename, 1);
+}
+
+/* save the streamed file with the final info of segment, or upload the segment as a whole */
+static int ivr_finish_segment(CachedSegmentContext *cseg, CachedSegment *segment, int stream_ret)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;   
+    IvrSegmentFile * file = (IvrSegmentFile *)segment->writer_data;
+    int ret = 0;
+    
+    if(stream_ret < 0 || file == NULL){
+        av_freep(&segment->writer_data);
+        return segment->dropped ? 0 : ivr_write_segment(cseg, segment);
+    }
+    
+    if(segment->dropped){
+        ret = save_file(priv, &priv->http, HTTP_REQUEST_TIMEOUT, 
+                        file->filename, 0, NULL);
+    }else{
+        //the last file of op=create is saved first to keep the order
+        if(strlen(priv->last_filename) != 0){
+            ret = queue_save(priv, priv->last_filename, 1, NULL);
+            if(ret){
+                goto fail;
+            }
+            priv->last_filename[0] = 0;
+        }
+        ret = queue_save(priv, file->filename, 1, segment);
+    }
+    
+fail:
+    if(ret < 0 && retry_pause(&priv->retry)){
+        ret = 1; //save it again after the breaker closed
+    }
+    if(ret == 0){
+        av_freep(&segment->writer_data);
+    }
     return ret;
 }
 
@@ -960,27 +4345,86 @@ static void ivr_uninit(CachedSegmentContext *cseg)
 {
     
     IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;    
+    HttpConnStat stat;
+    int i;
+    
     if(priv != NULL){
+        flush_saves(priv, &priv->http, HTTP_REQUEST_TIMEOUT);
+        if(priv->nb_saves > 0){
+            av_log(NULL, AV_LOG_ERROR,  "[cseg_ivr_writer] %d uploaded files are not saved at exit\n", 
+                   priv->nb_saves);
+        }
         if(strlen(priv->last_filename) != 0){
             //save the last file
-            save_file(priv, HTTP_REQUEST_TIMEOUT, 
-                      priv->last_filename, 1);   
+            save_file(priv, &priv->http, HTTP_REQUEST_TIMEOUT, 
+                      priv->last_filename, 1, NULL);   
             priv->last_filename[0] = 0;
         }
+        
+        //the leased files not used are removed from IVR
+        while(priv->nb_leases > 0){
+            priv->nb_leases--;
+            save_file(priv, &priv->http, HTTP_REQUEST_TIMEOUT, 
+                      priv->leases[priv->nb_leases].filename, 0, NULL);
+        }
 
-        if(priv->easyhandle != NULL){
-            curl_easy_cleanup(priv->easyhandle); 
-            priv->easyhandle = NULL;
+        memset(&stat, 0, sizeof(HttpConnStat));
+        add_conn_stat(&stat, &priv->http.stat);
+        add_conn_stat(&stat, &priv->transfer_stat);
+        for(i = 0; i < priv->nb_upload_http; i++){
+            add_conn_stat(&stat, &priv->upload_http[i].stat);
         }
+        if(stat.nb_requests > 0){
+            av_log(NULL, AV_LOG_INFO, 
+                   "[cseg_ivr_writer] %d HTTP requests, %d connects(avg %.1f ms), %d TLS handshakes(avg %.1f ms)\n", 
+                   stat.nb_requests, 
+                   stat.nb_connects, 
+                   stat.nb_connects ? stat.connect_time * 1000 / stat.nb_connects : 0.0, 
+                   stat.nb_tls_handshakes, 
+                   stat.nb_tls_handshakes ? stat.tls_handshake_time * 1000 / stat.nb_tls_handshakes : 0.0);
+            log_op_stat(priv->http_stat_level, &stat);
+        }
+        if(priv->retry.nb_retries > 0 || priv->retry.nb_opens > 0){
+            av_log(NULL, AV_LOG_INFO, "[cseg_ivr_writer] %d HTTP retries, circuit breaker opened %d times\n", 
+                   priv->retry.nb_retries, priv->retry.nb_opens);
+        }
+
+        uring_free(priv->uring);
+        priv->uring = NULL;
+        free_http_handles(priv);
         close_cached_file(priv);
+        pthread_mutex_destroy(&priv->fs_lock);
+        av_freep(&priv->leases);
+        av_freep(&priv->saves);
+        pthread_mutex_destroy(&priv->retry.lock);
         
         av_free(priv);  
         cseg->writer_priv = NULL;      
     }     
+}
+
+
+/* 
+ * the file uploaded last is saved along with the next op=create, 
+ * so it is kept in journal to be saved after restart
+ */
+static int ivr_save_state(CachedSegmentContext *cseg, char *state, int state_size)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;
     
-    curl_global_cleanup();
+    av_strlcpy(state, priv->last_filename, state_size);
+    return 0;
 }
 
+static void ivr_restore_state(CachedSegmentContext *cseg, const char *state)
+{
+    IvrWriterPriv * priv = (IvrWriterPriv * )cseg->writer_priv;
+    
+    if(strlen(state) != 0){
+        av_log(NULL, AV_LOG_INFO, "[cseg_ivr_writer] resume last file %s from journal\n", state);
+    }
+    av_strlcpy(priv->last_filename, state, MAX_FILE_NAME);
+}
 
 CachedSegmentWriter cseg_ivr_writer = {
     .name           = "ivr_writer",
@@ -989,5 +4433,17 @@ CachedSegmentWriter cseg_ivr_writer = {
     .init           = ivr_init, 
     .write_segment  = ivr_write_segment, 
     .uninit         = ivr_uninit,
+    .upload_segment = ivr_upload_segment, 
+    .commit_segment = ivr_commit_segment, 
+    .capabilities   = CSEG_WRITER_CAP_ASYNC | CSEG_WRITER_CAP_BATCH | CSEG_WRITER_CAP_STREAM, 
+    .write_segments = ivr_write_segments, 
+    .submit_segment = ivr_submit_segment, 
+    .poll           = ivr_poll, 
+    .poll_fds       = ivr_poll_fds, 
+    .cancel         = ivr_cancel, 
+    .stream_segment = ivr_stream_segment, 
+    .finish_segment = ivr_finish_segment, 
+    .save_state     = ivr_save_state, 
+    .restore_state  = ivr_restore_state, 
 };
 